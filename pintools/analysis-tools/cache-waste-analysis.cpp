@@ -3,14 +3,18 @@
  * The trace has the following format:
  * <access_type> <tid> <addr> <size> <func> <access_source> <alloc_source> <name> <type>
  *
- * It runs the trace through a very simple cache simulator, whose size, associativity
- * and the block-size can be configured via command line options, and for each evicted
+ * It runs the trace through a simple cache simulator and for each evicted
  * cache line outputs a record showing:
  * - The number of bytes that were used in that cache line between the time it was
  *   created and evicted.
  * - The number of times the cache line was reused. 
  * - The source code location, which caused this cache line to be created in the cache.
  * - The information on the variable that was accessed upon the faulting access. 
+ *
+ * The simulated cache is either a single level, whose size, associativity
+ * and the block-size can be configured via command line options, or a
+ * hierarchy of levels (e.g., L1D -> L2 -> LLC), each with its own geometry
+ * and replacement policy. Waste is reported separately for every level.
  */
 
 #include <sys/types.h>
@@ -21,17 +25,24 @@
 #include <string>
 #include <sys/time.h>
 #include <stdio.h>
+#include <string.h>
 #include <sstream> 
 #include <map>
 #include <utility>
 #include <bitset>
 #include <unistd.h>
+#include <getopt.h>
 #include <sys/syscall.h>
 #include <ctgmath>
 #include <stdlib.h>
 #include <algorithm>
 #include <unordered_map>
 #include <tuple>
+#include <set>
+#include <vector>
+#include <signal.h>
+
+#include "trace-stream.hpp"
 
 using namespace std;
 
@@ -53,8 +64,9 @@ const float LOW_UTIL_THRESHOLD = 0.5;
 
 /* These values are computed once the cache parameters are set */
 int lineOffsetBits;
-int indexBits;
-int tagMaskBits;
+/* Set if we simulate more than one cache (several levels or several
+ * cores), so that we label the output with the name of the cache. */
+bool MULTIPLE_CACHES = false;
 
 /* The following data structures are used to summarize
  * the cache waste per source location. 
@@ -68,7 +80,7 @@ public:
     WasteRecord(string vI = "", size_t addr=0)
 	: varInfo(vI), address(addr){}
 };
-    
+
 
 class ZeroReuseRecord: public WasteRecord
 {
@@ -81,8 +93,9 @@ public:
 
     friend std::ostream& operator<< (std::ostream& stream, const ZeroReuseRecord& zrr)
 	{
-	    cout << "\t" << zrr.varInfo << endl;
-	    cout << "\t0x" << hex << zrr.address << dec << endl;
+	    stream << "\t" << zrr.varInfo << endl;
+	    stream << "\t0x" << hex << zrr.address << dec << endl;
+	    return stream;
 	}
 };
 
@@ -100,19 +113,349 @@ public:
 
     friend std::ostream& operator<< (std::ostream& stream, const LowUtilRecord& lur)
 	{
-	    cout << "\t--------------------------------------------" << endl;
-	    cout << "\t" << lur.varInfo << endl;
-	    cout << "\t0x" << hex << lur.address << dec << endl;
-	    cout << "\t" << lur.byteUseCount << "/" << CACHE_LINE_SIZE << endl;
+	    stream << "\t--------------------------------------------" << endl;
+	    stream << "\t" << lur.varInfo << endl;
+	    stream << "\t0x" << hex << lur.address << dec << endl;
+	    stream << "\t" << lur.byteUseCount << "/" << CACHE_LINE_SIZE << endl;
+	    return stream;
+	}
+
+};
+
+/* A bounded summary of the waste records of one kind, grouped by
+ * source code line (access site).
+ *
+ * We don't keep every waste record: on long traces that takes tens
+ * of gigabytes. Instead, for every site we keep the number of waste
+ * occurrences, the total number of bytes used in the wasted lines and
+ * a reservoir sample of up to EXAMPLES_PER_SITE waste records.
+ *
+ * The number of sites we track is bounded by TOP_K_CAPACITY using the
+ * Space-Saving algorithm (Metwally et al., ICDT 2005). As long as there
+ * are fewer sites than that, the counts are exact. Once the table is
+ * full, a new site replaces the site with the smallest count and
+ * inherits that count as its possible overestimation error. Any site
+ * whose true count is above 1/TOP_K_CAPACITY of all occurrences is
+ * guaranteed to stay in the table.
+ */
+int TOP_K_CAPACITY = 1000;
+int EXAMPLES_PER_SITE = 8;
+
+template <class T>
+class WasteSummary
+{
+public:
+    class SiteSummary
+    {
+    public:
+	string accessSite;
+	size_t count;        /* waste occurrences, overestimated by at most error */
+	size_t error;
+	size_t bytesUsed;    /* total over the occurrences we have seen */
+	size_t seen;         /* occurrences since we started tracking the site */
+	vector<T> examples;  /* a reservoir sample of the waste records */
+    };
+
+    size_t totalCount;
+
+    WasteSummary()
+	: totalCount(0) {}
+
+    void add(const string &accessSite, const T &rec, size_t bytesUsed)
+	{
+	    SiteSummary *s;
+
+	    totalCount++;
+
+	    auto it = sites.find(accessSite);
+	    if(it != sites.end())
+	    {
+		s = it->second;
+		byCount.erase(make_pair(s->count, s));
+	    }
+	    else if((int)sites.size() < TOP_K_CAPACITY)
+	    {
+		s = new SiteSummary();
+		s->accessSite = accessSite;
+		s->count = s->error = 0;
+		sites[accessSite] = s;
+	    }
+	    else
+	    {
+		/* Replace the site with the smallest count */
+		s = byCount.begin()->second;
+		byCount.erase(byCount.begin());
+		sites.erase(s->accessSite);
+
+		s->accessSite = accessSite;
+		s->error = s->count;
+		sites[accessSite] = s;
+	    }
+
+	    if(s->count == s->error)
+	    {
+		/* We just started tracking this site */
+		s->bytesUsed = 0;
+		s->seen = 0;
+		s->examples.clear();
+	    }
+
+	    s->count++;
+	    s->bytesUsed += bytesUsed;
+	    s->seen++;
+	    byCount.insert(make_pair(s->count, s));
+
+	    /* Reservoir sampling: the i-th record replaces a random
+	     * example with probability EXAMPLES_PER_SITE/i. */
+	    if((int)s->examples.size() < EXAMPLES_PER_SITE)
+		s->examples.push_back(rec);
+	    else
+	    {
+		size_t j = rand() % s->seen;
+		if(j < (size_t)EXAMPLES_PER_SITE)
+		    s->examples[j] = rec;
+	    }
+	}
+
+    /* Display the sites in the order of decreasing waste occurrences */
+    void print()
+	{
+	    for(auto it = byCount.rbegin(); it != byCount.rend(); it++)
+	    {
+		SiteSummary *s = it->second;
+
+		cout << s->count << " waste occurrences";
+		if(s->error > 0)
+		    cout << " (at most " << s->error << " of them at other sites)";
+		cout << ", " << fixed << setprecision(1)
+		     << (double)s->bytesUsed / s->seen << "/" << CACHE_LINE_SIZE
+		     << " bytes used on average" << endl;
+		cout.unsetf(ios::floatfield);
+
+		cout << s->accessSite << endl;
+		for(size_t i = 0; i < s->examples.size(); i++)
+		    cout << s->examples[i] << endl;
+	    }
 	}
 
+private:
+    unordered_map<string, SiteSummary*> sites;
+    set<pair<size_t, SiteSummary*>> byCount;
+};
+
+/* With -H, we also map the bytes used in every evicted line back to the
+ * allocated items the line held, and keep a histogram of the bytes used
+ * at every offset of every allocated type. From that we suggest which
+ * fields of a type to keep together and which to split off into a cold
+ * part reached through a pointer.
+ *
+ * We follow the allocation records to know the type and the item size at
+ * every address. The trace has no field offsets, so we learn the fields
+ * from the accesses that name them (name->field): a field starts at the
+ * offset of such an access and covers the bytes it accessed.
+ */
+bool WANT_SPLITS = false;
+
+/* Larger items are more likely arrays than structures, and a histogram
+ * per byte would take too much memory. */
+#define MAX_SPLIT_ITEM_SIZE 4096
+
+/* Report this many types, with the most fetched bytes left unused */
+#define SPLIT_TOP_TYPES 10
+
+/* The size of the pointer from the hot part of a split item to the cold part */
+#define SPLIT_POINTER_SIZE 8
+
+/* If the bytes of a field are used in less than that fraction of the
+ * evicted lines that held them, we say that the field is cold.
+ */
+const float COLD_USE_THRESHOLD = 0.05;
+
+class TypeField
+{
+public:
+    string name;
+    size_t size;
+
+    TypeField() : size(0) {}
+};
+
+class AllocatedType
+{
+public:
+    string name;
+    size_t itemSize;
+    map<size_t, TypeField> fields;   /* by offset */
+
+    AllocatedType(string n, size_t size)
+	: name(n), itemSize(size) {}
+};
+
+class Allocation
+{
+public:
+    size_t base;
+    size_t end;
+    AllocatedType *type;
+};
+
+map<string, AllocatedType*> allocatedTypes;
+map<size_t, Allocation> allocations;   /* by base address */
+
+/* Remember the allocation, and forget the ones it overlaps: memtracker
+ * does not trace free(), so a new allocation over an old one means that
+ * the old one was freed. */
+void trackAllocation(const TraceRecord &rec)
+{
+    size_t end = rec.address + rec.itemSize * rec.itemNumber;
+    map<size_t, Allocation>::iterator it = allocations.lower_bound(rec.address);
+
+    if(it != allocations.begin() && prev(it)->second.end > rec.address)
+	--it;
+    while(it != allocations.end() && it->first < max(end, rec.address + 1))
+	it = allocations.erase(it);
+
+    if(rec.itemSize == 0 || rec.itemNumber == 0 || rec.itemSize > MAX_SPLIT_ITEM_SIZE)
+	return;
+
+    /* varInfo is "<alloc_source> <name> <type> ", where the name and
+     * the type may be empty. Allocations of unknown type are a type of
+     * their own, named after the allocation site and the variable. */
+    size_t sourceEnd = rec.varInfo.find(' ');
+    size_t nameEnd = rec.varInfo.find(' ', sourceEnd + 1);
+    string typeName = rec.varInfo.substr(nameEnd + 1, rec.varInfo.length() - nameEnd - 2);
+
+    if(typeName.length() == 0 || typeName.compare("<Unknown>") == 0)
+	typeName = nameEnd == sourceEnd + 1 ? rec.varInfo.substr(0, sourceEnd)
+	    : rec.varInfo.substr(0, nameEnd);
+
+    /* The same type may be allocated with different sizes */
+    map<string, AllocatedType*>::iterator t = allocatedTypes.find(typeName);
+    if(t != allocatedTypes.end() && t->second->itemSize != rec.itemSize)
+    {
+	typeName += " (" + to_string(rec.itemSize) + " bytes)";
+	t = allocatedTypes.find(typeName);
+    }
+    if(t == allocatedTypes.end())
+	t = allocatedTypes.insert(make_pair(typeName,
+					    new AllocatedType(typeName, rec.itemSize))).first;
+
+    Allocation &a = allocations[rec.address];
+    a.base = rec.address;
+    a.end = end;
+    a.type = t->second;
+}
+
+/* The allocation holding the address, or the first one after it */
+map<size_t, Allocation>::iterator findAllocation(size_t address)
+{
+    map<size_t, Allocation>::iterator it = allocations.upper_bound(address);
+
+    if(it != allocations.begin() && prev(it)->second.end > address)
+	--it;
+    return it;
+}
+
+/* If the access names a field of an allocated item, learn where the
+ * field is. */
+void learnField(const TraceRecord &rec)
+{
+    size_t arrow = rec.varInfo.find("->");
+
+    if(arrow == string::npos)
+	return;
+
+    map<size_t, Allocation>::iterator it = findAllocation(rec.address);
+    if(it == allocations.end() || it->first > rec.address)
+	return;
+
+    /* The name, without array indices */
+    size_t nameEnd = rec.varInfo.find_first_of(" [", arrow + 2);
+    string name = rec.varInfo.substr(arrow + 2, nameEnd == string::npos ? string::npos
+				     : nameEnd - arrow - 2);
+    if(name.length() == 0 || name.compare("<Unknown>") == 0)
+	return;
+
+    AllocatedType *type = it->second.type;
+    size_t offset = (rec.address - it->first) % type->itemSize;
+    size_t size = min((size_t)max(rec.accessSize, (unsigned short)1),
+		      type->itemSize - offset);
+    TypeField &f = type->fields[offset];
+
+    if(f.name.length() == 0)
+	f.name = name;
+    f.size = max(f.size, size);
+}
+
+/* How the bytes of one allocated type were used in the evicted lines */
+class TypeUsage
+{
+public:
+    size_t lines;             /* evicted lines with bytes of the type */
+    vector<size_t> fetched;   /* by offset: evicted lines that held the byte */
+    vector<size_t> used;      /* by offset: of those, the lines where it was used */
+
+    TypeUsage() : lines(0) {}
 };
 
-unordered_multimap <string, ZeroReuseRecord> zeroReuseMap;
-unordered_multimap <string, LowUtilRecord> lowUtilMap;
+class TypeUsageMap
+{
+public:
+    /* Account for a line evicted from the cache, by walking the
+     * allocations in it. */
+    void add(size_t lineAddress, const bitset<MAX_LINE_SIZE> &bytesUsed, int lineSize)
+	{
+	    size_t lineEnd = lineAddress + lineSize;
+	    vector<AllocatedType*> counted;   /* few allocations share a line */
+
+	    for(map<size_t, Allocation>::iterator it = findAllocation(lineAddress);
+		it != allocations.end() && it->first < lineEnd; ++it)
+	    {
+		Allocation &a = it->second;
+		size_t itemSize = a.type->itemSize;
+		TypeUsage &u = types[a.type];
+
+		if(u.fetched.empty())
+		{
+		    u.fetched.resize(itemSize);
+		    u.used.resize(itemSize);
+		}
+		/* A line holding several items of a type counts once */
+		if(find(counted.begin(), counted.end(), a.type) == counted.end())
+		{
+		    u.lines++;
+		    counted.push_back(a.type);
+		}
+
+		size_t from = max(lineAddress, a.base), to = min(lineEnd, a.end);
+		for(size_t addr = from; addr < to; addr++)
+		{
+		    size_t offset = (addr - a.base) % itemSize;
+
+		    u.fetched[offset]++;
+		    if(bytesUsed.test(addr - lineAddress))
+			u.used[offset]++;
+		}
+	    }
+	}
+
+    void print();
+
+private:
+    unordered_map<AllocatedType*, TypeUsage> types;
+};
 
-multimap <int, tuple<string, vector<ZeroReuseRecord>>> groupedZeroReuseMap;
-multimap <int, tuple<string, vector<LowUtilRecord>>> groupedLowUtilMap;
+/* Every simulated cache level keeps its own waste summaries, so that we
+ * can tell apart, for instance, a site that wastes L1 lines but gets
+ * good reuse out of the LLC from a site that wastes lines everywhere.
+ */
+class WasteMaps
+{
+public:
+    WasteSummary<ZeroReuseRecord> zeroReuse;
+    WasteSummary<LowUtilRecord> lowUtil;
+    TypeUsageMap typeUsage;   /* with -H */
+};
 
 /***************************************************************************
  * BEGIN CACHE SIMULATION CODE
@@ -127,12 +470,27 @@ multimap <int, tuple<string, vector<LowUtilRecord>>> groupedLowUtilMap;
  * before being evicted. 
  */
 
+/* MESI states of a line. They only matter when we simulate
+ * coherent private caches (see CoherentCaches). Otherwise, every
+ * line in use is simply EXCLUSIVE.
+ */
+typedef enum {
+    INVALID,
+    SHARED,
+    EXCLUSIVE,
+    MODIFIED
+} mesi_state_t;
+
 class CacheLine
 {
     int lineSize;     /* In bytes */
 public:
+    bool inUse;        /* does this line hold any data? */
     size_t address;    /* virtual address responsible for populating this cache line */
-    size_t tag; 
+    size_t tag;        /* the line number, i.e., address >> lineOffsetBits.
+			* We keep the whole line number rather than just the
+			* bits above the set index, so that levels with different
+			* numbers of sets can tell each other which line to drop. */
     string accessSite; /* which code location caused that data to be brought 
 			* into the cache line? */
     unsigned short initAccessSize; /* The size of the access that brought 
@@ -144,8 +502,8 @@ public:
 			* accessed by the user program, we mark it as "accessed"
 			* by setting the corresponding bit to "1".
 			*/
-    size_t timeStamp;  /* Virtual time of access */
     unsigned short timesReusedBeforeEvicted;
+    mesi_state_t state;
 
     /* CacheLine constructor does not take any arguments and instead we set 
      * the parameters from the globals. That enables us to 
@@ -156,13 +514,14 @@ public:
     CacheLine() /* Size is given in bytes */
 	{
 	    lineSize = CACHE_LINE_SIZE;
+	    inUse = false;
+	    state = INVALID;
 	    address = 0;
 	    tag = 0;
 	    initAccessSize = 0;
 	    accessSite = "";
 	    varInfo = "";
 	    timesReusedBeforeEvicted = 0;
-	    timeStamp = 0;
 	    bytesUsed = new bitset<MAX_LINE_SIZE>(lineSize); 
 	    bytesUsed->reset();
 	}
@@ -176,24 +535,26 @@ public:
 	}
 
     void setAndAccess(size_t address, unsigned short accessSize, 
-		      string accessSite, string varInfo, size_t timeStamp)
+		      const string &accessSite, const string &varInfo)
 	{
 	    this->address = address;
 	    this->initAccessSize = accessSize;
-	    tag = address >> tagMaskBits;
+	    inUse = true;
+	    state = EXCLUSIVE;
+	    tag = address >> lineOffsetBits;
 	    this->accessSite = accessSite;
 	    this->varInfo = varInfo;
 	    timesReusedBeforeEvicted = 0;
 	    bytesUsed->reset();
 
-	    access(address, accessSize, timeStamp);
+	    access(address, accessSize);
 	}
 
     bool valid(size_t address)
 	{
-	    if(address >> tagMaskBits == tag)
+	    if(inUse && address >> lineOffsetBits == tag)
 		return true;
-	    
+
 	    return false;
 	}
 
@@ -203,14 +564,12 @@ public:
      * If those bits are already marked as accessed, we increment
      * the reuse counter.
      */
-    void access(size_t address, unsigned short accessSize, size_t timeStamp)
+    void access(size_t address, unsigned short accessSize)
 	{
 	    int lineOffset = address % lineSize;
-	    
+
 	    assert(valid(address));
 	    assert(lineOffset + accessSize <= lineSize);
-	    
-	    this->timeStamp = timeStamp;
 
 	    /* We only check if the first bit is set, assuming that if
 	     * we access the same valid address twice, the data represents
@@ -223,33 +582,15 @@ public:
 		for(int i = lineOffset; i < min(lineOffset + accessSize, lineSize); i++)
 		    bytesUsed->set(i);
 	    }
-	}    
-    
+	}
+
+    /* The cache level that owns this line has already accounted
+     * for the waste (see CacheLevel::retire). Just clear the line.
+     */
     void evict()
 	{
-
-	    /* We are being evicted. Print our stats, update waste maps and clear. */
-	    if(WANT_RAW_OUTPUT)
-	    {
-		cout << bytesUsed->count() << "\t" << timesReusedBeforeEvicted 
-		     << "\t" << accessSite << "[" << varInfo << "]\t" 
-		     << "0x" << hex << address << dec << endl;
-	    }
-
-	    if(timesReusedBeforeEvicted == 0)
-	    {
-		zeroReuseMap.insert(pair<string, ZeroReuseRecord>
-				    (accessSite, 
-				     ZeroReuseRecord(varInfo, address)));
-	    }
-	    if((float)(bytesUsed->count()) / (float)lineSize < LOW_UTIL_THRESHOLD)
-	    {
-		lowUtilMap.insert(pair<string, LowUtilRecord>
-				  (accessSite, 
-				   LowUtilRecord(varInfo, address, bytesUsed->count())));
-	    }
-
-
+	    inUse = false;
+	    state = INVALID;
 	    address = 0;
 	    tag = 0;
 	    accessSite = "";
@@ -263,358 +604,1161 @@ public:
 	    cout << "Line size = " << lineSize << endl;
 	}
 
-	   
+
 };
 
+/* Replacement policies.
+ *
+ * Each cache set owns one policy object. The set tells the policy
+ * when a way is filled with a new line, when a resident line is hit
+ * and when a line is invalidated. Once all the ways hold valid lines
+ * and we need room for a new one, the set asks the policy for a victim.
+ *
+ * Policies are plugged into the cache as a template parameter, so
+ * the calls on the per-access path are resolved at compile time.
+ */
 
-class CacheSet
+/* True LRU based on virtual timestamps. */
+class LRUPolicy
 {
-public:
-    int assoc, lineSize;
-    CacheLine *lines;
+    vector<size_t> lastUse;
     size_t curTime; /* a virtual time ticks every time someone
 		     * accesses this cache set. */
 public:
-    /* CacheSet constructor does not take any arguments and instead we set 
-     * the parameters from the globals. That enables us to 
-     * allocate an entire array of cache sets. That allocation
-     * relies on zero-argument constructor and does not work
-     * with constructors that take arguments. 
-     */
-    CacheSet()
+    static const char *name() { return "lru"; }
+
+    void init(int assoc)
 	{
-	    assoc = ASSOC;
-	    lineSize = CACHE_LINE_SIZE;
+	    lastUse.assign(assoc, 0);
 	    curTime = 0;
-	    this->assoc = assoc;
-	    lines = new CacheLine[assoc];
-	    
 	}
 
-    /* Find a cache line to evict or return a clean time 
-     * For evictions we use the true LRU policy based on 
-     * virtual timestamps. 
-     */
-    CacheLine * findCleanOrVictim(size_t timeNow)
+    void fill(int way) { lastUse[way] = ++curTime; }
+    void hit(int way) { lastUse[way] = ++curTime; }
+    void invalidate(int way) { lastUse[way] = 0; }
+
+    int victim()
 	{
-	    size_t minTime = curTime, minIndex = -1;
-#if VERBOSE
-	    cout << "Looking for eviction candidate at time " << timeNow << endl;
-#endif
+	    int minIndex = 0;
 
-	    /* A clean line will have a timestamp of zero, 
-	     * so it will automatically get selected. 
-	     */
-	    for(int i = 0; i < assoc; i++)
+	    for(int i = 1; i < (int)lastUse.size(); i++)
 	    {
-		if(lines[i].timeStamp < minTime)
-		{
-		    minTime = lines[i].timeStamp;
+		if(lastUse[i] < lastUse[minIndex])
 		    minIndex = i;
-		}
-#if VERBOSE
-		cout << "block "<< i << " ts is " << lines[i].timeStamp << endl;
-#endif
 	    }
-	    assert(minIndex >= 0);
+	    return minIndex;
+	}
+};
 
-#if VERBOSE
-	    cout << "Eviction candidate is block " << minIndex << endl;
-#endif
-	    /* Evict the line if it's not empty */
-	    if(lines[minIndex].timeStamp != 0)
-		lines[minIndex].evict();
+/* Tree pseudo-LRU, as found in the L1 and L2 caches of most Intel
+ * parts. The ways are the leaves of a binary tree. Each of the
+ * assoc-1 internal nodes has a bit pointing to the half of its subtree
+ * that was used less recently (0 = left, 1 = right). Requires the
+ * associativity to be a power of two.
+ */
+class TreePLRUPolicy
+{
+    int assoc;
+    vector<unsigned char> tree;
+
+public:
+    static const char *name() { return "plru"; }
 
-	    return &(lines[minIndex]);
+    void init(int as)
+	{
+	    assoc = as;
+	    tree.assign(max(assoc - 1, 1), 0);
 	}
 
-    /* See if any of the existing cache lines hold
-     * that address. If so, access the cache line. 
-     * Otherwise, find someone to evict and populate
-     * the cache line with the new data.
-     * Return true on a hit, false on a miss. 
-     */
-    bool access(size_t address, unsigned short accessSize, 
-		string accessSite, string varInfo)
+    void fill(int way) { pointTo(way, false); }
+    void hit(int way) { pointTo(way, false); }
+    void invalidate(int way) { pointTo(way, true); }
+
+    int victim()
 	{
-	    curTime++;
+	    int node = 0, way = 0;
 
-	    for(int i = 0; i < assoc; i++)
+	    for(int span = assoc / 2; span > 0; span /= 2)
 	    {
-		if(lines[i].valid(address))
-		{
-		    lines[i].access(address, accessSize, curTime);
-		    return true;
-		}
+		int right = tree[node];
+
+		way += right * span;
+		node = 2 * node + 1 + right;
 	    }
-	    
-	    /* If we are here, we did not find the data in cache.
-	     * See if there is an empty cache line or find someone to evict. 
-	     */
-	    CacheLine *line = findCleanOrVictim(curTime);
-	    line->setAndAccess(address, accessSize, accessSite, varInfo, curTime);
-	    return false;
+	    return way;
 	}
 
-    void printParams()
+private:
+    /* Walk from the root to the leaf of this way and make every node
+     * on the path point away from it (after a use) or towards it
+     * (after an invalidation, so the empty way gets filled next).
+     */
+    void pointTo(int way, bool towards)
 	{
-	    cout << "Associativity = " << assoc << endl;
-	    cout << "Line size = " << lineSize << endl;
+	    int node = 0;
+
+	    for(int span = assoc / 2; span > 0; span /= 2)
+	    {
+		int right = (way & span) ? 1 : 0;
+
+		tree[node] = towards ? right : !right;
+		node = 2 * node + 1 + right;
+	    }
 	}
 };
 
-class Cache
+/* Re-reference interval prediction (Jaleel et al., ISCA 2010) with
+ * 2-bit re-reference prediction values (RRPV). A hit predicts a near
+ * re-reference (RRPV 0), and the victim is a line predicted to be
+ * re-referenced in the distant future (RRPV 3).
+ *
+ * SRRIP inserts new lines with a "long" prediction (RRPV 2). BRRIP
+ * inserts most lines with a "distant" prediction and only every 32nd
+ * one with a "long" prediction, which keeps scans from flushing the
+ * working set. We use a counter rather than a random number for the
+ * bimodal choice, so that simulations are reproducible.
+ */
+template <bool bimodal>
+class RRIPPolicy
 {
-public:
-    int numSets;
-    int assoc;
-    int lineSize;
-    CacheSet *sets;
-    int numMisses, numHits;
+    enum { RRPV_MAX = 3, BRRIP_LONG_INSERT_PERIOD = 32 };
+
+    vector<unsigned char> rrpv;
+    unsigned int fills;
 
+public:
+    static const char *name() { return bimodal ? "brrip" : "srrip"; }
 
-    Cache(int ns, int as, int ls)
-	: numSets(ns), assoc(as), lineSize(ls)
+    void init(int assoc)
 	{
-	    sets = new CacheSet[numSets];
-	    numMisses = 0;
-	    numHits = 0;
+	    rrpv.assign(assoc, RRPV_MAX);
+	    fills = 0;
+	}
 
-	    /* This is by how many bits we have to shift the
-	     * address to compute the tag. */
-	    tagMaskBits = log2(lineSize) + log2(numSets);
+    void fill(int way)
+	{
+	    if(bimodal && (++fills % BRRIP_LONG_INSERT_PERIOD) != 0)
+		rrpv[way] = RRPV_MAX;
+	    else
+		rrpv[way] = RRPV_MAX - 1;
 	}
 
-    void access(size_t address, unsigned short accessSize, 
-		string accessSite, string varInfo)
+    void hit(int way) { rrpv[way] = 0; }
+    void invalidate(int way) { rrpv[way] = RRPV_MAX; }
+
+    int victim()
 	{
-	    /* See if the access spans two cache lines.
-	     */
-	    int lineOffset = address % lineSize;
-	    
-	    if(lineOffset + accessSize <= lineSize)
+	    while(true)
 	    {
-		__access(address, accessSize, accessSite, varInfo);
-		return;
+		for(int i = 0; i < (int)rrpv.size(); i++)
+		{
+		    if(rrpv[i] == RRPV_MAX)
+			return i;
+		}
+
+		/* Nobody is predicted to be re-referenced in the
+		 * distant future. Age everyone and look again. */
+		for(int i = 0; i < (int)rrpv.size(); i++)
+		    rrpv[i]++;
 	    }
+	}
+};
 
-	    /* If we are here, we have a spanning access.
-	     * Determine the address of the first byte that 
-	     * spills into another cache line. 
-	     */
-	    uint16_t bytesFittingIntoFirstLine = lineSize - lineOffset;
-	    size_t addressOfFirstByteNotFitting = 
-		address + bytesFittingIntoFirstLine;
-	    uint16_t sizeOfSpillingAccess = accessSize - bytesFittingIntoFirstLine;
-#if VERBOSE
-	    cerr << "SPANNING ACCESS: 0x" << hex << address 
-		 << dec << " " << accessSize << " " << accessSite 
-		 << " " << varInfo << endl;
-	    cerr << "Split into: " << endl;
-	    cerr << "\t0x" << hex << address << dec << " " 
-		 << bytesFittingIntoFirstLine << endl;
-	    cerr << "\t0x" << hex << addressOfFirstByteNotFitting << dec << " " 
-		 << sizeOfSpillingAccess << endl;
-#endif
+typedef RRIPPolicy<false> SRRIPPolicy;
+typedef RRIPPolicy<true> BRRIPPolicy;
+
+/* Random replacement. We do not seed the generator, so that
+ * simulations are reproducible.
+ */
+class RandomPolicy
+{
+    int assoc;
 
+public:
+    static const char *name() { return "random"; }
 
-	    /* Split them into two accesses */
-	    __access(address, bytesFittingIntoFirstLine, accessSite, varInfo);
+    void init(int as) { assoc = as; }
+    void fill(int) {}
+    void hit(int) {}
+    void invalidate(int) {}
+    int victim() { return rand() % assoc; }
+};
 
-	    /* We recursively call this function in case the spilling access 
-	     * spans more than two lines. */
-	    access(addressOfFirstByteNotFitting, sizeOfSpillingAccess, 
-		   accessSite, varInfo);
-	    
-	}
 
-    void printParams()
+template <class Policy>
+class CacheSet
+{
+public:
+    int assoc;
+    CacheLine *lines;
+    Policy policy;
+
+    /* CacheSet constructor does not take any arguments, so that
+     * we can allocate an entire array of cache sets. That allocation
+     * relies on zero-argument constructor and does not work
+     * with constructors that take arguments. The owning cache
+     * calls init() on each set right after allocating them.
+     */
+    CacheSet()
+	: assoc(0), lines(NULL) {}
+
+    void init(int assoc)
 	{
-	    cout << "Line size      = " << lineSize << endl;
-	    cout << "Number of sets = " << numSets << endl;
-	    cout << "Associativity  = " << assoc << endl;
+	    this->assoc = assoc;
+	    lines = new CacheLine[assoc];
+	    policy.init(assoc);
 	}
 
-    void printStats()
+    /* See if any of the existing cache lines hold
+     * that address. Return the way or -1 if none does.
+     */
+    int find(size_t address)
 	{
-	    cout << "Number of hits: " << numHits << endl;
-	    cout << "Number of misses: " << numMisses << endl;
-	}
-    
-private:
-    /* Here we assume that accesses would not be spanning cache
+	    for(int i = 0; i < assoc; i++)
+	    {
+		if(lines[i].valid(address))
+		    return i;
+	    }
+	    return -1;
+	}
+
+    /* Find a clean line, or if there is none, ask the
+     * replacement policy which line to evict.
+     */
+    int findCleanOrVictim()
+	{
+	    for(int i = 0; i < assoc; i++)
+	    {
+		if(!lines[i].inUse)
+		    return i;
+	    }
+
+	    int victim = policy.victim();
+#if VERBOSE
+	    cout << "Eviction candidate is block " << victim << endl;
+#endif
+	    assert(victim >= 0 && victim < assoc);
+	    return victim;
+	}
+};
+
+/* Returned in place of a line number when a miss
+ * did not have to evict anything.
+ */
+const size_t NO_VICTIM = (size_t) -1;
+
+/* This is the part of a cache level that does not depend on the
+ * replacement policy. The cache hierarchy talks to its levels
+ * through this interface.
+ */
+class CacheLevel
+{
+public:
+    string name;
+    int numSets;
+    int assoc;
+    int lineSize;
+    size_t numMisses, numHits, numInvalidations;
+    WasteMaps waste;
+
+    CacheLevel(string n, int ns, int as, int ls)
+	: name(n), numSets(ns), assoc(as), lineSize(ls)
+	{
+	    numMisses = 0;
+	    numHits = 0;
+	    numInvalidations = 0;
+	}
+
+    virtual ~CacheLevel() {}
+
+    virtual const char *policyName() = 0;
+
+    /* Access the data within a single cache line. Return true on a
+     * hit, false on a miss. On a miss the line is brought into the cache.
+     * If that required evicting a valid line, the evicted line number
+     * is returned in victimTag. Otherwise victimTag is set to NO_VICTIM.
+     */
+    virtual bool accessLine(size_t address, unsigned short accessSize,
+			    const string &accessSite, const string &varInfo,
+			    size_t *victimTag) = 0;
+
+    /* Return the line holding this address or NULL if we don't
+     * have it. Unlike accessLine, this does not count as an access.
+     */
+    virtual CacheLine *find(size_t address) = 0;
+
+    /* Drop the line with the given line number, if we have it.
+     * Used to keep the upper levels of an inclusive hierarchy
+     * inclusive and to model coherence invalidations.
+     * Return true if we had the line.
+     */
+    virtual bool invalidate(size_t tag) = 0;
+
+    void printParams()
+	{
+	    cout << "[" << name << "] " << (size_t)numSets * assoc * lineSize / 1024
+		 << "KB, " << policyName() << endl;
+	    cout << "Line size      = " << lineSize << endl;
+	    cout << "Number of sets = " << numSets << endl;
+	    cout << "Associativity  = " << assoc << endl;
+	}
+
+    void printStats()
+	{
+	    cout << "[" << name << "] Number of hits: " << numHits << endl;
+	    cout << "[" << name << "] Number of misses: " << numMisses << endl;
+	    if(numInvalidations > 0)
+		cout << "[" << name << "] Number of invalidations: "
+		     << numInvalidations << endl;
+	}
+
+protected:
+    /* A line is leaving the cache. Print its stats,
+     * update waste maps and clear it.
+     */
+    void retire(CacheLine *line)
+	{
+	    size_t bytesUsed = line->bytesUsed->count();
+
+	    if(WANT_RAW_OUTPUT)
+	    {
+		if(MULTIPLE_CACHES)
+		    cout << name << "\t";
+		cout << bytesUsed << "\t" << line->timesReusedBeforeEvicted
+		     << "\t" << line->accessSite << "[" << line->varInfo << "]\t"
+		     << "0x" << hex << line->address << dec << endl;
+	    }
+
+	    if(line->timesReusedBeforeEvicted == 0)
+	    {
+		waste.zeroReuse.add(line->accessSite,
+				    ZeroReuseRecord(line->varInfo, line->address),
+				    bytesUsed);
+	    }
+	    if((float)bytesUsed / (float)lineSize < LOW_UTIL_THRESHOLD)
+	    {
+		waste.lowUtil.add(line->accessSite,
+				  LowUtilRecord(line->varInfo, line->address, bytesUsed),
+				  bytesUsed);
+	    }
+	    if(WANT_SPLITS)
+		waste.typeUsage.add(line->tag << lineOffsetBits, *line->bytesUsed, lineSize);
+
+	    line->evict();
+	}
+};
+
+
+template <class Policy>
+class Cache: public CacheLevel
+{
+    CacheSet<Policy> *sets;
+
+public:
+    Cache(string n, int ns, int as, int ls)
+	: CacheLevel(n, ns, as, ls)
+	{
+	    sets = new CacheSet<Policy>[numSets];
+	    for(int i = 0; i < numSets; i++)
+		sets[i].init(assoc);
+	}
+
+    const char *policyName()
+	{
+	    return Policy::name();
+	}
+
+    /* Here we assume that accesses would not be spanning cache
      * lines. The calling function should have taken care of this.
      */
-    void __access(size_t address, unsigned short accessSize, 
-		string accessSite, string varInfo)
+    bool accessLine(size_t address, unsigned short accessSize,
+		    const string &accessSite, const string &varInfo,
+		    size_t *victimTag)
 	{
 	    /* Locate the set that we have to access */
-	    int setNum = (address >> (int)log2(lineSize)) % numSets;
-	    
-	    assert(setNum < numSets);
+	    CacheSet<Policy> &set = sets[setIndex(address >> lineOffsetBits)];
 #if VERBOSE
-	    cout << hex << address << dec << " maps into set #" << setNum << endl;
+	    cout << hex << address << dec << " maps into set #"
+		 << setIndex(address >> lineOffsetBits) << endl;
 #endif
-	    bool hit = sets[setNum].access(address, accessSize, accessSite, varInfo);
-	    if(hit)
+	    *victimTag = NO_VICTIM;
+
+	    int way = set.find(address);
+	    if(way >= 0)
+	    {
+		set.lines[way].access(address, accessSize);
+		set.policy.hit(way);
 		numHits++;
-	    else
-		numMisses++;
+		return true;
+	    }
+
+	    /* If we are here, we did not find the data in cache.
+	     * See if there is an empty cache line or find someone to evict. 
+	     */
+	    way = set.findCleanOrVictim();
+	    CacheLine *line = &set.lines[way];
+
+	    if(line->inUse)
+	    {
+		*victimTag = line->tag;
+		retire(line);
+	    }
+
+	    line->setAndAccess(address, accessSize, accessSite, varInfo);
+	    set.policy.fill(way);
+	    numMisses++;
+	    return false;
 	}
 
+    CacheLine *find(size_t address)
+	{
+	    CacheSet<Policy> &set = sets[setIndex(address >> lineOffsetBits)];
+	    int way = set.find(address);
+
+	    return (way >= 0) ? &set.lines[way] : NULL;
+	}
+
+    bool invalidate(size_t tag)
+	{
+	    CacheSet<Policy> &set = sets[setIndex(tag)];
+
+	    for(int i = 0; i < set.assoc; i++)
+	    {
+		if(set.lines[i].inUse && set.lines[i].tag == tag)
+		{
+		    retire(&set.lines[i]);
+		    set.policy.invalidate(i);
+		    numInvalidations++;
+		    return true;
+		}
+	    }
+	    return false;
+	}
+
+private:
+    int setIndex(size_t tag)
+	{
+	    return tag % numSets;
+	}
 };
-/***************************************************************************
- * END CACHE SIMULATION CODE
-/****************************************************************************/
 
-void parseAndSimulate(string line, Cache *c)
+/* Set by SIGUSR1 to ask for a partial report */
+volatile sig_atomic_t partialReportRequested = 0;
+
+void requestPartialReport(int)
 {
-    istringstream str(line);
-    string word;
-    size_t address;
-    unsigned short accessSize;
-    string accessSite;
-    string varInfo;
+    partialReportRequested = 1;
+}
+
+/* Geometry and replacement policy of one level, as given on the command line. */
+class LevelSpec
+{
+public:
+    int numSets;
+    int assoc;
+    string policy;
 
-    /* Let's determine if this is an access record */
-    if(!str.eof())
+    LevelSpec(int ns, int as, string p = "")
+	: numSets(ns), assoc(as), policy(p) {}
+};
+
+/* Instantiate a cache level with the replacement policy
+ * of the given name. Return NULL if we don't know the policy.
+ */
+CacheLevel *makeCacheLevel(string name, int numSets, int assoc, int lineSize,
+			   string policy)
+{
+    if(policy.compare(LRUPolicy::name()) == 0)
+	return new Cache<LRUPolicy>(name, numSets, assoc, lineSize);
+    if(policy.compare(TreePLRUPolicy::name()) == 0)
     {
-	str >> word;
-	if(!(word.compare("read:") == 0) && !(word.compare("write:") == 0))
-	    return;
+	if(assoc & (assoc - 1))
+	{
+	    cerr << "Tree-PLRU requires the associativity to be a power of two, "
+		 << name << " has " << assoc << " ways." << endl;
+	    return NULL;
+	}
+	return new Cache<TreePLRUPolicy>(name, numSets, assoc, lineSize);
     }
+    if(policy.compare(SRRIPPolicy::name()) == 0)
+	return new Cache<SRRIPPolicy>(name, numSets, assoc, lineSize);
+    if(policy.compare(BRRIPPolicy::name()) == 0)
+	return new Cache<BRRIPPolicy>(name, numSets, assoc, lineSize);
+    if(policy.compare(RandomPolicy::name()) == 0)
+	return new Cache<RandomPolicy>(name, numSets, assoc, lineSize);
+
+    cerr << "Unknown replacement policy: " << policy << endl;
+    return NULL;
+}
+
+/* A stack of cache levels, L1 first. An access that misses in a level
+ * goes on to the next one, and the line is brought into every level
+ * that missed.
+ *
+ * In a non-inclusive hierarchy, the levels evict lines independently
+ * of each other. In an inclusive hierarchy, a line evicted from a level
+ * is also invalidated in all the levels above it.
+ *
+ * Note that a level only sees the accesses that missed in the levels
+ * above it, so its waste maps describe the reuse and utilization of
+ * lines from that level's point of view.
+ */
+class CacheHierarchy
+{
+public:
+    vector<CacheLevel*> levels;
+    bool inclusive;
+
+    CacheHierarchy(bool incl)
+	: inclusive(incl) {}
+
+    void addLevel(CacheLevel *level)
+	{
+	    assert(level != NULL);
+	    levels.push_back(level);
+	}
+
+    void access(size_t address, unsigned short accessSize, 
+		const string &accessSite, const string &varInfo)
+	{
+	    /* See if the access spans two cache lines.
+	     */
+	    int lineOffset = address % CACHE_LINE_SIZE;
+
+	    if(lineOffset + accessSize <= CACHE_LINE_SIZE)
+	    {
+		accessLine(address, accessSize, accessSite, varInfo);
+		return;
+	    }
+
+	    /* If we are here, we have a spanning access.
+	     * Determine the address of the first byte that 
+	     * spills into another cache line. 
+	     */
+	    uint16_t bytesFittingIntoFirstLine = CACHE_LINE_SIZE - lineOffset;
+	    size_t addressOfFirstByteNotFitting = 
+		address + bytesFittingIntoFirstLine;
+	    uint16_t sizeOfSpillingAccess = accessSize - bytesFittingIntoFirstLine;
+#if VERBOSE
+	    cerr << "SPANNING ACCESS: 0x" << hex << address 
+		 << dec << " " << accessSize << " " << accessSite 
+		 << " " << varInfo << endl;
+	    cerr << "Split into: " << endl;
+	    cerr << "\t0x" << hex << address << dec << " " 
+		 << bytesFittingIntoFirstLine << endl;
+	    cerr << "\t0x" << hex << addressOfFirstByteNotFitting << dec << " " 
+		 << sizeOfSpillingAccess << endl;
+#endif
+
 
-    /* We are assuming the memtracker trace output, the text 
-     * version. It has the following format:
-     * <access_type> <tid> <addr> <size> <func> <access_source> <alloc_source> <name> <type>
+	    /* Split them into two accesses */
+	    accessLine(address, bytesFittingIntoFirstLine, accessSite, varInfo);
+
+	    /* We recursively call this function in case the spilling access 
+	     * spans more than two lines. */
+	    access(addressOfFirstByteNotFitting, sizeOfSpillingAccess, 
+		   accessSite, varInfo);
+
+	}
+
+    void printParams()
+	{
+	    if(levels.size() > 1)
+		cout << (inclusive ? "Inclusive" : "Non-inclusive")
+		     << " hierarchy of " << levels.size() << " levels" << endl;
+
+	    for(CacheLevel *level: levels)
+		level->printParams();
+	}
+
+    void printStats()
+	{
+	    for(CacheLevel *level: levels)
+		level->printStats();
+	}
+
+private:
+    void accessLine(size_t address, unsigned short accessSize,
+		    const string &accessSite, const string &varInfo)
+	{
+	    for(size_t i = 0; i < levels.size(); i++)
+	    {
+		size_t victimTag;
+		bool hit = levels[i]->accessLine(address, accessSize,
+						 accessSite, varInfo, &victimTag);
+
+		if(inclusive && victimTag != NO_VICTIM)
+		{
+		    for(size_t j = 0; j < i; j++)
+			levels[j]->invalidate(victimTag);
+		}
+
+		if(hit)
+		    break;
+	    }
+	}
+};
+
+/* Counters of coherence events, kept per cache line and per
+ * access site/variable.
+ */
+class SharingStats
+{
+public:
+    size_t invalidations;      /* remote copies invalidated by our writes */
+    size_t trueSharingMisses;  /* misses on data that another core wrote */
+    size_t falseSharingMisses; /* misses on a line that another core wrote,
+				* but in bytes we did not touch */
+    string varInfo;            /* what we know about the data in the line */
+
+    SharingStats()
+	: invalidations(0), trueSharingMisses(0), falseSharingMisses(0) {}
+
+    size_t coherenceMisses() const
+	{
+	    return trueSharingMisses + falseSharingMisses;
+	}
+};
+
+/* A set of private caches kept coherent with the MESI protocol.
+ * Every thread in the trace is mapped to a core, and every core
+ * has a private cache. A core that writes a line invalidates the
+ * copies in all other cores; a core that reads a line another core
+ * has modified or holds exclusively downgrades that copy to SHARED.
+ *
+ * A miss on a line that this core lost to a remote write is a
+ * coherence miss. To tell true sharing from false sharing, we
+ * remember, for every invalidated copy, which bytes of the line the
+ * other cores have written since. If the missing access touches any
+ * of those bytes, the miss is due to true sharing; otherwise it is
+ * due to false sharing and would go away with a different data layout.
+ */
+class CoherentCaches
+{
+public:
+    vector<CacheLevel*> cores;
+    size_t invalidations, trueSharingMisses, falseSharingMisses;
+    size_t interventions; /* misses served from a remote MODIFIED copy */
+
+    /* Stats per cache line (line number) and per access site.
+     * Sites are keyed by the access site and the variable info,
+     * so that different fields accessed from the same source
+     * line are counted separately.
      */
-    int iter = 1;
-    while(!str.eof())
-    {
-	str >> word;
+    unordered_map<size_t, SharingStats> lineStats;
+    unordered_map<string, SharingStats> siteStats;
 
-	switch(iter++)
+    /* If maxCores is zero, every thread gets its own core.
+     * Otherwise, threads are mapped to cores round-robin by thread id.
+     */
+    CoherentCaches(int maxCores, LevelSpec *privateCache, string policy)
+	: maxCores(maxCores), privateCache(privateCache), policy(policy)
 	{
-	case 1:	    // Skip the tid
-	    break;
-	case 2:     // Parse the address
-	    address = strtol(word.c_str(), 0, 16);
-	    if(errno == EINVAL || errno == ERANGE)
+	    invalidations = 0;
+	    trueSharingMisses = 0;
+	    falseSharingMisses = 0;
+	    interventions = 0;
+	}
+
+    void access(int tid, bool isWrite, size_t address, unsigned short accessSize,
+		const string &accessSite, const string &varInfo)
+	{
+	    int core = coreForThread(tid);
+
+	    /* Split accesses spanning cache lines, as in CacheHierarchy::access */
+	    while(true)
 	    {
-		cerr << "The following line caused error when parsing address: " << endl;
-		cerr << line << endl;
-		exit(-1);
+		int lineOffset = address % CACHE_LINE_SIZE;
+		unsigned short size = min((int)accessSize, CACHE_LINE_SIZE - lineOffset);
+
+		accessLine(core, isWrite, address, size, accessSite, varInfo);
+
+		if(size == accessSize)
+		    break;
+		address += size;
+		accessSize -= size;
 	    }
-	    break;
-	case 3:     // Parse the size
-	    accessSize = (unsigned short) strtol(word.c_str(), 0, 10);
-	    if(errno == EINVAL || errno == ERANGE)
+	}
+
+    void printStats()
+	{
+	    for(CacheLevel *c: cores)
+		c->printStats();
+	}
+
+private:
+    int maxCores;
+    LevelSpec *privateCache;
+    string policy;
+    unordered_map<int, int> threadToCore;
+
+    /* For every core, the lines it lost to remote writes and
+     * the bytes of those lines that other cores wrote since.
+     */
+    vector<unordered_map<size_t, bitset<MAX_LINE_SIZE>>> remotelyWritten;
+
+    int coreForThread(int tid)
+	{
+	    auto it = threadToCore.find(tid);
+	    if(it != threadToCore.end())
+		return it->second;
+
+	    int core = (maxCores > 0) ? tid % maxCores : (int)threadToCore.size();
+	    threadToCore[tid] = core;
+
+	    while((int)cores.size() <= core)
 	    {
-		cerr << "The following line caused error when parsing access size: " << endl;
-		cerr << line << endl;
-		exit(-1);
+		CacheLevel *c = makeCacheLevel("core" + to_string(cores.size()),
+					       privateCache->numSets,
+					       privateCache->assoc,
+					       CACHE_LINE_SIZE, policy);
+		if(c == NULL)
+		    exit(-1);
+		cores.push_back(c);
+		remotelyWritten.push_back(unordered_map<size_t, bitset<MAX_LINE_SIZE>>());
 	    }
-	    break;
-	case 4: 
-	case 5: 
-	    accessSite += word + " ";
-	    break;
-	case 6: 
-	case 7: 
-	case 8:
-	    varInfo += word + " ";
-	    break;
+	    return core;
 	}
-    }
 
-#if VERBOSE
-    cout << line << endl;
-    cout << "Parsed: " << endl;
-    cout << hex << "0x" << address << dec << endl;
-    cout << accessSize << endl;
-    cout << accessSite << endl;
-    cout << varInfo << endl;
-#endif
+    string siteKey(const string &accessSite, const string &varInfo)
+	{
+	    return accessSite + "\n\t" + varInfo;
+	}
 
-    c->access(address, accessSize, accessSite, varInfo);
+    void accessLine(int core, bool isWrite, size_t address, unsigned short accessSize,
+		    const string &accessSite, const string &varInfo)
+	{
+	    size_t tag = address >> lineOffsetBits;
+	    int lineOffset = address % CACHE_LINE_SIZE;
+	    bitset<MAX_LINE_SIZE> accessMask;
+	    size_t victimTag;
 
-}
+	    for(int i = lineOffset; i < lineOffset + accessSize; i++)
+		accessMask.set(i);
+
+	    CacheLine *line = cores[core]->find(address);
+
+	    if(line == NULL)
+	    {
+		/* Did we lose this line to a remote write? */
+		auto it = remotelyWritten[core].find(tag);
+		if(it != remotelyWritten[core].end())
+		{
+		    SharingStats &ls = lineStats[tag];
+		    SharingStats &ss = siteStats[siteKey(accessSite, varInfo)];
+
+		    if((it->second & accessMask).any())
+		    {
+			trueSharingMisses++;
+			ls.trueSharingMisses++;
+			ss.trueSharingMisses++;
+		    }
+		    else
+		    {
+			falseSharingMisses++;
+			ls.falseSharingMisses++;
+			ss.falseSharingMisses++;
+		    }
+		    if(ls.varInfo.empty())
+			ls.varInfo = varInfo;
+		    remotelyWritten[core].erase(it);
+		}
+
+		/* Snoop the other cores */
+		bool sharedElsewhere = false;
+		for(int i = 0; i < (int)cores.size(); i++)
+		{
+		    if(i == core)
+			continue;
+
+		    CacheLine *remote = cores[i]->find(address);
+		    if(remote == NULL)
+			continue;
+
+		    if(remote->state == MODIFIED)
+			interventions++;
+
+		    if(isWrite)
+			invalidateRemote(i, tag, accessSite, varInfo);
+		    else
+		    {
+			remote->state = SHARED;
+			sharedElsewhere = true;
+		    }
+		}
+
+		cores[core]->accessLine(address, accessSize, accessSite, varInfo,
+					&victimTag);
+		line = cores[core]->find(address);
+		assert(line != NULL);
+
+		if(isWrite)
+		    line->state = MODIFIED;
+		else
+		    line->state = sharedElsewhere ? SHARED : EXCLUSIVE;
+	    }
+	    else
+	    {
+		cores[core]->accessLine(address, accessSize, accessSite, varInfo,
+					&victimTag);
+
+		if(isWrite)
+		{
+		    /* An upgrade from SHARED invalidates the other copies.
+		     * EXCLUSIVE lines are upgraded silently. */
+		    if(line->state == SHARED)
+		    {
+			for(int i = 0; i < (int)cores.size(); i++)
+			{
+			    if(i != core)
+				invalidateRemote(i, tag, accessSite, varInfo);
+			}
+		    }
+		    line->state = MODIFIED;
+		}
+	    }
+
+	    /* Remember which bytes we wrote in the lines
+	     * the other cores have lost to us. */
+	    if(isWrite)
+	    {
+		for(int i = 0; i < (int)cores.size(); i++)
+		{
+		    if(i == core)
+			continue;
+
+		    auto it = remotelyWritten[i].find(tag);
+		    if(it != remotelyWritten[i].end())
+			it->second |= accessMask;
+		}
+	    }
+	}
+
+    void invalidateRemote(int core, size_t tag,
+			  const string &accessSite, const string &varInfo)
+	{
+	    if(!cores[core]->invalidate(tag))
+		return;
+
+	    SharingStats &ls = lineStats[tag];
+
+	    invalidations++;
+	    ls.invalidations++;
+	    siteStats[siteKey(accessSite, varInfo)].invalidations++;
+	    if(ls.varInfo.empty())
+		ls.varInfo = varInfo;
+
+	    /* Start tracking the bytes written to
+	     * this line since the core lost it. */
+	    remotelyWritten[core][tag].reset();
+	}
+};
+/***************************************************************************
+ * END CACHE SIMULATION CODE
+/****************************************************************************/
 
 /***************************************************************************
  * BEGIN DATA ANALYSIS CODE
 /****************************************************************************/
 
-/*
- * These functions summarize the maps of waste records, so we can 
- * display them in a user-friendly way. We will group the records
- * by source code line(access site) and display them in the order of decreasing
- * waste occurrences.
+/* Print the waste summaries of a cache, grouped by source code
+ * line (access site) in the order of decreasing waste occurrences.
  */
-template <class T>
-void summarizeWasteMap(unordered_multimap<string, T> &ungroupedMap,
-		       multimap<int, tuple<string, vector<T>>> &groupedMap)
+void printWasteMaps(CacheLevel *level)
 {
+    WasteMaps &w = level->waste;
 
-    /* Iterate the map. Once we encounter a new source line,
-     * count the number of its associated waste records, 
-     * put that in the summarized map, where the count is the key, 
-     * and the value is the list (vector) of associated waste records.
-     */
-    for(auto it = ungroupedMap.begin(); it != ungroupedMap.end(); it++) 
+    if(MULTIPLE_CACHES)
+    {
+	cout << "#################################################" << endl;
+	cout << "               WASTE IN " << level->name << endl;
+	cout << "#################################################" << endl;
+    }
+
+    cout << "*************************************************" << endl;
+    cout << "         ZERO REUSE MAP SUMMARIZED               " << endl;
+    cout << "*************************************************" << endl;
+    w.zeroReuse.print();
+
+    cout << endl;
+    cout << "*************************************************" << endl;
+    cout << "         LOW UTILIZATION MAP SUMMARIZED          " << endl;
+    cout << "*************************************************" << endl;
+    w.lowUtil.print();
+
+    if(WANT_SPLITS)
+    {
+	cout << endl;
+	cout << "*************************************************" << endl;
+	cout << "         HOT/COLD SPLIT SUGGESTIONS              " << endl;
+	cout << "*************************************************" << endl;
+	w.typeUsage.print();
+    }
+}
+
+/* A part of an allocated type: a field, or bytes between the fields */
+class TypeSegment
+{
+public:
+    size_t offset;
+    size_t size;
+    string name;
+    size_t fetched, used;
+    bool hot;
+};
+
+/* Split the type into fields and unnamed runs of bytes, and tell
+ * which of them are hot */
+vector<TypeSegment> segmentType(AllocatedType *type, TypeUsage &u)
+{
+    vector<TypeSegment> segments;
+    size_t offset = 0;
+
+    while(offset < type->itemSize)
     {
+	TypeSegment seg;
+	map<size_t, TypeField>::iterator f = type->fields.lower_bound(offset);
 
-	vector<T> curVector;	
-	string curAccessSite = it->first;
+	seg.offset = offset;
+	if(f != type->fields.end() && f->first == offset)
+	{
+	    seg.name = f->second.name;
+	    seg.size = f->second.size;
+	}
+	else
+	{
+	    seg.name = "<unnamed>";
+	    seg.size = (f == type->fields.end() ? type->itemSize : f->first) - offset;
+	}
+	/* Fields accessed with different sizes may overlap */
+	seg.size = min(seg.size, type->itemSize - offset);
 
-	do 
+	seg.fetched = seg.used = 0;
+	for(size_t i = offset; i < offset + seg.size; i++)
 	{
-	    curVector.push_back(it->second);
-	    ++it;
-	} while (it != ungroupedMap.end() && curAccessSite.compare(it->first)==0);
-	
-	tuple<string, vector<T>> gRecs = make_tuple(curAccessSite, curVector); 
-	groupedMap.insert(make_pair(curVector.size(), gRecs));	
+	    seg.fetched += u.fetched[i];
+	    seg.used += u.used[i];
+	}
+	seg.hot = seg.fetched > 0
+	    && (float)seg.used / (float)seg.fetched >= COLD_USE_THRESHOLD;
 
-	if(it == ungroupedMap.end())
-	  break;
+	segments.push_back(seg);
+	offset += seg.size;
     }
+    return segments;
 }
 
-template <class T>
-void printSummarizedMap(multimap<int, tuple<string, vector<T>>> & groupedMap)
+/* Print the byte usage of the types with the most fetched bytes that
+ * were never used, and how to split them.
+ */
+void TypeUsageMap::print()
 {
-    for(auto it = groupedMap.rbegin(); it != groupedMap.rend(); it++) 
+    vector<pair<size_t, AllocatedType*> > byWaste;
+
+    for(auto &t: types)
     {
-        cout << it->first << " waste occurrences" << endl;
+	size_t fetched = 0, used = 0;
 
-	tuple<string, vector<T>> gRecs = it->second;
+	for(size_t i = 0; i < t.first->itemSize; i++)
+	{
+	    fetched += t.second.fetched[i];
+	    used += t.second.used[i];
+	}
+	byWaste.push_back(make_pair(fetched - used, t.first));
+    }
+    sort(byWaste.rbegin(), byWaste.rend());
 
-	string accessSite = get<0>(gRecs); 
-	vector<T> recs = get<1>(gRecs); 
+    if(byWaste.empty())
+    {
+	cout << "No evicted line held allocated items. Note that packed "
+	     << "traces have no allocation records." << endl;
+	return;
+    }
 
-        cout << accessSite << endl;
-	for(int i = 0; i < recs.size(); i++)
-	    cout << recs[i] << endl;
+    for(size_t i = 0; i < byWaste.size() && i < SPLIT_TOP_TYPES; i++)
+    {
+	AllocatedType *type = byWaste[i].second;
+	TypeUsage &u = types[type];
+	vector<TypeSegment> segments = segmentType(type, u);
+	size_t fetched = 0, used = 0, hotSize = 0, coldSize = 0;
+	size_t hotUnnamed = 0, coldUnnamed = 0;
+	string hotNames, coldNames;
+
+	for(TypeSegment &seg: segments)
+	{
+	    string &names = seg.hot ? hotNames : coldNames;
+
+	    fetched += seg.fetched;
+	    used += seg.used;
+	    (seg.hot ? hotSize : coldSize) += seg.size;
+	    if(seg.name.compare("<unnamed>") == 0)
+		(seg.hot ? hotUnnamed : coldUnnamed) += seg.size;
+	    else
+		names += (names.empty() ? "" : ", ") + seg.name;
+	}
+	if(hotUnnamed > 0)
+	    hotNames += (hotNames.empty() ? "" : ", ") + to_string(hotUnnamed) + " unnamed bytes";
+	if(coldUnnamed > 0)
+	    coldNames += (coldNames.empty() ? "" : ", ") + to_string(coldUnnamed) + " unnamed bytes";
+
+	cout << type->name << ": " << type->itemSize << "-byte items, "
+	     << u.lines << " evicted lines, " << fixed << setprecision(1)
+	     << (fetched ? 100.0 * used / fetched : 0.0)
+	     << "% of the fetched bytes used" << endl;
+	cout << "\toffset\tsize\tused%\tclass\tfield" << endl;
+	for(TypeSegment &seg: segments)
+	    cout << "\t" << seg.offset << "\t" << seg.size << "\t"
+		 << (seg.fetched ? 100.0 * seg.used / seg.fetched : 0.0) << "\t"
+		 << (seg.hot ? "hot" : "cold") << "\t" << seg.name << endl;
+	cout.unsetf(ios::fixed);
+
+	if(hotSize == 0)
+	    cout << "\tNo hot fields: the items are rarely used once fetched." << endl;
+	else if(coldSize == 0)
+	    cout << "\tNo cold fields: nothing to split." << endl;
+	else
+	    cout << "\tSplit: keep " << hotNames << " together ("
+		 << hotSize + SPLIT_POINTER_SIZE << " bytes with a pointer to the "
+		 << "cold part), move " << coldNames << " (" << coldSize
+		 << " bytes) to a separate cold structure" << endl;
+	cout << endl;
     }
 }
 
+/* Print the coherence stats gathered by CoherentCaches: the totals,
+ * then the access sites and the cache lines in the order of decreasing
+ * coherence misses. For each site, the invalidations are those its
+ * writes caused in other cores, and the misses are those it suffered.
+ */
+void printSharingReport(CoherentCaches *cc, int missLatency)
+{
+    size_t misses = cc->trueSharingMisses + cc->falseSharingMisses;
+
+    cout << "*************************************************" << endl;
+    cout << "               COHERENCE SUMMARY                 " << endl;
+    cout << "*************************************************" << endl;
+    cout << "Cores: " << cc->cores.size() << endl;
+    cout << "Invalidations: " << cc->invalidations << endl;
+    cout << "Coherence misses: " << misses << " (true sharing: "
+	 << cc->trueSharingMisses << ", false sharing: "
+	 << cc->falseSharingMisses << ")" << endl;
+    cout << "Misses served from a remote modified line: "
+	 << cc->interventions << endl;
+    cout << "Estimated cost of coherence misses at " << missLatency
+	 << " cycles each: " << misses * missLatency << " cycles, "
+	 << cc->falseSharingMisses * missLatency
+	 << " of them due to false sharing" << endl;
+    cout << endl;
+
+    multimap<pair<size_t, size_t>, pair<string, SharingStats>> sites;
+    for(auto &s: cc->siteStats)
+	sites.insert(make_pair(make_pair(s.second.coherenceMisses(),
+					 s.second.invalidations), s));
+
+    cout << "*************************************************" << endl;
+    cout << "         COHERENCE MISSES BY ACCESS SITE         " << endl;
+    cout << "*************************************************" << endl;
+    for(auto it = sites.rbegin(); it != sites.rend(); it++)
+    {
+	SharingStats &ss = it->second.second;
+
+	cout << ss.coherenceMisses() << " coherence misses ("
+	     << ss.trueSharingMisses << " true sharing, "
+	     << ss.falseSharingMisses << " false sharing), "
+	     << ss.invalidations << " invalidations" << endl;
+	cout << it->second.first << endl << endl;
+    }
+
+    multimap<pair<size_t, size_t>, pair<size_t, SharingStats>> lines;
+    for(auto &l: cc->lineStats)
+	lines.insert(make_pair(make_pair(l.second.coherenceMisses(),
+					 l.second.invalidations), l));
+
+    cout << "*************************************************" << endl;
+    cout << "          COHERENCE MISSES BY CACHE LINE         " << endl;
+    cout << "*************************************************" << endl;
+    for(auto it = lines.rbegin(); it != lines.rend(); it++)
+    {
+	SharingStats &ls = it->second.second;
+
+	cout << "0x" << hex << (it->second.first << lineOffsetBits) << dec
+	     << " " << ls.coherenceMisses() << " coherence misses ("
+	     << ls.trueSharingMisses << " true sharing, "
+	     << ls.falseSharingMisses << " false sharing), "
+	     << ls.invalidations << " invalidations" << endl;
+	cout << "\t" << ls.varInfo << endl;
+    }
+}
+
+/* Print what we know so far, while the trace is still being read */
+void printPartialReport(CacheHierarchy *cache, CoherentCaches *coherentCaches,
+			int coherenceMissLatency, size_t numRecords)
+{
+    cout << "=================================================" << endl;
+    cout << "     PARTIAL REPORT AFTER " << numRecords << " RECORDS" << endl;
+    cout << "=================================================" << endl;
+
+    if(coherentCaches)
+    {
+	coherentCaches->printStats();
+	for(CacheLevel *core: coherentCaches->cores)
+	    printWasteMaps(core);
+	printSharingReport(coherentCaches, coherenceMissLatency);
+    }
+    else
+    {
+	cache->printStats();
+	for(CacheLevel *level: cache->levels)
+	    printWasteMaps(level);
+    }
+    cout.flush();
+}
+
 /***************************************************************************
  * END DATA ANALYSIS CODE
 /****************************************************************************/
 
+/* Parse a level specification of the form <sets>:<assoc>[:<policy>] */
+bool parseLevelSpec(const char *spec, vector<LevelSpec> &levelSpecs)
+{
+    char *nptr;
+    int numSets, assoc;
+
+    numSets = (int)strtol(spec, &nptr, 10);
+    if(nptr == spec || *nptr != ':' || numSets <= 0)
+	return false;
+
+    spec = nptr + 1;
+    assoc = (int)strtol(spec, &nptr, 10);
+    if(nptr == spec || (*nptr != ':' && *nptr != '\0') || assoc <= 0)
+	return false;
+
+    levelSpecs.push_back(LevelSpec(numSets, assoc,
+				   (*nptr == ':') ? string(nptr + 1) : string("")));
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     char *fname = NULL;
     char *nptr;
-    char c;
-    ifstream traceFile;
+    int c;
+    TraceSlice slice;
+    vector<LevelSpec> levelSpecs;
+    string defaultPolicy = LRUPolicy::name();
+    bool inclusive = false;
+    bool coherent = false;
+    int numCores = 0;
+    int coherenceMissLatency = 100; /* cycles */
+    size_t reportInterval = 0; /* records between partial reports */
+
 
-    
     /* Right now we don't check that the number of sets
      * and the cache line size are a power of two, but
      * we probably should. 
      */
-    while ((c = getopt (argc, argv, "a:f:l:s:r")) != -1)
+    while ((c = getopt_long (argc, argv, "a:e:f:HikK:l:L:mn:p:R:s:rx:",
+			     sliceOptions, NULL)) != -1)
 	switch(c)
 	{
 	case 'a': /* Associativity */
@@ -628,9 +1772,39 @@ int main(int argc, char *argv[])
 	    else
 		cout << "Associativity set to "<< ASSOC << endl;
 	    break;
+	case 'e': /* Example waste records to keep per site */
+	    EXAMPLES_PER_SITE = (int)strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || EXAMPLES_PER_SITE < 0)
+	    {
+		cerr << "Invalid argument for the number of examples per site: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
 	case 'f':
 	    fname = optarg;
 	    break;
+	case 'H': /* Hot/cold split suggestions */
+	    WANT_SPLITS = true;
+	    break;
+	case 'i': /* Inclusive hierarchy */
+	    inclusive = true;
+	    break;
+	case 'k': /* Skylake client: 32KB 8-way L1D, 256KB 4-way L2, 8MB 16-way LLC */
+	    levelSpecs.clear();
+	    levelSpecs.push_back(LevelSpec(64, 8));
+	    levelSpecs.push_back(LevelSpec(1024, 4));
+	    levelSpecs.push_back(LevelSpec(8*1024, 16));
+	    break;
+	case 'K': /* Access sites to track in the waste summaries */
+	    TOP_K_CAPACITY = (int)strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || TOP_K_CAPACITY <= 0)
+	    {
+		cerr << "Invalid argument for the number of tracked sites: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
 	case 'l':
 	    CACHE_LINE_SIZE = strtol(optarg, &nptr, 10);
 	    if(nptr == optarg && CACHE_LINE_SIZE == 0)
@@ -640,11 +1814,43 @@ int main(int argc, char *argv[])
 		exit(-1);
 	    }
 	    else
-		cout << "Associativity set to "<< CACHE_LINE_SIZE << endl;
+		cout << "Cache line size set to "<< CACHE_LINE_SIZE << endl;
+	    break;
+	case 'L': /* Add a cache level: <sets>:<assoc>[:<policy>] */
+	    if(!parseLevelSpec(optarg, levelSpecs))
+	    {
+		cerr << "Invalid cache level specification: " << optarg << endl;
+		cerr << "Expecting <sets>:<assoc>[:<policy>]" << endl;
+		exit(-1);
+	    }
+	    break;
+	case 'm': /* Coherent private caches */
+	    coherent = true;
+	    break;
+	case 'n': /* Number of cores for the coherent mode */
+	    numCores = (int)strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || numCores < 0)
+	    {
+		cerr << "Invalid argument for the number of cores: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case 'p': /* Replacement policy */
+	    defaultPolicy = optarg;
 	    break;
 	case 'r':
 	    WANT_RAW_OUTPUT = true;
 	    break;
+	case 'R': /* Partial report every so many million records */
+	    reportInterval = strtol(optarg, &nptr, 10) * 1000000;
+	    if(nptr == optarg || reportInterval == 0)
+	    {
+		cerr << "Invalid argument for the partial report interval: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
 	case 's': /* Number of cache sets */
     	    NUM_SETS = (int)strtol(optarg, &nptr, 10);
 	    if(nptr == optarg && NUM_SETS == 0)
@@ -656,6 +1862,21 @@ int main(int argc, char *argv[])
 	    else
 		cout << "Number of cache sets set to "<< NUM_SETS << endl;
 	    break;
+	case 'x': /* Latency of a coherence miss */
+	    coherenceMissLatency = (int)strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || coherenceMissLatency < 0)
+	    {
+		cerr << "Invalid argument for the coherence miss latency: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case OPT_FROM: /* Only simulate a slice of the trace */
+	case OPT_TO:
+	case OPT_THREADS:
+	    if(!slice.parseOption(c, optarg))
+		exit(-1);
+	    break;
 	case '?':
 	default:
 	    cerr << "Unknown option or missing option argument." << endl;
@@ -665,71 +1886,134 @@ int main(int argc, char *argv[])
 
     if(fname == NULL)
     {
-	cerr << "Please provide input trace file with the -f option." << endl;
+	cerr << "Please provide input trace file with the -f option "
+	     << "(\"-f -\" reads the trace from stdin)." << endl;
 	exit(-1);
     }
 
-    Cache *cache = new Cache(NUM_SETS, ASSOC, CACHE_LINE_SIZE);
-    cache->printParams();
- 
-    /* Let's open the trace file */
-    traceFile.open(fname);
-    if(!traceFile.is_open())
+    if(CACHE_LINE_SIZE > MAX_LINE_SIZE || (CACHE_LINE_SIZE & (CACHE_LINE_SIZE - 1)))
     {
-	cerr << "Failed to open file " << fname << endl;
+	cerr << "The cache line size must be a power of two no larger than "
+	     << MAX_LINE_SIZE << endl;
 	exit(-1);
     }
+    lineOffsetBits = log2(CACHE_LINE_SIZE);
+
+    /* Without any -L or -k options we simulate a single level
+     * configured with -s and -a. */
+    if(levelSpecs.empty())
+	levelSpecs.push_back(LevelSpec(NUM_SETS, ASSOC));
+    MULTIPLE_CACHES = levelSpecs.size() > 1 || coherent;
+    for(LevelSpec &spec: levelSpecs)
+    {
+	if(spec.policy.empty())
+	    spec.policy = defaultPolicy;
+    }
 
-    string line;
+    CacheHierarchy *cache = NULL;
+    CoherentCaches *coherentCaches = NULL;
 
-    /* Read the input line by line */
-    while(!traceFile.eof())
+    if(coherent)
     {
-	getline(traceFile, line);
-	parseAndSimulate(line, cache);
+	/* Every core gets a private cache with the
+	 * geometry of the first level. */
+	if(levelSpecs.size() > 1)
+	{
+	    cerr << "The coherent mode simulates a single level of private "
+		 << "caches. Please specify only one cache level." << endl;
+	    exit(-1);
+	}
+	coherentCaches = new CoherentCaches(numCores, &levelSpecs[0],
+					    levelSpecs[0].policy);
+	cout << "Coherent private caches (MESI), "
+	     << (numCores ? to_string(numCores) + " cores" : "one core per thread")
+	     << endl;
+	cout << "Line size      = " << CACHE_LINE_SIZE << endl;
+	cout << "Number of sets = " << levelSpecs[0].numSets << endl;
+	cout << "Associativity  = " << levelSpecs[0].assoc << endl;
     }
-    
-    /* Print the waste maps */
-    cout << "*************************************************" << endl;
-    cout << "               ZERO REUSE MAP                    " << endl;
-    cout << "*************************************************" << endl;
-
-    for(auto it = zeroReuseMap.begin(); it != zeroReuseMap.end(); it++) 
+    else
     {
-        cout << it->first << endl;
-        cout << (ZeroReuseRecord&) it->second << endl;
-
+	cache = new CacheHierarchy(inclusive);
+	for(size_t i = 0; i < levelSpecs.size(); i++)
+	{
+	    CacheLevel *level = makeCacheLevel("L" + to_string(i + 1),
+					       levelSpecs[i].numSets,
+					       levelSpecs[i].assoc,
+					       CACHE_LINE_SIZE, levelSpecs[i].policy);
+	    if(level == NULL)
+		exit(-1);
+	    cache->addLevel(level);
+	}
+	cache->printParams();
     }
 
-    cout << endl;
-    
-    /* Print the waste maps */
-    cout << "*************************************************" << endl;
-    cout << "               LOW UTILIZATION MAP               " << endl;
-    cout << "*************************************************" << endl;
-
-    for(auto it = lowUtilMap.begin(); it != lowUtilMap.end(); it++) 
+    /* A partial report can be requested at any time with SIGUSR1 */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = requestPartialReport;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    /* Let's open the trace file. The trace is read and parsed
+     * on a separate thread, while we run the simulation. */
+    TraceStream traceStream(fname);
+    traceStream.select(slice);
+    if(WANT_SPLITS)
+	traceStream.withAllocations();
+    if(!traceStream.start())
     {
-        cout << it->first << endl;
-        cout << (LowUtilRecord&)it->second << endl;
-
+	cerr << "Failed to open file " << fname << endl;
+	exit(-1);
     }
 
-    summarizeWasteMap<ZeroReuseRecord>(zeroReuseMap, groupedZeroReuseMap);
-    cout << "*************************************************" << endl;
-    cout << "         ZERO REUSE MAP SUMMARIZED               " << endl;
-    cout << "*************************************************" << endl;
-    printSummarizedMap<ZeroReuseRecord>(groupedZeroReuseMap);
+    vector<TraceRecord> batch;
+    size_t numRecords = 0, nextReport = reportInterval;
 
-    summarizeWasteMap<LowUtilRecord>(lowUtilMap, groupedLowUtilMap);
-    cout << endl;
-    cout << "*************************************************" << endl;
-    cout << "         LOW UTILIZATION MAP SUMMARIZED          " << endl;
-    cout << "*************************************************" << endl;
-    printSummarizedMap<LowUtilRecord>(groupedLowUtilMap);
+    while(traceStream.next(batch))
+    {
+	for(TraceRecord &rec: batch)
+	{
+	    if(rec.isAlloc)
+	    {
+		trackAllocation(rec);
+		continue;
+	    }
+	    if(WANT_SPLITS)
+		learnField(rec);
 
-}
+	    numRecords++;
+	    if(coherent)
+		coherentCaches->access(rec.tid, rec.isWrite, rec.address,
+				       rec.accessSize, rec.accessSite, rec.varInfo);
+	    else
+		cache->access(rec.address, rec.accessSize,
+			      rec.accessSite, rec.varInfo);
+	}
 
+	if(partialReportRequested || (reportInterval && numRecords >= nextReport))
+	{
+	    partialReportRequested = 0;
+	    while(reportInterval && nextReport <= numRecords)
+		nextReport += reportInterval;
+	    printPartialReport(cache, coherentCaches, coherenceMissLatency, numRecords);
+	}
+    }
 
+    if(coherent)
+    {
+	coherentCaches->printStats();
+
+	for(CacheLevel *core: coherentCaches->cores)
+	    printWasteMaps(core);
 
+	printSharingReport(coherentCaches, coherenceMissLatency);
+    }
+    else
+    {
+	cache->printStats();
 
+	for(CacheLevel *level: cache->levels)
+	    printWasteMaps(level);
+    }
+}
@@ -0,0 +1,273 @@
+/*
+ * This tool reads a columnar trace written by memtracker (-c, see
+ * ../columnar.hpp). By default it finds the cache lines that are
+ * accessed by more than one thread, reading only the address, thread ID
+ * and access type columns. Row groups outside the address range given
+ * with -A are skipped without reading them.
+ *
+ * With -d it instead prints the access records in the text format of
+ * the trace, so a columnar trace can be fed to the other tools:
+ *
+ * % ./colscan -f trace.col -d | ./wa -f -
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctgmath>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../columnar.hpp"
+
+using namespace std;
+
+int CACHE_LINE_SIZE = 64;  /* in bytes */
+int lineOffsetBits;
+
+/* How many shared lines to report */
+int TOP_N = 20;
+
+/* Only look at the accesses to these addresses */
+uint64_t rangeStart = 0, rangeEnd = ~(uint64_t)0;
+
+/* Who touched a cache line. Few lines are touched by many
+ * threads, so we keep the thread IDs in short vectors.
+ */
+class LineSharing
+{
+public:
+    size_t accesses;
+    size_t writes;
+    vector<uint64_t> threads;
+    vector<uint64_t> writers;
+
+    LineSharing()
+	: accesses(0), writes(0) {}
+
+    void add(uint64_t tid, bool isWrite)
+	{
+	    accesses++;
+	    if(find(threads.begin(), threads.end(), tid) == threads.end())
+		threads.push_back(tid);
+
+	    if(!isWrite)
+		return;
+	    writes++;
+	    if(find(writers.begin(), writers.end(), tid) == writers.end())
+		writers.push_back(tid);
+	}
+
+    /* Written by one thread and accessed by another */
+    bool writeShared() const
+	{
+	    return threads.size() > 1 && writers.size() > 0;
+	}
+};
+
+bool inRange(const RowGroupInfo &rg)
+{
+    return rg.maxAddress >= rangeStart && rg.minAddress < rangeEnd;
+}
+
+void readOrDie(ColumnarReader &reader, const RowGroupInfo &rg, int column,
+	       vector<uint64_t> &values)
+{
+    if(!reader.readColumn(rg, column, values))
+    {
+	cerr << "Corrupt " << columnName(column) << " column in the trace" << endl;
+	exit(-1);
+    }
+}
+
+void findSharing(ColumnarReader &reader)
+{
+    unordered_map<uint64_t, LineSharing> lines;
+    vector<uint64_t> address, tid, type;
+    size_t accesses = 0, skippedGroups = 0;
+
+    for(const RowGroupInfo &rg: reader.rowGroups)
+    {
+	if(!inRange(rg))
+	{
+	    skippedGroups++;
+	    continue;
+	}
+
+	readOrDie(reader, rg, COL_ADDRESS, address);
+	readOrDie(reader, rg, COL_TID, tid);
+	readOrDie(reader, rg, COL_TYPE, type);
+
+	for(size_t i = 0; i < rg.numRows; i++)
+	{
+	    if(address[i] < rangeStart || address[i] >= rangeEnd)
+		continue;
+	    accesses++;
+	    lines[address[i] >> lineOffsetBits].add(tid[i], type[i] != 0);
+	}
+    }
+
+    vector<pair<size_t, uint64_t>> shared;
+    size_t numShared = 0;
+
+    for(auto &l: lines)
+    {
+	if(l.second.threads.size() > 1)
+	    numShared++;
+	if(l.second.writeShared())
+	    shared.push_back(make_pair(l.second.accesses, l.first));
+    }
+    sort(shared.rbegin(), shared.rend());
+
+    cout << "Row groups: " << reader.rowGroups.size() << ", skipped "
+	 << skippedGroups << endl;
+    cout << "Column bytes read: " << reader.bytesRead << endl;
+    cout << "Accesses: " << accesses << endl;
+    cout << "Cache lines: " << lines.size() << endl;
+    cout << "Lines accessed by more than one thread: " << numShared << endl;
+    cout << "Lines written by one thread and accessed by another: "
+	 << shared.size() << endl;
+
+    cout << "*************************************************" << endl;
+    cout << "           MOST ACCESSED SHARED LINES            " << endl;
+    cout << "*************************************************" << endl;
+    cout << setw(18) << "line" << setw(12) << "accesses" << setw(12) << "writes"
+	 << "  threads (writers)" << endl;
+
+    for(size_t i = 0; i < shared.size() && (int)i < TOP_N; i++)
+    {
+	LineSharing &ls = lines[shared[i].second];
+
+	cout << "0x" << hex << setw(16) << setfill('0')
+	     << (shared[i].second << lineOffsetBits) << dec << setfill(' ')
+	     << setw(12) << ls.accesses << setw(12) << ls.writes << "  ";
+	for(uint64_t t: ls.threads)
+	    cout << t << " ";
+	cout << "(";
+	for(size_t w = 0; w < ls.writers.size(); w++)
+	    cout << (w ? " " : "") << ls.writers[w];
+	cout << ")" << endl;
+    }
+}
+
+/* Print the access records as memtracker prints them */
+void dumpRecords(ColumnarReader &reader)
+{
+    vector<uint64_t> columns[NUM_COLUMNS];
+    const vector<string> &sites = reader.dictionary(COL_SITE);
+    const vector<string> &functions = reader.dictionary(COL_FUNCTION);
+    const vector<string> &variables = reader.dictionary(COL_VARIABLE);
+
+    for(const RowGroupInfo &rg: reader.rowGroups)
+    {
+	if(!inRange(rg))
+	    continue;
+
+	for(int c = 0; c < NUM_COLUMNS; c++)
+	    readOrDie(reader, rg, c, columns[c]);
+
+	for(size_t i = 0; i < rg.numRows; i++)
+	{
+	    uint64_t address = columns[COL_ADDRESS][i];
+
+	    if(address < rangeStart || address >= rangeEnd)
+		continue;
+
+	    if(columns[COL_SITE][i] >= sites.size()
+	       || columns[COL_FUNCTION][i] >= functions.size()
+	       || columns[COL_VARIABLE][i] >= variables.size())
+	    {
+		cerr << "Dictionary ID out of range in the trace" << endl;
+		exit(-1);
+	    }
+
+	    const string &var = variables[columns[COL_VARIABLE][i]];
+
+	    printf("%s %lu 0x%016lx %lu %s %s%s%s\n",
+		   columns[COL_TYPE][i] ? "write:" : "read:",
+		   (unsigned long)columns[COL_TID][i], (unsigned long)address,
+		   (unsigned long)columns[COL_SIZE][i],
+		   functions[columns[COL_FUNCTION][i]].c_str(),
+		   sites[columns[COL_SITE][i]].c_str(),
+		   var.length() > 0 ? " " : "", var.c_str());
+	}
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char *fname = NULL;
+    char *nptr;
+    int c;
+    bool dump = false;
+
+    while ((c = getopt (argc, argv, "A:df:l:n:")) != -1)
+	switch(c)
+	{
+	case 'A':
+	    rangeStart = strtoull(optarg, &nptr, 16);
+	    if(nptr == optarg || *nptr != '-')
+	    {
+		cerr << "Invalid address range: " << optarg
+		     << ". Expected <start>-<end> in hex." << endl;
+		exit(-1);
+	    }
+	    rangeEnd = strtoull(nptr + 1, &nptr, 16);
+	    break;
+	case 'd':
+	    dump = true;
+	    break;
+	case 'f':
+	    fname = optarg;
+	    break;
+	case 'l':
+	    CACHE_LINE_SIZE = strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || CACHE_LINE_SIZE <= 0
+	       || (CACHE_LINE_SIZE & (CACHE_LINE_SIZE - 1)))
+	    {
+		cerr << "Invalid argument for the cache line size: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case 'n':
+	    TOP_N = strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || TOP_N < 0)
+	    {
+		cerr << "Invalid argument for the number of lines to report: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case '?':
+	default:
+	    cerr << "Unknown option or missing option argument." << endl;
+	    exit(-1);
+	}
+
+    if(fname == NULL)
+    {
+	cerr << "Please provide the columnar trace file with the -f option." << endl;
+	exit(-1);
+    }
+
+    lineOffsetBits = log2(CACHE_LINE_SIZE);
+
+    ColumnarReader reader;
+    if(!reader.open(fname))
+    {
+	cerr << "Failed to open " << fname << " or it is not a columnar trace" << endl;
+	exit(-1);
+    }
+
+    if(dump)
+	dumpRecords(reader);
+    else
+	findSharing(reader);
+    return 0;
+}
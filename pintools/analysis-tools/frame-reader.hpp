@@ -0,0 +1,205 @@
+/*
+ * Reads a compressed trace (see ../trace-frames.hpp) and decompresses
+ * its frames in parallel. Every frame is decompressed and then handed
+ * to a processing function on one of the worker threads, so the tools
+ * can parse or convert the frames in parallel too. The results are
+ * returned to the consumer in the order of the frames in the trace.
+ *
+ * A reader thread reads the frames into a ring of slots; the workers
+ * process the slots in any order, and the consumer takes the results
+ * from the slots in order. The number of slots bounds the memory used
+ * for the frames read ahead.
+ */
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../trace-frames.hpp"
+
+template <class Result>
+class ParallelFrameReader
+{
+public:
+    /* Turns the text of a frame into a result */
+    typedef std::function<void(const char *text, size_t len, Result &result)> Processor;
+
+    ParallelFrameReader(std::istream &in, Processor process, int numThreads = 0)
+	: in(in), process(process), numThreads(numThreads), head(0), tail(0),
+	  count(0), readerDone(false), corrupt(false), stopping(false)
+	{
+	    if(this->numThreads <= 0)
+		this->numThreads = defaultThreads();
+	    slots.resize(2 * this->numThreads + 2);
+	}
+
+    ~ParallelFrameReader()
+	{
+	    {
+		std::unique_lock<std::mutex> lk(m);
+		stopping = true;
+	    }
+	    slotFree.notify_all();
+	    jobReady.notify_all();
+
+	    if(reader.joinable())
+		reader.join();
+	    for(std::thread &t: workers)
+		t.join();
+	}
+
+    /* Check the magic at the beginning of the trace and start
+     * the threads, reading from the frame at offset if it is not 0.
+     * Return false if this is not a compressed trace.
+     */
+    bool start(std::streamoff offset = 0)
+	{
+	    if(!readFrameMagic(in))
+		return false;
+	    if(offset != 0 && !in.seekg(offset))
+		return false;
+
+	    reader = std::thread(&ParallelFrameReader::readFrames, this);
+	    for(int i = 0; i < numThreads; i++)
+		workers.push_back(std::thread(&ParallelFrameReader::processFrames, this));
+	    return true;
+	}
+
+    /* Get the result for the next frame. The previous contents of
+     * result are discarded. Return false once the trace is over.
+     */
+    bool next(Result &result)
+	{
+	    std::unique_lock<std::mutex> lk(m);
+
+	    resultReady.wait(lk, [this]{
+		    return slots[head].state == PROCESSED || (readerDone && count == 0);
+		});
+	    if(slots[head].state != PROCESSED)
+		return false;
+
+	    std::swap(result, slots[head].result);
+	    slots[head].state = EMPTY;
+	    head = (head + 1) % slots.size();
+	    count--;
+	    slotFree.notify_one();
+	    return true;
+	}
+
+    /* Did we find a truncated or corrupt frame? */
+    bool failed()
+	{
+	    std::unique_lock<std::mutex> lk(m);
+	    return corrupt;
+	}
+
+    static int defaultThreads()
+	{
+	    int n = std::thread::hardware_concurrency();
+
+	    return n < 2 ? 1 : (n > 8 ? 8 : n - 1);
+	}
+
+private:
+    typedef enum {
+	EMPTY,
+	LOADED,
+	PROCESSED
+    } slot_state_t;
+
+    class Slot
+    {
+    public:
+	slot_state_t state;
+	std::string compressed;
+	size_t rawLength;
+	Result result;
+
+	Slot()
+	    : state(EMPTY), rawLength(0) {}
+    };
+
+    std::istream &in;
+    Processor process;
+    int numThreads;
+    std::thread reader;
+    std::vector<std::thread> workers;
+
+    /* Protected by m */
+    std::vector<Slot> slots;
+    size_t head, tail, count;
+    std::deque<size_t> jobs;
+    bool readerDone, corrupt, stopping;
+
+    std::mutex m;
+    std::condition_variable slotFree, jobReady, resultReady;
+
+    void readFrames()
+	{
+	    std::unique_lock<std::mutex> lk(m);
+
+	    while(true)
+	    {
+		slotFree.wait(lk, [this]{ return count < slots.size() || stopping; });
+		if(stopping)
+		    break;
+
+		/* Nobody else touches an empty slot */
+		Slot &s = slots[tail];
+		lk.unlock();
+		frame_status_t status = readFrame(in, s.compressed, s.rawLength);
+		lk.lock();
+
+		if(status != FRAME_OK)
+		{
+		    if(status == FRAME_CORRUPT)
+			corrupt = true;
+		    break;
+		}
+
+		s.state = LOADED;
+		jobs.push_back(tail);
+		tail = (tail + 1) % slots.size();
+		count++;
+		jobReady.notify_one();
+	    }
+
+	    readerDone = true;
+	    jobReady.notify_all();
+	    resultReady.notify_all();
+	}
+
+    void processFrames()
+	{
+	    std::string text;
+	    std::unique_lock<std::mutex> lk(m);
+
+	    while(true)
+	    {
+		jobReady.wait(lk, [this]{ return !jobs.empty() || readerDone || stopping; });
+		if(jobs.empty() || stopping)
+		    break;
+
+		Slot &s = slots[jobs.front()];
+		jobs.pop_front();
+		lk.unlock();
+
+		bool ok = decompressFrame(s.compressed, s.rawLength, text);
+		if(!ok)
+		    text.clear();
+		process(text.data(), text.length(), s.result);
+
+		lk.lock();
+		if(!ok)
+		    corrupt = true;
+		s.state = PROCESSED;
+		resultReady.notify_all();
+	    }
+	}
+};
@@ -0,0 +1,282 @@
+/*
+ * This tool merges the per-thread packed traces that memtracker writes
+ * with -b <file> -pt (<file>.0, <file>.1, ...) into a single text trace,
+ * in the order of the timestamps of the accesses (see ../packed-trace.hpp).
+ * The tools that need the global order of the accesses, like wa in the
+ * coherent mode, can read the merged trace from a pipe:
+ *
+ *   memtracker-merge trace.pk.* | wa -f - -m
+ *
+ * The tools that look at one thread at a time can read the per-thread
+ * traces directly, and in parallel.
+ *
+ * Every trace is read and decoded by its own thread, which also formats
+ * the accesses as text, so most of the work is done in parallel. The main
+ * thread only merges the streams with a loser tree: after it takes the
+ * oldest access, the tree is updated with a single pass from the leaf of
+ * the trace it came from to the root, one comparison per level.
+ *
+ * Usage:
+ *   memtracker-merge [-o <file>] <trace> ...
+ *
+ * By default the merged trace is written to stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../packed-trace.hpp"
+
+using namespace std;
+
+/* Chunks of accesses decoded ahead, per trace */
+#define CHUNKS_AHEAD 4
+
+/* The key of a trace that is over */
+#define EXHAUSTED (~(uint64_t)0)
+
+/* An access, formatted as a line of the text trace */
+class Line
+{
+public:
+    uint64_t time;
+    string text;
+};
+
+/* Reads one of the traces on its own thread */
+class ThreadTrace
+{
+public:
+    ThreadTrace(const char *fname)
+	: fname(fname), reader(in), pos(0), done(false), corrupt(false) {}
+
+    ~ThreadTrace()
+	{
+	    if(decoder.joinable())
+		decoder.join();
+	}
+
+    bool start()
+	{
+	    in.open(fname.c_str(), ios::binary);
+	    if(!in.is_open() || !reader.start())
+		return false;
+
+	    decoder = thread(&ThreadTrace::decode, this);
+	    return true;
+	}
+
+    /* The next access of the trace, or NULL at the end */
+    const Line *next()
+	{
+	    if(pos == current.size())
+	    {
+		unique_lock<mutex> lk(m);
+
+		ready.wait(lk, [this]{ return !chunks.empty() || done; });
+		if(chunks.empty())
+		    return NULL;
+		current.swap(chunks.front());
+		chunks.pop_front();
+		pos = 0;
+		taken.notify_one();
+	    }
+	    return &current[pos++];
+	}
+
+    bool failed()
+	{
+	    unique_lock<mutex> lk(m);
+	    return corrupt;
+	}
+
+    string fname;
+
+private:
+    ifstream in;
+    PackedReader reader;
+    thread decoder;
+
+    /* Used by the consumer only */
+    vector<Line> current;
+    size_t pos;
+
+    /* Protected by m */
+    deque<vector<Line>> chunks;
+    bool done, corrupt;
+    mutex m;
+    condition_variable ready, taken;
+
+    void decode()
+	{
+	    vector<PackedAccess> accesses;
+	    vector<Line> chunk;
+	    uint64_t tid;
+
+	    while(reader.next(tid, accesses))
+	    {
+		chunk.resize(accesses.size());
+		for(size_t i = 0; i < accesses.size(); i++)
+		{
+		    chunk[i].time = accesses[i].time;
+		    chunk[i].text = reader.text(tid, accesses[i]);
+		    chunk[i].text.push_back('\n');
+		}
+
+		unique_lock<mutex> lk(m);
+		taken.wait(lk, [this]{ return chunks.size() < CHUNKS_AHEAD; });
+		chunks.push_back(vector<Line>());
+		chunks.back().swap(chunk);
+		ready.notify_one();
+	    }
+
+	    unique_lock<mutex> lk(m);
+	    corrupt = reader.failed();
+	    done = true;
+	    ready.notify_one();
+	}
+};
+
+/* A tournament tree over k sources that keeps, in every inner node, the
+ * source that lost the match played there. The overall winner, the source
+ * with the smallest key, is kept in node 0. Ties go to the lower source,
+ * so the merge is stable.
+ */
+class LoserTree
+{
+public:
+    LoserTree(const vector<uint64_t> &keys)
+	: k(keys.size()), keys(keys), tree(keys.size())
+	{
+	    vector<size_t> winners(2 * k);
+
+	    for(size_t i = 0; i < k; i++)
+		winners[k + i] = i;
+	    for(size_t n = k - 1; n >= 1; n--)
+	    {
+		size_t a = winners[2 * n], b = winners[2 * n + 1];
+
+		winners[n] = beats(a, b) ? a : b;
+		tree[n] = beats(a, b) ? b : a;
+	    }
+	    tree[0] = k > 1 ? winners[1] : 0;
+	}
+
+    size_t winner() const
+	{
+	    return tree[0];
+	}
+
+    /* The winner has a new key. Replay its matches up to the root. */
+    void replace(uint64_t key)
+	{
+	    size_t w = tree[0];
+
+	    keys[w] = key;
+	    for(size_t n = (k + w) / 2; n >= 1; n /= 2)
+		if(beats(tree[n], w))
+		    swap(tree[n], w);
+	    tree[0] = w;
+	}
+
+private:
+    size_t k;
+    vector<uint64_t> keys;
+    vector<size_t> tree;
+
+    bool beats(size_t a, size_t b) const
+	{
+	    return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+	}
+};
+
+int main(int argc, char *argv[])
+{
+    char *outName = NULL;
+    FILE *out = stdout;
+    int c;
+
+    while ((c = getopt (argc, argv, "o:")) != -1)
+	switch(c)
+	{
+	case 'o':
+	    outName = optarg;
+	    break;
+	case '?':
+	default:
+	    cerr << "Unknown option or missing option argument." << endl;
+	    exit(-1);
+	}
+
+    if(optind == argc)
+    {
+	cerr << "Please provide the per-thread traces to merge." << endl;
+	exit(-1);
+    }
+
+    if(outName != NULL && (out = fopen(outName, "w")) == NULL)
+    {
+	cerr << "Failed to create file " << outName << endl;
+	exit(-1);
+    }
+
+    vector<ThreadTrace*> traces;
+    vector<const Line*> heads;
+    vector<uint64_t> keys;
+
+    for(int i = optind; i < argc; i++)
+    {
+	ThreadTrace *t = new ThreadTrace(argv[i]);
+
+	if(!t->start())
+	{
+	    cerr << "Failed to open packed trace " << argv[i] << endl;
+	    exit(-1);
+	}
+	traces.push_back(t);
+    }
+
+    for(ThreadTrace *t: traces)
+    {
+	heads.push_back(t->next());
+	keys.push_back(heads.back() ? heads.back()->time : EXHAUSTED);
+    }
+
+    LoserTree tree(keys);
+    while(heads[tree.winner()] != NULL)
+    {
+	size_t w = tree.winner();
+	const Line *line = heads[w];
+
+	fwrite(line->text.data(), 1, line->text.length(), out);
+	heads[w] = traces[w]->next();
+	tree.replace(heads[w] ? heads[w]->time : EXHAUSTED);
+    }
+
+    int ret = 0;
+    for(ThreadTrace *t: traces)
+    {
+	if(t->failed())
+	{
+	    cerr << "The packed trace " << t->fname << " is truncated or corrupt" << endl;
+	    ret = 1;
+	}
+	delete t;
+    }
+
+    if(fclose(out) != 0)
+    {
+	cerr << "Failed to write the merged trace" << endl;
+	ret = 1;
+    }
+    return ret;
+}
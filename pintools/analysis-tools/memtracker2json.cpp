@@ -0,0 +1,463 @@
+/*
+ * A native version of scripts/memtracker2json.py. It converts the text
+ * trace produced by memtracker into the JSON events consumed by memvis
+ * ("allocation", "memory-access", "function-begin", "function-end" and
+ * "implicit-free") and produces exactly the same output as the script,
+ * including its handling of missing and empty fields.
+ *
+ * The script is the slowest stage of the memtracker -> memtracker2json ->
+ * memvis pipeline, and back-pressures the pintool through the pipe. Here
+ * we read the trace in large blocks, split the lines into fields in place,
+ * without copying them, and write the JSON through a large output buffer.
+ *
+ * Usage:
+ *   m2j [--infile <trace>] [--keepdots] > trace.json
+ *
+ * By default the trace is read from stdin. A compressed trace
+ * (memtracker -o <file> -z) is decompressed and converted in parallel,
+ * a frame per thread.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "frame-reader.hpp"
+
+using namespace std;
+
+#define INPUT_BUFFER_SIZE (4 * 1024 * 1024)
+#define OUTPUT_BUFFER_SIZE (4 * 1024 * 1024)
+
+/* A field of a trace record. It points into the input buffer. */
+class Token
+{
+public:
+    const char *p;
+    size_t len;
+
+    Token()
+	: p(""), len(0) {}
+};
+
+/* Output is accumulated in a large buffer and written out
+ * only when the buffer fills up. When converting the frames of a
+ * compressed trace, the output of a frame goes into a string instead.
+ */
+class OutputBuffer
+{
+public:
+    OutputBuffer(FILE *f)
+	: out(f), str(NULL), used(0)
+	{
+	    buf = new char[OUTPUT_BUFFER_SIZE];
+	}
+
+    OutputBuffer(string *s)
+	: out(NULL), str(s), buf(NULL), used(0) {}
+
+    ~OutputBuffer()
+	{
+	    flush();
+	    delete[] buf;
+	}
+
+    void write(const char *p, size_t len)
+	{
+	    if(str != NULL)
+	    {
+		str->append(p, len);
+		return;
+	    }
+
+	    if(used + len > OUTPUT_BUFFER_SIZE)
+	    {
+		flush();
+		if(len > OUTPUT_BUFFER_SIZE)
+		{
+		    fwrite(p, 1, len, out);
+		    return;
+		}
+	    }
+	    memcpy(buf + used, p, len);
+	    used += len;
+	}
+
+    void write(const Token &t)
+	{
+	    write(t.p, t.len);
+	}
+
+    /* For string literals */
+    template <size_t N>
+    void write(const char (&s)[N])
+	{
+	    write(s, N - 1);
+	}
+
+    void flush()
+	{
+	    if(out == NULL)
+		return;
+	    if(used > 0)
+		fwrite(buf, 1, used, out);
+	    used = 0;
+	    fflush(out);
+	}
+
+private:
+    FILE *out;
+    string *str;
+    char *buf;
+    size_t used;
+};
+
+/* Fields that are missing from a record are printed as "-" */
+const Token MISSING = []() { Token t; t.p = "-"; t.len = 1; return t; }();
+
+/* Split the line at every single space, like Python's line.split(" "):
+ * consecutive spaces produce empty fields. We only need the first
+ * maxWords fields. If restInLast is set, the last field extends to
+ * the end of the line, as if the remaining fields were joined with
+ * spaces. Return the number of fields found.
+ */
+int splitLine(const char *line, size_t len, Token *words, int maxWords,
+	      bool restInLast)
+{
+    const char *p = line, *end = line + len;
+    int n = 0;
+
+    while(n < maxWords)
+    {
+	const char *space;
+
+	if(restInLast && n == maxWords - 1)
+	    space = end;
+	else
+	{
+	    space = (const char*)memchr(p, ' ', end - p);
+	    if(space == NULL)
+		space = end;
+	}
+
+	words[n].p = p;
+	words[n].len = space - p;
+	n++;
+
+	if(space == end)
+	    break;
+	p = space + 1;
+    }
+    return n;
+}
+
+/* Python's str.strip(':') */
+Token stripColons(Token t)
+{
+    while(t.len > 0 && t.p[0] == ':')
+    {
+	t.p++;
+	t.len--;
+    }
+    while(t.len > 0 && t.p[t.len - 1] == ':')
+	t.len--;
+    return t;
+}
+
+bool startsWith(const char *line, size_t len, const char *prefix)
+{
+    size_t plen = strlen(prefix);
+
+    return len >= plen && memcmp(line, prefix, plen) == 0;
+}
+
+bool contains(const char *line, size_t len, const char *s)
+{
+    size_t slen = strlen(s);
+
+    if(len < slen)
+	return false;
+
+    for(const char *p = line; (p = (const char*)memchr(p, s[0], line + len - p)) != NULL; p++)
+    {
+	if((size_t)(line + len - p) < slen)
+	    break;
+	if(memcmp(p, s, slen) == 0)
+	    return true;
+    }
+    return false;
+}
+
+/* Python's str.isspace() for a single character */
+bool isPythonSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+void parseAlloc(const char *line, size_t len, OutputBuffer &out)
+{
+    Token words[9];
+    int n = splitLine(line, len, words, 9, false);
+
+    for(int i = n; i < 9; i++)
+	words[i] = MISSING;
+
+    out.write("{\"event\": \"allocation\", \"thread-id\": \"");
+    out.write(words[1]);
+    out.write("\", \"alloc-base\": \"");
+    out.write(words[2]);
+    out.write("\", \"type\": \"");
+    out.write(words[3]);
+    out.write("\", \"alloc-size\": \"");
+    out.write(words[4]);
+    out.write("\", \"num-items\": \"");
+    out.write(words[5]);
+    out.write("\", \"source-location\": \"");
+    out.write(words[6]);
+    out.write("\", \"var-name\": \"");
+    out.write(words[7]);
+    out.write("\", \"var-type\": \"");
+    out.write(words[8]);
+    out.write("\"}\n");
+}
+
+void parseMemoryAccess(const char *line, size_t len, OutputBuffer &out)
+{
+    Token words[9];
+    int n = splitLine(line, len, words, 9, true);
+
+    for(int i = n; i < 9; i++)
+	words[i] = MISSING;
+
+    out.write("{\"event\": \"memory-access\", \"type\": \"");
+    out.write(stripColons(words[0]));
+    out.write("\", \"thread-id\": \"");
+    out.write(words[1]);
+    out.write("\", \"address\": \"");
+    out.write(words[2]);
+    out.write("\", \"size\": \"");
+    out.write(words[3]);
+    out.write("\", \"function\": \"");
+    out.write(words[4]);
+    out.write("\", \"source-location\": \"");
+    out.write(words[5]);
+    out.write("\", \"alloc-location\": \"");
+    out.write(words[6]);
+    out.write("\", \"var-name\": \"");
+    out.write(words[7]);
+    out.write("\", \"var-type\": \"");
+    out.write(words[8]);
+    out.write("\"}\n");
+}
+
+void parseFunction(const char *line, size_t len, OutputBuffer &out)
+{
+    Token words[3];
+    int n = splitLine(line, len, words, 3, false);
+
+    for(int i = n; i < 3; i++)
+	words[i] = MISSING;
+
+    out.write("{\"event\": \"");
+    out.write(stripColons(words[0]));
+    out.write("\", \"thread-id\": \"");
+    out.write(words[1]);
+    out.write("\", \"name\": \"");
+    out.write(words[2]);
+    out.write("\"}\n");
+}
+
+void parseFree(const char *line, size_t len, OutputBuffer &out)
+{
+    Token words[2];
+    int n = splitLine(line, len, words, 2, false);
+
+    if(n < 2)
+    {
+	cerr << "implicit-free record without the base parameter";
+	return;
+    }
+
+    out.write("{\"event\": \"implicit-free\", \"base\": \"");
+    out.write(words[1]);
+    out.write("\"}\n");
+}
+
+void parseLine(const char *line, size_t len, bool keepdots, OutputBuffer &out)
+{
+    if(!keepdots)
+    {
+	if(contains(line, len, ".plt"))
+	    return;
+
+	if(contains(line, len, ".text"))
+	    return;
+    }
+
+    while(len > 0 && isPythonSpace(line[len - 1]))
+	len--;
+
+    if(startsWith(line, len, "alloc:"))
+	parseAlloc(line, len, out);
+    else if(startsWith(line, len, "read:") || startsWith(line, len, "write:"))
+	parseMemoryAccess(line, len, out);
+    else if(startsWith(line, len, "function-begin") || startsWith(line, len, "function-end"))
+	parseFunction(line, len, out);
+    else if(startsWith(line, len, "implicit-free"))
+	parseFree(line, len, out);
+}
+
+/* Read the trace in large blocks and convert it line by line.
+ * A line that does not fit in the buffer makes the buffer grow.
+ */
+void parse(FILE *trace, bool keepdots, OutputBuffer &out)
+{
+    vector<char> buf(INPUT_BUFFER_SIZE);
+    size_t used = 0;
+
+    while(true)
+    {
+	if(used == buf.size())
+	    buf.resize(buf.size() * 2);
+
+	size_t bytesRead = fread(&buf[used], 1, buf.size() - used, trace);
+	if(bytesRead == 0)
+	    break;
+	used += bytesRead;
+
+	const char *p = &buf[0], *end = &buf[0] + used;
+	const char *nl;
+	while((nl = (const char*)memchr(p, '\n', end - p)) != NULL)
+	{
+	    parseLine(p, nl - p, keepdots, out);
+	    p = nl + 1;
+	}
+
+	/* Move the incomplete last line to the front */
+	used = end - p;
+	memmove(&buf[0], p, used);
+    }
+
+    if(used > 0)
+	parseLine(&buf[0], used, keepdots, out);
+}
+
+/* Convert a compressed trace. Frames end at line boundaries,
+ * so every frame is converted on its own.
+ */
+bool parseFrames(istream &trace, bool keepdots, OutputBuffer &out)
+{
+    ParallelFrameReader<string> frames(trace,
+	[keepdots](const char *text, size_t len, string &json)
+	{
+	    OutputBuffer frameOut(&json);
+	    const char *end = text + len, *nl;
+
+	    json.clear();
+	    while(text < end)
+	    {
+		nl = (const char*)memchr(text, '\n', end - text);
+		if(nl == NULL)
+		    nl = end;
+		parseLine(text, nl - text, keepdots, frameOut);
+		text = nl + 1;
+	    }
+	});
+    string json;
+
+    if(!frames.start())
+    {
+	cerr << "m2j: the trace is not a valid compressed trace" << endl;
+	return false;
+    }
+
+    while(frames.next(json))
+	out.write(json.data(), json.length());
+
+    if(frames.failed())
+    {
+	cerr << "m2j: the compressed trace is truncated or corrupt" << endl;
+	return false;
+    }
+    return true;
+}
+
+void usage()
+{
+    cout << "usage: m2j [-h] [--infile INFILE] [--keepdots]" << endl << endl;
+    cout << "Convert memtracker trace to JSON." << endl << endl;
+    cout << "optional arguments:" << endl;
+    cout << "  -h, --help       show this help message and exit" << endl;
+    cout << "  --infile INFILE  Name of the trace file generated by the memtracker" << endl;
+    cout << "                   pintool. By default the trace is read from stdin." << endl;
+    cout << "  --keepdots       Do not skip records from .text and .plt when" << endl;
+    cout << "                   generating trace" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *infile = NULL;
+    bool keepdots = false;
+
+    for(int i = 1; i < argc; i++)
+    {
+	string arg = argv[i];
+
+	if(arg.compare("--keepdots") == 0)
+	    keepdots = true;
+	else if(arg.compare("--infile") == 0 && i + 1 < argc)
+	    infile = argv[++i];
+	else if(arg.compare(0, 9, "--infile=") == 0)
+	    infile = argv[i] + 9;
+	else if(arg.compare("-h") == 0 || arg.compare("--help") == 0)
+	{
+	    usage();
+	    return 0;
+	}
+	else
+	{
+	    usage();
+	    cerr << "m2j: error: unrecognized argument: " << arg << endl;
+	    return 2;
+	}
+    }
+
+    FILE *trace = stdin;
+    if(infile != NULL)
+    {
+	trace = fopen(infile, "r");
+	if(trace == NULL)
+	{
+	    cout << "File " << infile << " does not exist." << endl;
+	    return 1;
+	}
+    }
+
+    OutputBuffer out(stdout);
+    int c = getc(trace);
+    bool ok = true;
+
+    ungetc(c, trace);
+    if(c == (unsigned char)FRAME_MAGIC[0])
+    {
+	if(trace == stdin)
+	    ok = parseFrames(cin, keepdots, out);
+	else
+	{
+	    ifstream traceFile(infile, ios::binary);
+	    ok = parseFrames(traceFile, keepdots, out);
+	}
+    }
+    else
+	parse(trace, keepdots, out);
+    out.flush();
+
+    if(trace != stdin)
+	fclose(trace);
+    return ok ? 0 : 1;
+}
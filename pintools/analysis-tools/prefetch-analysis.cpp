@@ -0,0 +1,458 @@
+/*
+ * This tool reads a memtracker trace (in any of the formats read by
+ * TraceStream) and tells, for every access site, whether the addresses
+ * it accesses are predictable enough for a software prefetch to pay off.
+ *
+ * Every thread has a reference prediction table indexed by the access
+ * site, like the stride prefetcher of Chen and Baer (1995): an entry
+ * holds the last address of the site and the last stride, and moves
+ * between the initial, transient, steady and no-prediction states as
+ * the strides repeat or change. An access is predicted by its stride if
+ * the entry was steady and the address is the last one plus the stride.
+ *
+ * A hardware prefetcher would also notice pointer chasing by looking at
+ * the values loaded, but the trace has no values. Instead, we say that
+ * an access chases a pointer if it jumps far from the previous access
+ * of the site, and the thread read a pointer-sized value near that
+ * previous access in between: as in n = n->next, the next node is where
+ * the pointer in the previous node said. We can't tell that apart from
+ * a random array index read next to the previous element, so this is an
+ * estimate.
+ *
+ * Prefetching only matters for the accesses that miss, so we run the
+ * accesses through a fully associative LRU cache (-s lines) and report,
+ * for the sites with the most misses, the fraction of their misses the
+ * stride table or the pointer chasing detector predicted (the coverage),
+ * the number of accesses the thread makes between two accesses of the
+ * site, and how far ahead to prefetch to hide the miss latency (-d, in
+ * accesses of the thread) given that gap.
+ */
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <list>
+#include <utility>
+#include <unistd.h>
+#include <getopt.h>
+#include <ctgmath>
+#include <stdlib.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "trace-stream.hpp"
+
+using namespace std;
+
+int CACHE_LINE_SIZE = 64;  /* in bytes */
+int lineOffsetBits;
+size_t CACHE_LINES = 32768; /* of the LRU cache, 2MB with 64-byte lines */
+int LATENCY = 100;         /* of a miss, in accesses of the thread */
+int TOP_N = 20;            /* access sites to report */
+
+/* The size of a pointer, and how far from the previous access of a site
+ * a pointer read may be to count as a read of the pointer to the next
+ * node. A node larger than that is not recognized. */
+#define POINTER_SIZE 8
+#define NODE_SPAN 256
+
+/* Pointer reads of a thread that we remember */
+#define POINTER_READS 16
+
+/* A site with this fraction of its misses predicted is worth prefetching */
+#define GOOD_COVERAGE 0.5
+
+typedef enum {
+    RPT_INITIAL,
+    RPT_TRANSIENT,
+    RPT_STEADY,
+    RPT_NO_PREDICTION
+} rpt_state_t;
+
+/* An entry of the reference prediction table */
+class RptEntry
+{
+public:
+    bool seen;
+    size_t lastAddress;
+    long stride;
+    rpt_state_t state;
+    size_t lastAccess;  /* the number of the thread's access */
+
+    RptEntry()
+	: seen(false), lastAddress(0), stride(0), state(RPT_INITIAL), lastAccess(0) {}
+
+    /* Update the entry with a new address. Return true if it predicted it. */
+    bool update(size_t address)
+	{
+	    bool correct = (long)(address - lastAddress) == stride;
+	    bool predicted = correct && state == RPT_STEADY;
+
+	    switch(state)
+	    {
+	    case RPT_INITIAL:
+		state = correct ? RPT_STEADY : RPT_TRANSIENT;
+		break;
+	    case RPT_TRANSIENT:
+		state = correct ? RPT_STEADY : RPT_NO_PREDICTION;
+		break;
+	    case RPT_STEADY:
+		/* Keep the stride, a single irregular access does not
+		 * break a stream */
+		if(!correct)
+		    state = RPT_INITIAL;
+		break;
+	    case RPT_NO_PREDICTION:
+		if(correct)
+		    state = RPT_TRANSIENT;
+		break;
+	    }
+	    if(!correct && state != RPT_INITIAL)
+		stride = address - lastAddress;
+	    lastAddress = address;
+	    return predicted;
+	}
+};
+
+class PointerRead
+{
+public:
+    size_t address;
+    size_t access;
+};
+
+/* The prediction table and the recent pointer reads of a thread */
+class ThreadState
+{
+public:
+    size_t accesses;
+    vector<RptEntry> table;       /* by site */
+    PointerRead pointerReads[POINTER_READS];
+    int nextPointerRead;
+
+    ThreadState()
+	: accesses(0), nextPointerRead(0)
+	{
+	    memset(pointerReads, 0, sizeof(pointerReads));
+	}
+
+    /* Did we read a pointer near the address since the given access? */
+    bool readPointerNear(size_t address, size_t since)
+	{
+	    for(int i = 0; i < POINTER_READS; i++)
+	    {
+		PointerRead &r = pointerReads[i];
+
+		if(r.access >= since && r.access > 0
+		   && r.address + NODE_SPAN > address && r.address < address + NODE_SPAN)
+		    return true;
+	    }
+	    return false;
+	}
+
+    void addPointerRead(size_t address)
+	{
+	    pointerReads[nextPointerRead].address = address;
+	    pointerReads[nextPointerRead].access = accesses;
+	    nextPointerRead = (nextPointerRead + 1) % POINTER_READS;
+	}
+};
+
+/* What we found out about an access site */
+class SiteStats
+{
+public:
+    string name;
+    size_t accesses, misses;
+    size_t strideMisses;       /* misses predicted by the stride table */
+    size_t chaseMisses;        /* misses that chased a pointer */
+    size_t gaps, gapTotal;     /* accesses of the thread between two of the site */
+    map<long, size_t> strides; /* of the predicted misses */
+
+    SiteStats(const string &n)
+	: name(n), accesses(0), misses(0), strideMisses(0), chaseMisses(0),
+	  gaps(0), gapTotal(0) {}
+
+    double coverage(size_t predicted)
+	{
+	    return misses ? (double)predicted / misses : 0;
+	}
+
+    double gap()
+	{
+	    return gaps ? (double)gapTotal / gaps : 0;
+	}
+
+    long mainStride()
+	{
+	    long stride = 0;
+	    size_t count = 0;
+
+	    for(auto &s: strides)
+		if(s.second > count)
+		{
+		    stride = s.first;
+		    count = s.second;
+		}
+	    return stride;
+	}
+
+    /* How many iterations of the site ahead to prefetch, so that the
+     * line arrives before it is needed */
+    size_t lookahead()
+	{
+	    return max((size_t)1, (size_t)ceil(LATENCY / max(gap(), 1.0)));
+	}
+};
+
+/* A fully associative LRU cache, to tell the misses */
+class LRUCache
+{
+public:
+    /* Return true on a hit */
+    bool access(size_t line)
+	{
+	    unordered_map<size_t, list<size_t>::iterator>::iterator it = where.find(line);
+
+	    if(it != where.end())
+	    {
+		lines.splice(lines.begin(), lines, it->second);
+		return true;
+	    }
+	    lines.push_front(line);
+	    where[line] = lines.begin();
+	    if(lines.size() > CACHE_LINES)
+	    {
+		where.erase(lines.back());
+		lines.pop_back();
+	    }
+	    return false;
+	}
+
+private:
+    list<size_t> lines;   /* most recently used first */
+    unordered_map<size_t, list<size_t>::iterator> where;
+};
+
+LRUCache cache;
+unordered_map<int, ThreadState> threads;
+unordered_map<string, int> siteIds;
+vector<SiteStats> sites;
+
+void analyze(const TraceRecord &rec)
+{
+    unordered_map<string, int>::iterator id = siteIds.find(rec.accessSite);
+
+    if(id == siteIds.end())
+    {
+	id = siteIds.insert(make_pair(rec.accessSite, (int)sites.size())).first;
+	sites.push_back(SiteStats(rec.accessSite));
+    }
+
+    ThreadState &t = threads[rec.tid];
+    SiteStats &site = sites[id->second];
+
+    t.accesses++;
+    if(t.table.size() <= (size_t)id->second)
+	t.table.resize(id->second + 1);
+
+    RptEntry &e = t.table[id->second];
+    bool strided = false, chased = false;
+    long stride = 0;
+
+    if(e.seen)
+    {
+	size_t previous = e.lastAddress;
+	size_t distance = rec.address > previous ? rec.address - previous
+	    : previous - rec.address;
+
+	stride = rec.address - previous;
+	site.gaps++;
+	site.gapTotal += t.accesses - e.lastAccess;
+	strided = e.update(rec.address);
+	chased = !strided && distance >= NODE_SPAN
+	    && t.readPointerNear(previous, e.lastAccess);
+    }
+    else
+    {
+	e.seen = true;
+	e.lastAddress = rec.address;
+    }
+    e.lastAccess = t.accesses;
+
+    if(!rec.isWrite && rec.accessSize == POINTER_SIZE)
+	t.addPointerRead(rec.address);
+
+    site.accesses++;
+    if(cache.access(rec.address >> lineOffsetBits))
+	return;
+
+    site.misses++;
+    if(strided)
+    {
+	site.strideMisses++;
+	site.strides[stride]++;
+    }
+    else if(chased)
+	site.chaseMisses++;
+}
+
+string verdict(SiteStats &s)
+{
+    if(s.coverage(s.strideMisses) >= GOOD_COVERAGE)
+	return "strided: prefetch " + to_string(s.lookahead()) + " iterations ("
+	    + to_string(s.lookahead() * s.mainStride()) + " bytes) ahead";
+    if(s.coverage(s.chaseMisses) >= GOOD_COVERAGE)
+	return s.gap() >= LATENCY ? "pointer chasing: prefetch the next node"
+	    : "pointer chasing: the next node hides "
+	    + to_string((int)(100 * s.gap() / LATENCY)) + "% of the latency";
+    if(s.coverage(s.strideMisses + s.chaseMisses) >= GOOD_COVERAGE)
+	return "mixed strides and pointers";
+    return "unpredictable";
+}
+
+int main(int argc, char *argv[])
+{
+    char *fname = NULL;
+    char *nptr;
+    int c;
+    bool csv = false;
+    TraceSlice slice;
+
+    while ((c = getopt_long (argc, argv, "cd:f:l:n:s:", sliceOptions, NULL)) != -1)
+	switch(c)
+	{
+	case 'c':
+	    csv = true;
+	    break;
+	case 'd': /* Miss latency, in accesses */
+	    LATENCY = strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || LATENCY <= 0)
+	    {
+		cerr << "Invalid argument for the miss latency: " << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case 'f':
+	    fname = optarg;
+	    break;
+	case 'l':
+	    CACHE_LINE_SIZE = strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || CACHE_LINE_SIZE <= 0
+	       || (CACHE_LINE_SIZE & (CACHE_LINE_SIZE - 1)))
+	    {
+		cerr << "Invalid argument for the cache line size: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case 'n':
+	    TOP_N = strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || TOP_N < 0)
+	    {
+		cerr << "Invalid argument for the number of sites to report: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case 's': /* Lines in the LRU cache */
+	    CACHE_LINES = strtoul(optarg, &nptr, 10);
+	    if(nptr == optarg || CACHE_LINES == 0)
+	    {
+		cerr << "Invalid argument for the number of cache lines: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case OPT_FROM:
+	case OPT_TO:
+	case OPT_THREADS:
+	    if(!slice.parseOption(c, optarg))
+		exit(-1);
+	    break;
+	case '?':
+	default:
+	    cerr << "Unknown option or missing option argument." << endl;
+	    exit(-1);
+	}
+
+    if(fname == NULL)
+    {
+	cerr << "Please provide input trace file with the -f option." << endl;
+	exit(-1);
+    }
+
+    lineOffsetBits = log2(CACHE_LINE_SIZE);
+
+    TraceStream traceStream(fname);
+    traceStream.select(slice);
+    if(!traceStream.start())
+    {
+	cerr << "Failed to open file " << fname << endl;
+	exit(-1);
+    }
+
+    vector<TraceRecord> batch;
+    size_t accesses = 0, misses = 0;
+
+    while(traceStream.next(batch))
+    {
+	for(TraceRecord &rec: batch)
+	    analyze(rec);
+	accesses += batch.size();
+    }
+
+    vector<pair<size_t, int> > byMisses;
+    for(size_t i = 0; i < sites.size(); i++)
+    {
+	byMisses.push_back(make_pair(sites[i].misses, i));
+	misses += sites[i].misses;
+    }
+    sort(byMisses.rbegin(), byMisses.rend());
+
+    if(csv)
+	cout << "site,accesses,misses,stride_coverage,stride,pointer_coverage,"
+	     << "gap,lookahead" << endl;
+    else
+    {
+	cout << "Line size = " << CACHE_LINE_SIZE << ", LRU cache of "
+	     << CACHE_LINES << " lines, miss latency = " << LATENCY << " accesses" << endl;
+	cout << "Accesses: " << accesses << endl;
+	cout << "Misses: " << misses << endl;
+	cout << "*************************************************" << endl;
+	cout << "     PREFETCHABILITY OF THE TOP MISSING SITES    " << endl;
+	cout << "*************************************************" << endl;
+    }
+
+    for(int i = 0; i < (int)byMisses.size() && i < TOP_N; i++)
+    {
+	SiteStats &s = sites[byMisses[i].second];
+
+	if(s.misses == 0)
+	    break;
+	if(csv)
+	{
+	    cout << "\"" << s.name << "\"," << s.accesses << "," << s.misses << ","
+		 << s.coverage(s.strideMisses) << "," << s.mainStride() << ","
+		 << s.coverage(s.chaseMisses) << "," << s.gap() << ","
+		 << s.lookahead() << endl;
+	    continue;
+	}
+
+	cout << s.name << endl;
+	cout << "\t" << s.accesses << " accesses, " << s.misses << " misses" << endl;
+	cout << fixed << setprecision(1);
+	cout << "\tstride coverage " << 100 * s.coverage(s.strideMisses)
+	     << "% (stride " << s.mainStride() << "), pointer chasing coverage "
+	     << 100 * s.coverage(s.chaseMisses) << "%" << endl;
+	cout << "\t" << s.gap() << " accesses between iterations, lookahead "
+	     << s.lookahead() << " iterations" << endl;
+	cout.unsetf(ios::fixed);
+	cout << "\t" << verdict(s) << endl << endl;
+    }
+}
@@ -0,0 +1,424 @@
+/*
+ * This tool reads a memtracker trace (in any of the formats read by
+ * TraceStream) and computes, in a single pass, the LRU stack distance
+ * of every access to a cache line: the number of distinct cache lines
+ * accessed since the previous access to the same line. A fully
+ * associative LRU cache of C lines misses exactly on the accesses whose
+ * stack distance is C or more (and on the first access to every line),
+ * so the histogram of stack distances gives us the miss ratio for every
+ * cache size at once.
+ *
+ * We report the miss-ratio curve for the whole trace, and for the
+ * access sites and the variables that make the most accesses.
+ *
+ * Stack distances are computed with the algorithm of Olken (1981):
+ * we keep, for every cache line, the virtual time of its last access,
+ * and a Fenwick tree over virtual time that has a "1" at the time
+ * of the last access of every line. The stack distance of an access
+ * is then the number of ones between the last access to the line and
+ * now, which takes O(log N) to compute.
+ */
+
+#include <assert.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <utility>
+#include <unistd.h>
+#include <getopt.h>
+#include <ctgmath>
+#include <stdlib.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "trace-stream.hpp"
+
+using namespace std;
+
+int CACHE_LINE_SIZE = 64;  /* in bytes */
+int lineOffsetBits;
+
+/* How many access sites and variables to report */
+int TOP_N = 20;
+
+/* Stack distances are kept in logarithmic bins: bin 0 holds distance
+ * zero and bin k holds the distances in [2^(k-1), 2^k). That is exact
+ * for cache sizes that are a power of two lines: a cache of 2^k lines
+ * misses on the accesses in bins k+1 and above.
+ */
+#define NUM_BINS 65
+
+class DistanceHistogram
+{
+public:
+    size_t accesses;
+    size_t coldMisses;     /* first accesses to a line */
+    size_t bins[NUM_BINS];
+
+    DistanceHistogram()
+	: accesses(0), coldMisses(0)
+	{
+	    memset(bins, 0, sizeof(bins));
+	}
+
+    void addCold()
+	{
+	    accesses++;
+	    coldMisses++;
+	}
+
+    void add(size_t distance)
+	{
+	    int bin = 0;
+
+	    while(distance > 0)
+	    {
+		bin++;
+		distance >>= 1;
+	    }
+	    accesses++;
+	    bins[bin]++;
+	}
+
+    /* Misses in a fully associative LRU cache of 2^k lines */
+    size_t misses(int k)
+	{
+	    size_t m = coldMisses;
+
+	    for(int bin = k + 1; bin < NUM_BINS; bin++)
+		m += bins[bin];
+	    return m;
+	}
+
+    double missRatio(int k)
+	{
+	    return accesses ? (double)misses(k) / accesses : 0.0;
+	}
+};
+
+/* Computes stack distances of line accesses. */
+class StackDistanceCounter
+{
+public:
+    size_t distinctLines;
+
+    StackDistanceCounter()
+	: distinctLines(0), now(0)
+	{
+	    tree.assign(INITIAL_CAPACITY + 1, 0);
+	}
+
+    /* Access a cache line. Return the stack distance
+     * or COLD if the line was never accessed before.
+     */
+    size_t access(size_t line)
+	{
+	    size_t distance = COLD;
+
+	    if(now == tree.size() - 1)
+		compact();
+
+	    auto it = lastAccess.find(line);
+	    if(it != lastAccess.end())
+	    {
+		size_t last = it->second;
+
+		distance = prefixSum(now) - prefixSum(last + 1);
+		update(last + 1, -1);
+		it->second = now;
+	    }
+	    else
+	    {
+		distinctLines++;
+		lastAccess[line] = now;
+	    }
+
+	    update(now + 1, 1);
+	    now++;
+	    return distance;
+	}
+
+    static const size_t COLD = (size_t) -1;
+
+private:
+    enum { INITIAL_CAPACITY = 1 << 20 };
+
+    /* Virtual time of the last access to every line */
+    unordered_map<size_t, size_t> lastAccess;
+
+    /* A Fenwick tree over virtual time, indexed from one. */
+    vector<long> tree;
+    size_t now;
+
+    void update(size_t i, long delta)
+	{
+	    for(; i < tree.size(); i += i & -i)
+		tree[i] += delta;
+	}
+
+    /* Sum of the first i slots */
+    long prefixSum(size_t i)
+	{
+	    long sum = 0;
+
+	    for(; i > 0; i -= i & -i)
+		sum += tree[i];
+	    return sum;
+	}
+
+    /* We ran out of virtual time. Only the last access of every line
+     * matters, so renumber those in the order of their times, which
+     * preserves the distances, and rebuild the tree with enough room
+     * for at least as many accesses as there are lines.
+     */
+    void compact()
+	{
+	    vector<pair<size_t, size_t>> byTime;
+
+	    byTime.reserve(lastAccess.size());
+	    for(auto &la: lastAccess)
+		byTime.push_back(make_pair(la.second, la.first));
+	    sort(byTime.begin(), byTime.end());
+
+	    size_t capacity = max((size_t)INITIAL_CAPACITY, 2 * byTime.size());
+	    tree.assign(capacity + 1, 0);
+
+	    for(size_t t = 0; t < byTime.size(); t++)
+	    {
+		lastAccess[byTime[t].second] = t;
+		update(t + 1, 1);
+	    }
+	    now = byTime.size();
+	}
+};
+
+DistanceHistogram globalHistogram;
+unordered_map<string, DistanceHistogram> siteHistograms;
+unordered_map<string, DistanceHistogram> varHistograms;
+
+void recordDistance(const TraceRecord &rec, size_t distance)
+{
+    DistanceHistogram &site = siteHistograms[rec.accessSite];
+
+    if(distance == StackDistanceCounter::COLD)
+    {
+	globalHistogram.addCold();
+	site.addCold();
+	if(rec.varInfo.length() > 0)
+	    varHistograms[rec.varInfo].addCold();
+    }
+    else
+    {
+	globalHistogram.add(distance);
+	site.add(distance);
+	if(rec.varInfo.length() > 0)
+	    varHistograms[rec.varInfo].add(distance);
+    }
+}
+
+/* Split accesses spanning cache lines, as the cache simulator does,
+ * and record the stack distance for every line.
+ */
+void simulate(StackDistanceCounter &sdc, TraceRecord &rec)
+{
+    size_t address = rec.address;
+    size_t end = rec.address + max((int)rec.accessSize, 1);
+
+    for(size_t line = address >> lineOffsetBits;
+	line <= (end - 1) >> lineOffsetBits; line++)
+	recordDistance(rec, sdc.access(line));
+}
+
+string sizeString(size_t bytes)
+{
+    if(bytes >= 1024 * 1024 * 1024)
+	return to_string(bytes / (1024 * 1024 * 1024)) + "G";
+    if(bytes >= 1024 * 1024)
+	return to_string(bytes / (1024 * 1024)) + "M";
+    if(bytes >= 1024)
+	return to_string(bytes / 1024) + "K";
+    return to_string(bytes);
+}
+
+/* Cache sizes we report, from one line up to the first
+ * power of two that holds every line we have seen.
+ */
+int maxSizeLog(size_t distinctLines)
+{
+    int k = 0;
+
+    while(((size_t)1 << k) < distinctLines)
+	k++;
+    return k;
+}
+
+void printCurve(DistanceHistogram &h, int maxK, bool csv,
+		const string &scope, const string &key)
+{
+    for(int k = 0; k <= maxK; k++)
+    {
+	size_t lines = (size_t)1 << k;
+
+	if(csv)
+	{
+	    cout << scope << ",\"" << key << "\"," << lines << ","
+		 << lines * CACHE_LINE_SIZE << "," << h.misses(k) << ","
+		 << h.missRatio(k) << endl;
+	}
+	else
+	{
+	    cout << setw(12) << lines << setw(12) << sizeString(lines * CACHE_LINE_SIZE)
+		 << setw(16) << h.misses(k) << setw(12) << fixed << setprecision(4)
+		 << h.missRatio(k) << endl;
+	}
+    }
+}
+
+/* Print the miss-ratio curves of the TOP_N histograms with the most
+ * accesses, one row per histogram, one column per cache size.
+ */
+void printTopCurves(unordered_map<string, DistanceHistogram> &histograms,
+		    int maxK, bool csv, const string &scope)
+{
+    multimap<size_t, pair<const string, DistanceHistogram> *> byAccesses;
+
+    for(auto &h: histograms)
+	byAccesses.insert(make_pair(h.second.accesses, &h));
+
+    int printed = 0;
+    for(auto it = byAccesses.rbegin(); it != byAccesses.rend() && printed < TOP_N;
+	it++, printed++)
+    {
+	const string &key = it->second->first;
+	DistanceHistogram &h = it->second->second;
+
+	if(csv)
+	{
+	    printCurve(h, maxK, csv, scope, key);
+	    continue;
+	}
+
+	cout << key << endl;
+	cout << "\t" << h.accesses << " accesses, " << h.coldMisses
+	     << " cold misses" << endl;
+	cout << "\t";
+	for(int k = 0; k <= maxK; k++)
+	    cout << setw(7) << sizeString(((size_t)1 << k) * CACHE_LINE_SIZE);
+	cout << endl << "\t";
+	for(int k = 0; k <= maxK; k++)
+	    cout << setw(7) << fixed << setprecision(3) << h.missRatio(k);
+	cout << endl << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char *fname = NULL;
+    char *nptr;
+    int c;
+    bool csv = false;
+    TraceSlice slice;
+
+    while ((c = getopt_long (argc, argv, "cf:l:n:", sliceOptions, NULL)) != -1)
+	switch(c)
+	{
+	case 'c':
+	    csv = true;
+	    break;
+	case 'f':
+	    fname = optarg;
+	    break;
+	case 'l':
+	    CACHE_LINE_SIZE = strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || CACHE_LINE_SIZE <= 0
+	       || (CACHE_LINE_SIZE & (CACHE_LINE_SIZE - 1)))
+	    {
+		cerr << "Invalid argument for the cache line size: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case 'n':
+	    TOP_N = strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || TOP_N < 0)
+	    {
+		cerr << "Invalid argument for the number of sites to report: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case OPT_FROM:
+	case OPT_TO:
+	case OPT_THREADS:
+	    if(!slice.parseOption(c, optarg))
+		exit(-1);
+	    break;
+	case '?':
+	default:
+	    cerr << "Unknown option or missing option argument." << endl;
+	    exit(-1);
+	}
+
+    if(fname == NULL)
+    {
+	cerr << "Please provide input trace file with the -f option." << endl;
+	exit(-1);
+    }
+
+    lineOffsetBits = log2(CACHE_LINE_SIZE);
+
+    TraceStream traceStream(fname);
+    traceStream.select(slice);
+    if(!traceStream.start())
+    {
+	cerr << "Failed to open file " << fname << endl;
+	exit(-1);
+    }
+
+    StackDistanceCounter sdc;
+    vector<TraceRecord> batch;
+
+    while(traceStream.next(batch))
+    {
+	for(TraceRecord &rec: batch)
+	    simulate(sdc, rec);
+    }
+
+    int maxK = maxSizeLog(sdc.distinctLines);
+
+    if(csv)
+    {
+	cout << "scope,key,lines,bytes,misses,miss_ratio" << endl;
+	printCurve(globalHistogram, maxK, csv, "global", "");
+	printTopCurves(siteHistograms, maxK, csv, "site");
+	printTopCurves(varHistograms, maxK, csv, "variable");
+	return 0;
+    }
+
+    cout << "Line size = " << CACHE_LINE_SIZE << endl;
+    cout << "Line accesses: " << globalHistogram.accesses << endl;
+    cout << "Distinct lines: " << sdc.distinctLines << endl;
+
+    cout << "*************************************************" << endl;
+    cout << "  MISS RATIO CURVE (FULLY ASSOCIATIVE LRU)       " << endl;
+    cout << "*************************************************" << endl;
+    cout << setw(12) << "lines" << setw(12) << "bytes" << setw(16) << "misses"
+	 << setw(12) << "miss ratio" << endl;
+    printCurve(globalHistogram, maxK, csv, "global", "");
+
+    cout << endl;
+    cout << "*************************************************" << endl;
+    cout << "   MISS RATIO CURVES OF THE TOP ACCESS SITES     " << endl;
+    cout << "*************************************************" << endl;
+    printTopCurves(siteHistograms, maxK, csv, "site");
+
+    cout << "*************************************************" << endl;
+    cout << "     MISS RATIO CURVES OF THE TOP VARIABLES      " << endl;
+    cout << "*************************************************" << endl;
+    printTopCurves(varHistograms, maxK, csv, "variable");
+}
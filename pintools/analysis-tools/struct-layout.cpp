@@ -0,0 +1,1075 @@
+/*
+ * This tool reads a memtracker trace and suggests a better layout for
+ * the structures the program accesses the most. It makes two passes
+ * over the trace.
+ *
+ * In the first pass we follow the allocation records to find, for every
+ * access to an allocated item, the type of the item and the offset into
+ * it, and name the field after the variable of the access (name->field).
+ * The offsets and sizes of the fields are what the accesses to them
+ * cover, so bytes that are never accessed are not known to be part of
+ * any field. For every field we count the reads and writes of every
+ * thread. Two fields of the same item accessed by a thread within -w
+ * accesses of each other have affinity, and two fields written by one
+ * thread and accessed by another should not share a cache line.
+ *
+ * From that we propose a new order of the fields: the hottest field and
+ * the fields with the most affinity to it go to the first line, as long
+ * as they fit and no other thread writes to them, and so on. A group of
+ * fields goes to the next line if it does not fit in what is left of
+ * the current one, or if it shares writes with the fields already there.
+ * Fields that are never accessed go to the end.
+ *
+ * In the second pass we replay the accesses with the old and the new
+ * layout and compare the number of cache lines of an item that a thread
+ * touches within a window of its accesses to the item, the number of
+ * times a thread accesses a line last written by another thread to
+ * another field (false sharing), and the misses of an LRU cache. With
+ * -o the accesses with the new layout are written out as a trace, to
+ * replay through wa for the full picture.
+ */
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <utility>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "frame-reader.hpp"
+#include "../packed-trace.hpp"
+#include "trace-parser.hpp"
+
+using namespace std;
+
+int CACHE_LINE_SIZE = 64;  /* in bytes */
+int WINDOW = 8;            /* accesses of a thread that count as together */
+int TOP_N = 5;             /* types to lay out */
+int NUM_SETS = 8192;       /* of the LRU cache we replay the accesses through */
+int ASSOC = 4;
+
+/* Where the items with the new layout go in the replay */
+#define REMAP_BASE 0x600000000000ULL
+
+/* ===================================================================== */
+/* Reading the trace                                                     */
+/* ===================================================================== */
+
+/* The lines of a text or a compressed trace. We need the allocation
+ * records, which only those have, so we don't use TraceStream.
+ */
+class TraceLines
+{
+public:
+    TraceLines()
+	: pos(0) {}
+
+    bool open(const char *fname)
+	{
+	    f.open(fname);
+	    if(!f.is_open())
+		return false;
+
+	    int first = f.peek();
+	    if(first == (unsigned char)PACKED_MAGIC[0])
+	    {
+		cerr << "The packed trace has no allocation records. Please give "
+		     << "a text or a compressed trace (memtracker -o, -z)." << endl;
+		exit(-1);
+	    }
+	    if(first == (unsigned char)FRAME_MAGIC[0])
+	    {
+		frames.reset(new ParallelFrameReader<vector<string>>(f, splitLines));
+		return frames->start();
+	    }
+	    return true;
+	}
+
+    bool next(string &line)
+	{
+	    if(!frames)
+		return (bool)getline(f, line);
+
+	    while(pos == batch.size())
+	    {
+		pos = 0;
+		if(!frames->next(batch))
+		{
+		    if(frames->failed())
+			cerr << "The compressed trace is truncated or corrupt" << endl;
+		    return false;
+		}
+	    }
+	    line.swap(batch[pos++]);
+	    return true;
+	}
+
+private:
+    ifstream f;
+    unique_ptr<ParallelFrameReader<vector<string>>> frames;
+    vector<string> batch;
+    size_t pos;
+
+    static void splitLines(const char *text, size_t len, vector<string> &lines)
+	{
+	    const char *end = text + len;
+
+	    lines.clear();
+	    while(text < end)
+	    {
+		const char *nl = (const char*)memchr(text, '\n', end - text);
+
+		if(nl == NULL)
+		    nl = end;
+		lines.push_back(string(text, nl - text));
+		text = nl + 1;
+	    }
+	}
+};
+
+/* Split a line at every space, keeping the empty words */
+vector<string> splitWords(const string &line)
+{
+    vector<string> words;
+    size_t start = 0, space;
+
+    while((space = line.find(' ', start)) != string::npos)
+    {
+	words.push_back(line.substr(start, space - start));
+	start = space + 1;
+    }
+    words.push_back(line.substr(start));
+    return words;
+}
+
+/* ===================================================================== */
+/* Types, fields and allocations                                         */
+/* ===================================================================== */
+
+class ThreadCounts
+{
+public:
+    size_t reads, writes;
+
+    ThreadCounts()
+	: reads(0), writes(0) {}
+};
+
+class Field
+{
+public:
+    string name;
+    size_t offset, size;          /* the bytes the accesses covered */
+    map<int, ThreadCounts> threads;
+    size_t accesses;
+    size_t newOffset;
+    int unit;                     /* the field this one was merged into */
+
+    Field(const string &n, size_t o, size_t s)
+	: name(n), offset(o), size(s), accesses(0), newOffset(0), unit(-1) {}
+
+    /* The alignment we give the field: what its size and its old
+     * offset allow, up to 8 bytes
+     */
+    size_t align() const
+	{
+	    size_t a = 8;
+
+	    while(a > 1 && (a > size || offset % a != 0))
+		a /= 2;
+	    return a;
+	}
+};
+
+class StructType
+{
+public:
+    string name;
+    size_t itemSize;
+    size_t accesses;
+
+    /* The fields as the accesses named them, and after merging the
+     * ones that overlap, which are the fields we lay out
+     */
+    vector<Field> named;
+    map<string, int> namedIds;
+    vector<Field> fields;
+    int knownNames;   /* fields with a name, not just an offset */
+
+    map<pair<int, int>, size_t> affinity;   /* by named field */
+    map<pair<int, int>, size_t> unitAffinity, sharing;
+
+    /* The new layout */
+    bool analyzed, padded;
+    vector<int> order;
+    vector<bool> lineBreak;   /* padding to a new line before order[i] */
+    size_t newSize;
+
+    StructType(const string &n, size_t s)
+	: name(n), itemSize(s), accesses(0), knownNames(0), analyzed(false), padded(false),
+	  newSize(s) {}
+
+    /* The field (after merging) at offset, or -1 */
+    int fieldAt(size_t offset) const
+	{
+	    for(size_t i = 0; i < fields.size(); i++)
+		if(offset >= fields[i].offset && offset < fields[i].offset + fields[i].size)
+		    return i;
+	    return -1;
+	}
+
+    size_t get(const map<pair<int, int>, size_t> &m, int a, int b) const
+	{
+	    map<pair<int, int>, size_t>::const_iterator it =
+		m.find(make_pair(min(a, b), max(a, b)));
+	    return it == m.end() ? 0 : it->second;
+	}
+};
+
+vector<StructType> types;
+map<string, int> typeIds;
+
+class Allocation
+{
+public:
+    size_t base, itemSize, number;
+    int type;
+    size_t newBase;
+};
+
+map<size_t, Allocation> allocations;
+
+/* The allocation containing addr, or NULL */
+Allocation *findAllocation(size_t addr)
+{
+    map<size_t, Allocation>::iterator it = allocations.upper_bound(addr);
+
+    if(it == allocations.begin())
+	return NULL;
+    it--;
+    if(addr >= it->second.base + it->second.itemSize * it->second.number)
+	return NULL;
+    return &it->second;
+}
+
+/* Follow an allocation or an implicit-free record. Return false if
+ * the line is neither.
+ * alloc: <tid> <addr> <func> <item size> <number> <file>:<line> <var> <type>
+ */
+bool trackAllocation(const string &line)
+{
+    if(line.compare(0, 14, "implicit-free:") == 0)
+    {
+	vector<string> words = splitWords(line);
+
+	allocations.erase(strtoull(words.back().c_str(), NULL, 16));
+	return true;
+    }
+    if(line.compare(0, 6, "alloc:") != 0)
+	return false;
+
+    vector<string> words = splitWords(line);
+    if(words.size() < 8)
+	return true;
+
+    Allocation a;
+    string typeName;
+
+    a.base = strtoull(words[2].c_str(), NULL, 16);
+    a.itemSize = strtoull(words[4].c_str(), NULL, 10);
+    a.number = strtoull(words[5].c_str(), NULL, 10);
+    a.newBase = 0;
+    for(size_t i = 8; i < words.size(); i++)
+	typeName += (i > 8 ? " " : "") + words[i];
+    if(a.itemSize == 0 || a.number == 0)
+	return true;
+
+    /* Allocations of unknown type are a type of their own */
+    if(typeName.length() == 0 || typeName.compare("<Unknown>") == 0)
+	typeName = words[6] + " " + words[7];
+
+    /* The same type may be allocated with different sizes */
+    map<string, int>::iterator it = typeIds.find(typeName);
+    if(it != typeIds.end() && types[it->second].itemSize != a.itemSize)
+    {
+	typeName += " (" + to_string(a.itemSize) + " bytes)";
+	it = typeIds.find(typeName);
+    }
+    if(it == typeIds.end())
+    {
+	it = typeIds.insert(make_pair(typeName, (int)types.size())).first;
+	types.push_back(StructType(typeName, a.itemSize));
+    }
+    a.type = it->second;
+
+    allocations[a.base] = a;
+    return true;
+}
+
+/* The field the access names, without array indices, or "" */
+string fieldName(const TraceRecord &rec)
+{
+    size_t arrow = rec.varInfo.find("->");
+
+    if(arrow == string::npos)
+	return "";
+
+    size_t end = rec.varInfo.find_first_of(" [", arrow + 2);
+    string name = rec.varInfo.substr(arrow + 2, end == string::npos ? string::npos
+				     : end - arrow - 2);
+    return name.compare("<Unknown>") == 0 ? "" : name;
+}
+
+/* ===================================================================== */
+/* The first pass                                                        */
+/* ===================================================================== */
+
+/* An access in the window of a thread */
+class Touch
+{
+public:
+    size_t item;    /* the address of the item */
+    int type;
+    int field;      /* named in the first pass, merged in the second */
+    size_t oldLine, newLine;
+};
+
+map<int, deque<Touch> > windows;
+
+/* Add the access to the window of the thread and call together() with
+ * every other field of the same item in the window, once
+ */
+template <class Together>
+void slideWindow(int tid, const Touch &t, Together together)
+{
+    deque<Touch> &w = windows[tid];
+    set<int> seen;
+
+    for(const Touch &o: w)
+	if(o.item == t.item && o.type == t.type && o.field != t.field
+	   && seen.insert(o.field).second)
+	    together(o.field);
+
+    w.push_back(t);
+    if(w.size() > (size_t)WINDOW)
+	w.pop_front();
+}
+
+void countAccess(const TraceRecord &rec)
+{
+    Allocation *a = findAllocation(rec.address);
+
+    if(a == NULL)
+	return;
+
+    StructType &st = types[a->type];
+    size_t offset = (rec.address - a->base) % a->itemSize;
+    size_t end = min(offset + max((size_t)rec.accessSize, (size_t)1), a->itemSize);
+    string name = fieldName(rec);
+
+    bool known = name.length() > 0;
+
+    if(!known)
+	name = "+" + to_string(offset);
+
+    map<string, int>::iterator it = st.namedIds.find(name);
+    if(it == st.namedIds.end())
+    {
+	it = st.namedIds.insert(make_pair(name, (int)st.named.size())).first;
+	st.named.push_back(Field(name, offset, end - offset));
+	st.knownNames += known;
+    }
+
+    Field &f = st.named[it->second];
+    if(offset < f.offset)
+    {
+	f.size += f.offset - offset;
+	f.offset = offset;
+    }
+    f.size = max(f.size, end - f.offset);
+    f.accesses++;
+    if(rec.isWrite)
+	f.threads[rec.tid].writes++;
+    else
+	f.threads[rec.tid].reads++;
+    st.accesses++;
+
+    Touch t;
+    t.item = rec.address - offset;
+    t.type = a->type;
+    t.field = it->second;
+    slideWindow(rec.tid, t, [&](int other) {
+	    st.affinity[make_pair(min(other, t.field), max(other, t.field))]++;
+	});
+}
+
+/* ===================================================================== */
+/* The new layout                                                        */
+/* ===================================================================== */
+
+/* Merge the named fields that overlap (different names for the same
+ * bytes, or a field inside an array) into the fields we lay out.
+ */
+void mergeFields(StructType &st)
+{
+    vector<int> byOffset;
+
+    for(size_t i = 0; i < st.named.size(); i++)
+	byOffset.push_back(i);
+    sort(byOffset.begin(), byOffset.end(), [&](int a, int b)
+	 { return st.named[a].offset < st.named[b].offset; });
+
+    for(int id: byOffset)
+    {
+	Field &n = st.named[id];
+
+	if(st.fields.empty() || n.offset >= st.fields.back().offset + st.fields.back().size)
+	{
+	    st.fields.push_back(Field(n.name, n.offset, n.size));
+	    st.fields.back().threads = n.threads;
+	    st.fields.back().accesses = n.accesses;
+	}
+	else
+	{
+	    Field &u = st.fields.back();
+
+	    u.name += "/" + n.name;
+	    u.size = max(u.size, n.offset + n.size - u.offset);
+	    u.accesses += n.accesses;
+	    for(map<int, ThreadCounts>::iterator it = n.threads.begin(); it != n.threads.end(); it++)
+	    {
+		u.threads[it->first].reads += it->second.reads;
+		u.threads[it->first].writes += it->second.writes;
+	    }
+	}
+	n.unit = st.fields.size() - 1;
+    }
+
+    for(map<pair<int, int>, size_t>::iterator it = st.affinity.begin();
+	it != st.affinity.end(); it++)
+    {
+	int a = st.named[it->first.first].unit, b = st.named[it->first.second].unit;
+
+	if(a != b)
+	    st.unitAffinity[make_pair(min(a, b), max(a, b))] += it->second;
+    }
+
+    /* How often a thread writing one field and another thread accessing
+     * the other would bounce the line between them if they shared it
+     */
+    for(size_t a = 0; a < st.fields.size(); a++)
+	for(size_t b = a + 1; b < st.fields.size(); b++)
+	{
+	    size_t shared = 0;
+
+	    for(map<int, ThreadCounts>::iterator ta = st.fields[a].threads.begin();
+		ta != st.fields[a].threads.end(); ta++)
+		for(map<int, ThreadCounts>::iterator tb = st.fields[b].threads.begin();
+		    tb != st.fields[b].threads.end(); tb++)
+		{
+		    if(ta->first == tb->first)
+			continue;
+		    shared += min(ta->second.writes, tb->second.reads + tb->second.writes);
+		    shared += min(tb->second.writes, ta->second.reads + ta->second.writes);
+		}
+	    if(shared > 0)
+		st.sharing[make_pair(a, b)] = shared;
+	}
+}
+
+/* The size of the fields laid out one after the other, from offset */
+size_t fieldsExtent(const StructType &st, const vector<int> &group, size_t offset)
+{
+    size_t start = offset;
+
+    for(int id: group)
+    {
+	size_t align = st.fields[id].align();
+
+	offset = (offset + align - 1) / align * align + st.fields[id].size;
+    }
+    return offset - start;
+}
+
+bool sharesWrites(const StructType &st, int id, const vector<int> &group)
+{
+    for(int other: group)
+	if(st.get(st.sharing, id, other) > 0)
+	    return true;
+    return false;
+}
+
+void layOut(StructType &st)
+{
+    vector<int> hot;
+    vector<bool> placed(st.fields.size(), false);
+    vector<vector<int> > groups;
+
+    for(size_t i = 0; i < st.fields.size(); i++)
+	hot.push_back(i);
+    sort(hot.begin(), hot.end(), [&](int a, int b)
+	 { return st.fields[a].accesses > st.fields[b].accesses; });
+
+    /* Grow a line's worth of fields around the hottest field left */
+    for(int seed: hot)
+    {
+	if(placed[seed])
+	    continue;
+
+	vector<int> group(1, seed);
+	placed[seed] = true;
+
+	while(true)
+	{
+	    int best = -1;
+	    size_t bestAffinity = 0;
+
+	    for(int id: hot)
+	    {
+		size_t affinity = 0;
+
+		if(placed[id] || sharesWrites(st, id, group))
+		    continue;
+		for(int member: group)
+		    affinity += st.get(st.unitAffinity, id, member);
+
+		vector<int> bigger(group);
+		bigger.push_back(id);
+		if(affinity > bestAffinity && fieldsExtent(st, bigger, 0) <= (size_t)CACHE_LINE_SIZE)
+		{
+		    best = id;
+		    bestAffinity = affinity;
+		}
+	    }
+	    if(best < 0)
+		break;
+	    group.push_back(best);
+	    placed[best] = true;
+	}
+	groups.push_back(group);
+    }
+
+    /* Place the groups, starting a new line when a group doesn't fit
+     * in what's left of the current one, or shares writes with it
+     */
+    vector<int> line;
+    size_t offset = 0, holes = 0;
+    size_t maxAlign = 1;
+
+    for(vector<int> &group: groups)
+    {
+	size_t size = fieldsExtent(st, group, offset);
+	bool crosses = offset % CACHE_LINE_SIZE + size > (size_t)CACHE_LINE_SIZE
+	    && fieldsExtent(st, group, 0) <= (size_t)CACHE_LINE_SIZE;
+	bool shares = false;
+
+	for(int id: group)
+	    shares = shares || sharesWrites(st, id, line);
+
+	bool lineBreak = offset % CACHE_LINE_SIZE != 0 && (crosses || shares);
+	if(lineBreak)
+	{
+	    size_t next = (offset + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+	    holes += next - offset;
+	    offset = next;
+	    st.padded = true;
+	}
+	if(offset % CACHE_LINE_SIZE == 0)
+	    line.clear();
+
+	for(size_t i = 0; i < group.size(); i++)
+	{
+	    Field &f = st.fields[group[i]];
+	    size_t align = f.align();
+
+	    offset = (offset + align - 1) / align * align;
+	    f.newOffset = offset;
+	    offset += f.size;
+	    maxAlign = max(maxAlign, align);
+
+	    st.order.push_back(group[i]);
+	    st.lineBreak.push_back(lineBreak && i == 0);
+	    line.push_back(group[i]);
+	    if(offset % CACHE_LINE_SIZE == 0)
+		line.clear();
+	}
+    }
+
+    /* The bytes never accessed fill the padding, and what doesn't fit
+     * goes to the end
+     */
+    size_t accessed = 0;
+    for(Field &f: st.fields)
+	accessed += f.size;
+    offset += st.itemSize - min(accessed + holes, st.itemSize);
+
+    if(st.padded)
+	maxAlign = CACHE_LINE_SIZE;
+    st.newSize = (offset + maxAlign - 1) / maxAlign * maxAlign;
+    st.analyzed = true;
+}
+
+/* ===================================================================== */
+/* The second pass                                                       */
+/* ===================================================================== */
+
+/* A set-associative LRU cache of lines */
+class LineCache
+{
+public:
+    size_t accesses, misses;
+
+    LineCache(int numSets, int assoc)
+	: accesses(0), misses(0), numSets(numSets), assoc(assoc), clock(0),
+	  tags(numSets * assoc, (size_t)-1), stamps(numSets * assoc, 0) {}
+
+    void access(size_t line)
+	{
+	    size_t set = line % numSets * assoc;
+	    size_t victim = set;
+
+	    accesses++;
+	    clock++;
+	    for(size_t way = set; way < set + assoc; way++)
+	    {
+		if(tags[way] == line)
+		{
+		    stamps[way] = clock;
+		    return;
+		}
+		if(stamps[way] < stamps[victim])
+		    victim = way;
+	    }
+	    misses++;
+	    tags[victim] = line;
+	    stamps[victim] = clock;
+	}
+
+private:
+    size_t numSets, assoc;
+    size_t clock;
+    vector<size_t> tags;
+    vector<size_t> stamps;
+};
+
+/* What we compare between the old and the new layout */
+class Replay
+{
+public:
+    LineCache cache;
+    size_t linesTouched, groups, falseSharing;
+
+    /* The thread and the field that last wrote a line of an item */
+    unordered_map<size_t, pair<int, int> > lastWriter;
+
+    Replay()
+	: cache(NUM_SETS, ASSOC), linesTouched(0), groups(0), falseSharing(0) {}
+
+    void access(size_t addr, size_t size, int tid, bool isWrite, int field)
+	{
+	    size_t lineBits = __builtin_ctz(CACHE_LINE_SIZE);
+
+	    for(size_t line = addr >> lineBits; line <= (addr + size - 1) >> lineBits; line++)
+	    {
+		cache.access(line);
+		if(field < 0)
+		    continue;
+
+		unordered_map<size_t, pair<int, int> >::iterator it = lastWriter.find(line);
+		if(it != lastWriter.end() && it->second.first != tid && it->second.second != field)
+		    falseSharing++;
+		if(isWrite)
+		    lastWriter[line] = make_pair(tid, field);
+	    }
+	}
+};
+
+Replay oldReplay, newReplay;
+size_t newRegion = REMAP_BASE;
+
+/* Where the allocation goes with the new layout of its type */
+void placeAllocation(Allocation &a)
+{
+    StructType &st = types[a.type];
+    size_t line = CACHE_LINE_SIZE;
+
+    newRegion = (newRegion + line - 1) / line * line;
+    a.newBase = newRegion + (st.padded ? 0 : a.base % line);
+    newRegion = a.newBase + st.newSize * a.number + line;
+}
+
+/* Replay the access with both layouts. Return the address of the access
+ * with the new layout.
+ */
+size_t replayAccess(const TraceRecord &rec)
+{
+    Allocation *a = findAllocation(rec.address);
+    size_t size = max((size_t)rec.accessSize, (size_t)1);
+
+    if(a == NULL || !types[a->type].analyzed)
+    {
+	oldReplay.access(rec.address, size, rec.tid, rec.isWrite, -1);
+	newReplay.access(rec.address, size, rec.tid, rec.isWrite, -1);
+	return rec.address;
+    }
+
+    StructType &st = types[a->type];
+    size_t index = (rec.address - a->base) / a->itemSize;
+    size_t offset = (rec.address - a->base) % a->itemSize;
+    int id = st.fieldAt(offset);
+
+    if(id < 0)
+    {
+	oldReplay.access(rec.address, size, rec.tid, rec.isWrite, -1);
+	newReplay.access(rec.address, size, rec.tid, rec.isWrite, -1);
+	return rec.address;
+    }
+
+    Field &f = st.fields[id];
+    size_t newAddr = a->newBase + index * st.newSize + f.newOffset + offset - f.offset;
+    int field = a->type << 16 | id;
+
+    oldReplay.access(rec.address, size, rec.tid, rec.isWrite, field);
+    newReplay.access(newAddr, size, rec.tid, rec.isWrite, field);
+
+    /* The lines of the item the thread touched in the window */
+    Touch t;
+    set<size_t> oldLines, newLines;
+
+    t.item = rec.address - offset;
+    t.type = a->type;
+    t.field = id;
+    t.oldLine = rec.address / CACHE_LINE_SIZE;
+    t.newLine = newAddr / CACHE_LINE_SIZE;
+    oldLines.insert(t.oldLine);
+    newLines.insert(t.newLine);
+    for(const Touch &o: windows[rec.tid])
+	if(o.item == t.item && o.type == t.type)
+	{
+	    oldLines.insert(o.oldLine);
+	    newLines.insert(o.newLine);
+	}
+    oldReplay.linesTouched += oldLines.size();
+    newReplay.linesTouched += newLines.size();
+    oldReplay.groups++;
+    newReplay.groups++;
+    slideWindow(rec.tid, t, [](int) {});
+
+    return newAddr;
+}
+
+/* Write the line with the address of the access or the allocation
+ * changed to where it is with the new layout
+ */
+void writeRemapped(ostream &out, const string &line, size_t newAddr, size_t newSize)
+{
+    vector<string> words = splitWords(line);
+    char addr[32];
+
+    snprintf(addr, sizeof(addr), "0x%016zx", newAddr);
+    words[2] = addr;
+    if(newSize != 0)
+	words[4] = to_string(newSize);
+
+    for(size_t i = 0; i < words.size(); i++)
+	out << (i > 0 ? " " : "") << words[i];
+    out << endl;
+}
+
+/* ===================================================================== */
+/* The report                                                            */
+/* ===================================================================== */
+
+string percent(size_t before, size_t after)
+{
+    ostringstream s;
+
+    if(before == 0)
+	return "";
+    s << " (" << showpos << fixed << setprecision(1)
+      << 100.0 * ((double)after - (double)before) / before << "%)";
+    return s.str();
+}
+
+string writers(const Field &f)
+{
+    string s;
+
+    for(map<int, ThreadCounts>::const_iterator it = f.threads.begin(); it != f.threads.end(); it++)
+	if(it->second.writes > 0)
+	    s += (s.length() > 0 ? "," : "") + to_string(it->first);
+    return s.length() > 0 ? s : "-";
+}
+
+void printType(const StructType &st)
+{
+    vector<int> byOffset;
+
+    for(size_t i = 0; i < st.fields.size(); i++)
+	byOffset.push_back(i);
+    sort(byOffset.begin(), byOffset.end(), [&](int a, int b)
+	 { return st.fields[a].offset < st.fields[b].offset; });
+
+    cout << "type " << st.name << ": " << st.itemSize << " bytes, "
+	 << st.accesses << " accesses" << endl;
+
+    cout << "  current layout:" << endl;
+    cout << "    " << setw(8) << "offset" << setw(6) << "size" << "  " << left
+	 << setw(24) << "field" << right << setw(12) << "reads" << setw(12)
+	 << "writes" << "  writers" << endl;
+    for(int id: byOffset)
+    {
+	const Field &f = st.fields[id];
+	size_t reads = 0, writes = 0;
+
+	for(map<int, ThreadCounts>::const_iterator it = f.threads.begin(); it != f.threads.end(); it++)
+	{
+	    reads += it->second.reads;
+	    writes += it->second.writes;
+	}
+	cout << "    " << setw(8) << f.offset << setw(6) << f.size << "  " << left
+	     << setw(24) << f.name << right << setw(12) << reads << setw(12) << writes
+	     << "  " << writers(f) << endl;
+    }
+
+    cout << "  proposed layout: " << st.newSize << " bytes";
+    if(st.padded)
+	cout << ", aligned to " << CACHE_LINE_SIZE << " bytes";
+    cout << endl;
+    for(size_t i = 0; i < st.order.size(); i++)
+    {
+	const Field &f = st.fields[st.order[i]];
+
+	if(st.lineBreak[i])
+	    cout << "    " << setw(8) << "" << "  -- to the next line (room for the bytes never accessed) --" << endl;
+	cout << "    " << setw(8) << f.newOffset << setw(6) << f.size << "  " << f.name << endl;
+    }
+
+    size_t accessed = 0;
+    for(const Field &f: st.fields)
+	accessed += f.size;
+    if(accessed < st.itemSize)
+	cout << "    " << setw(8) << "" << setw(6) << st.itemSize - accessed
+	     << "  (the bytes never accessed, in the padding first)" << endl;
+
+    vector<pair<size_t, pair<int, int> > > pairs;
+    for(map<pair<int, int>, size_t>::const_iterator it = st.unitAffinity.begin();
+	it != st.unitAffinity.end(); it++)
+	pairs.push_back(make_pair(it->second, it->first));
+    sort(pairs.rbegin(), pairs.rend());
+    for(size_t i = 0; i < pairs.size() && i < 5; i++)
+	cout << "  accessed together: " << st.fields[pairs[i].second.first].name << " "
+	     << st.fields[pairs[i].second.second].name << " " << pairs[i].first << endl;
+
+    for(map<pair<int, int>, size_t>::const_iterator it = st.sharing.begin();
+	it != st.sharing.end(); it++)
+	cout << "  written by one thread, accessed by another: "
+	     << st.fields[it->first.first].name << " " << st.fields[it->first.second].name
+	     << " " << it->second << endl;
+    cout << endl;
+}
+
+void printReplay()
+{
+    cout << "REPLAY WITH THE PROPOSED LAYOUTS" << endl;
+    if(oldReplay.groups > 0)
+	cout << "  lines of an item touched per " << WINDOW << " accesses: " << fixed
+	     << setprecision(2) << (double)oldReplay.linesTouched / oldReplay.groups
+	     << " -> " << (double)newReplay.linesTouched / newReplay.groups
+	     << percent(oldReplay.linesTouched, newReplay.linesTouched) << endl;
+    cout << "  accesses to lines last written by another thread to another field: "
+	 << oldReplay.falseSharing << " -> " << newReplay.falseSharing
+	 << percent(oldReplay.falseSharing, newReplay.falseSharing) << endl;
+    cout << "  misses of a " << (size_t)NUM_SETS * ASSOC * CACHE_LINE_SIZE / 1024
+	 << "KB " << ASSOC << "-way LRU cache: " << oldReplay.cache.misses << " -> "
+	 << newReplay.cache.misses
+	 << percent(oldReplay.cache.misses, newReplay.cache.misses) << endl;
+}
+
+int parsePositive(const char *arg, const char *what)
+{
+    char *nptr;
+    long value = strtol(arg, &nptr, 10);
+
+    if(nptr == arg || *nptr != '\0' || value <= 0)
+    {
+	cerr << "Invalid argument for " << what << ": " << arg << endl;
+	exit(-1);
+    }
+    return value;
+}
+
+int main(int argc, char *argv[])
+{
+    char *fname = NULL, *outName = NULL;
+    set<string> wanted;
+    int c;
+
+    while ((c = getopt(argc, argv, "a:f:l:n:o:s:T:w:")) != -1)
+	switch(c)
+	{
+	case 'a':
+	    ASSOC = parsePositive(optarg, "the associativity");
+	    break;
+	case 'f':
+	    fname = optarg;
+	    break;
+	case 'l':
+	    CACHE_LINE_SIZE = parsePositive(optarg, "the cache line size");
+	    if(CACHE_LINE_SIZE & (CACHE_LINE_SIZE - 1))
+	    {
+		cerr << "The cache line size must be a power of two" << endl;
+		exit(-1);
+	    }
+	    break;
+	case 'n':
+	    TOP_N = parsePositive(optarg, "the number of types");
+	    break;
+	case 'o':
+	    outName = optarg;
+	    break;
+	case 's':
+	    NUM_SETS = parsePositive(optarg, "the number of sets");
+	    break;
+	case 'T':
+	    wanted.insert(optarg);
+	    break;
+	case 'w':
+	    WINDOW = parsePositive(optarg, "the window");
+	    break;
+	case '?':
+	default:
+	    cerr << "Unknown option or missing option argument." << endl;
+	    exit(-1);
+	}
+
+    if(fname == NULL || string(fname).compare("-") == 0)
+    {
+	cerr << "Please provide the input trace file with the -f option. "
+	     << "We read it twice, so it can't be the standard input." << endl;
+	exit(-1);
+    }
+
+    TraceLines first;
+    string line;
+    TraceRecord rec;
+
+    if(!first.open(fname))
+    {
+	cerr << "Failed to open file " << fname << endl;
+	exit(-1);
+    }
+    while(first.next(line))
+    {
+	if(!trackAllocation(line) && parseAccessRecord(line, rec))
+	    countAccess(rec);
+    }
+
+    /* Lay out the types with the most accesses, or the ones asked for,
+     * if they have more than one field. Without the names of the fields
+     * we can't tell a structure from an array, so we want two names.
+     */
+    vector<pair<size_t, int> > hottest;
+    for(size_t i = 0; i < types.size(); i++)
+	if(wanted.empty() ? types[i].accesses > 0 : wanted.count(types[i].name) > 0)
+	    hottest.push_back(make_pair(types[i].accesses, i));
+    sort(hottest.rbegin(), hottest.rend());
+
+    cout << "STRUCT LAYOUT SUGGESTIONS (" << CACHE_LINE_SIZE << "-byte lines, fields "
+	 << "accessed within " << WINDOW << " accesses are together)" << endl << endl;
+
+    int analyzed = 0;
+    for(pair<size_t, int> &h: hottest)
+    {
+	StructType &st = types[h.second];
+
+	if(analyzed == TOP_N && wanted.empty())
+	    break;
+	if(st.knownNames < 2)
+	    continue;
+	mergeFields(st);
+	if(st.fields.size() < 2)
+	    continue;
+	layOut(st);
+	printType(st);
+	analyzed++;
+    }
+    if(analyzed == 0)
+    {
+	cout << "No allocated type with more than one named field accessed." << endl;
+	return 0;
+    }
+
+    /* Replay the trace with the new layouts */
+    TraceLines second;
+    ofstream out;
+
+    if(outName && (out.open(outName), !out.is_open()))
+    {
+	cerr << "Failed to create file " << outName << endl;
+	exit(-1);
+    }
+    if(!second.open(fname))
+    {
+	cerr << "Failed to open file " << fname << endl;
+	exit(-1);
+    }
+
+    allocations.clear();
+    windows.clear();
+    while(second.next(line))
+    {
+	if(trackAllocation(line))
+	{
+	    Allocation *a = line.compare(0, 6, "alloc:") == 0 ?
+		findAllocation(strtoull(splitWords(line)[2].c_str(), NULL, 16)) : NULL;
+
+	    if(a && types[a->type].analyzed)
+	    {
+		placeAllocation(*a);
+		if(outName)
+		    writeRemapped(out, line, a->newBase, types[a->type].newSize);
+	    }
+	    else if(outName)
+		out << line << endl;
+	    continue;
+	}
+
+	if(!parseAccessRecord(line, rec))
+	{
+	    if(outName)
+		out << line << endl;
+	    continue;
+	}
+
+	size_t newAddr = replayAccess(rec);
+	if(outName)
+	{
+	    if(newAddr != rec.address)
+		writeRemapped(out, line, newAddr, 0);
+	    else
+		out << line << endl;
+	}
+    }
+
+    printReplay();
+    if(outName && (out.close(), out.fail()))
+    {
+	cerr << "Failed to write " << outName << endl;
+	exit(-1);
+    }
+    return 0;
+}
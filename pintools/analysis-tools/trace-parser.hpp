@@ -0,0 +1,156 @@
+/*
+ * A parser for the text version of the memtracker trace, shared by
+ * the analysis tools in this directory. The access records have the
+ * following format:
+ * <access_type> <tid> <addr> <size> <func> <access_source> <alloc_source> <name> <type>
+ *
+ * The allocation records can be parsed too, for the tools that need
+ * them. All the other records (function begin/end, etc.) are skipped.
+ */
+#pragma once
+
+#include <errno.h>
+#include <stdlib.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+/* An access record from the trace */
+class TraceRecord
+{
+public:
+    bool isWrite;
+    int tid;
+    size_t address;
+    unsigned short accessSize;
+    std::string accessSite;
+    std::string varInfo;
+
+    /* Set for an allocation record, which has the base address of the
+     * allocation, the size and the number of the items in it, the
+     * allocation function as the access site, and "<alloc_source>
+     * <name> <type>" as the variable.
+     */
+    bool isAlloc;
+    size_t itemSize, itemNumber;
+};
+
+/* Parse a line of the trace into rec.
+ * Return false if this is not an access record.
+ */
+inline bool parseAccessRecord(const std::string &line, TraceRecord &rec)
+{
+    std::istringstream str(line);
+    std::string word;
+    size_t &address = rec.address;
+    unsigned short &accessSize = rec.accessSize;
+    std::string &accessSite = rec.accessSite;
+    std::string &varInfo = rec.varInfo;
+
+    accessSite.clear();
+    varInfo.clear();
+    rec.isAlloc = false;
+
+    /* Let's determine if this is an access record */
+    if(!str.eof())
+    {
+	str >> word;
+	if(!(word.compare("read:") == 0) && !(word.compare("write:") == 0))
+	    return false;
+	rec.isWrite = (word.compare("write:") == 0);
+    }
+
+    /* We are assuming the memtracker trace output, the text
+     * version. It has the following format:
+     * <access_type> <tid> <addr> <size> <func> <access_source> <alloc_source> <name> <type>
+     */
+    int iter = 1;
+    while(!str.eof())
+    {
+	str >> word;
+
+	switch(iter++)
+	{
+	case 1:	    // Parse the tid
+	    rec.tid = atoi(word.c_str());
+	    break;
+	case 2:     // Parse the address
+	    address = strtol(word.c_str(), 0, 16);
+	    if(errno == EINVAL || errno == ERANGE)
+	    {
+		std::cerr << "The following line caused error when parsing address: " << std::endl;
+		std::cerr << line << std::endl;
+		exit(-1);
+	    }
+	    break;
+	case 3:     // Parse the size
+	    accessSize = (unsigned short) strtol(word.c_str(), 0, 10);
+	    if(errno == EINVAL || errno == ERANGE)
+	    {
+		std::cerr << "The following line caused error when parsing access size: " << std::endl;
+		std::cerr << line << std::endl;
+		exit(-1);
+	    }
+	    break;
+	case 4:
+	case 5:
+	    accessSite += word + " ";
+	    break;
+	case 6:
+	case 7:
+	case 8:
+	    varInfo += word + " ";
+	    break;
+	}
+    }
+
+#if VERBOSE
+    std::cout << line << std::endl;
+    std::cout << "Parsed: " << std::endl;
+    std::cout << std::hex << "0x" << address << std::dec << std::endl;
+    std::cout << accessSize << std::endl;
+    std::cout << accessSite << std::endl;
+    std::cout << varInfo << std::endl;
+#endif
+
+    return true;
+}
+
+/* Parse an allocation record into rec. Return false if this is not one.
+ * alloc: <tid> <addr> <func> <item_size> <item_number> <alloc_source> <name> <type>
+ * Unlike in the access records, the type is kept whole.
+ */
+inline bool parseAllocRecord(const std::string &line, TraceRecord &rec)
+{
+    if(line.compare(0, 7, "alloc: ") != 0)
+	return false;
+
+    std::istringstream str(line.substr(7));
+    std::string addr, source, name, type;
+
+    str >> rec.tid >> addr >> rec.accessSite >> rec.itemSize >> rec.itemNumber
+	>> source;
+    if(str.fail())
+	return false;
+
+    /* memtracker writes " <name> <type>" even when it does not know
+     * them, so either may be empty, and the type may have several words.
+     */
+    std::string rest;
+    getline(str, rest);
+    if(rest.length() > 0)
+	rest.erase(0, 1);
+
+    size_t space = rest.find(' ');
+    name = rest.substr(0, space);
+    if(space != std::string::npos)
+	type = rest.substr(space + 1);
+    type.erase(type.find_last_not_of(' ') + 1);
+
+    rec.isAlloc = true;
+    rec.isWrite = false;
+    rec.address = strtoull(addr.c_str(), 0, 16);
+    rec.accessSize = 0;
+    rec.varInfo = source + " " + name + " " + type + " ";
+    return true;
+}
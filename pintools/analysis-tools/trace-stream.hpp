@@ -0,0 +1,469 @@
+/*
+ * Streams the access records of a memtracker trace from a file, a FIFO
+ * or the standard input. A reader thread reads and parses the trace and
+ * hands the records to the consumer in batches, through a bounded ring
+ * buffer. That lets the analysis run concurrently with memtracker, as in
+ *
+ * pin.sh -t memtracker.so -- ./app | ./wa -f -
+ *
+ * without the trace ever touching the disk. Because the ring buffer is
+ * bounded, a slow consumer back-pressures the reader (and, through the
+ * pipe, memtracker) instead of letting the parsed records pile up in memory.
+ *
+ * A compressed trace (memtracker -o <file> -z) is recognized by its first
+ * byte. Its frames are decompressed and parsed in parallel by a
+ * ParallelFrameReader, and the reader thread just passes them on.
+ * A packed trace (memtracker -b) is decoded by the reader thread, and
+ * its accesses are put back in the order of their timestamps.
+ *
+ * The tools that need to know the allocations can ask for the allocation
+ * records too. They come in the order they are in the trace, but only
+ * text and compressed traces have them.
+ *
+ * The stream can be limited to a slice of the trace: a range of access
+ * records, given by record numbers or by the time they were made, and a
+ * set of threads. If the trace has an index (memtracker -i), the reader
+ * seeks to the checkpoint just before the slice and stops after it, so
+ * reading a slice takes time in proportion to the slice, not the trace.
+ * Times are only known at the granularity of checkpoints, so selecting
+ * by time needs the index and may include records made a little before
+ * or after the range. Blocks of a packed trace from the threads or
+ * records we don't want are skipped without being decoded.
+ */
+#pragma once
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame-reader.hpp"
+#include "../packed-trace.hpp"
+#include "../trace-index.hpp"
+#include "trace-parser.hpp"
+
+/* The options that select a slice of the trace, for getopt_long */
+enum {
+    OPT_FROM = 256,
+    OPT_TO,
+    OPT_THREADS
+};
+
+static const struct option sliceOptions[] = {
+    {"from", required_argument, NULL, OPT_FROM},
+    {"to", required_argument, NULL, OPT_TO},
+    {"threads", required_argument, NULL, OPT_THREADS},
+    {NULL, 0, NULL, 0}
+};
+
+/* The part of the trace a tool asked for, with --from, --to and --threads */
+class TraceSlice
+{
+public:
+    /* The records from from up to, but not including, to. If fromTime or
+     * toTime is set, from or to is a time in microseconds since the start
+     * of the trace instead.
+     */
+    uint64_t from, to;
+    bool fromTime, toTime;
+    std::set<int> threads;  /* all of them if empty */
+
+    TraceSlice()
+	: from(0), to(TraceIndex::NO_RECORD), fromTime(false), toTime(false) {}
+
+    /* Parse a record number, or a time with an s, ms or us suffix */
+    static bool parseBound(const char *arg, uint64_t &value, bool &isTime)
+	{
+	    char *end;
+	    double v = strtod(arg, &end);
+
+	    if(end == arg || v < 0)
+		return false;
+
+	    isTime = true;
+	    if(strcmp(end, "s") == 0)
+		v *= 1000000;
+	    else if(strcmp(end, "ms") == 0)
+		v *= 1000;
+	    else if(strcmp(end, "us") != 0)
+	    {
+		isTime = false;
+		if(*end != '\0' || v != (uint64_t)v)
+		    return false;
+	    }
+	    value = v;
+	    return true;
+	}
+
+    bool setFrom(const char *arg)
+	{
+	    return parseBound(arg, from, fromTime);
+	}
+
+    bool setTo(const char *arg)
+	{
+	    return parseBound(arg, to, toTime);
+	}
+
+    /* Parse a comma-separated list of thread IDs */
+    bool setThreads(const char *arg)
+	{
+	    char *end;
+
+	    do
+	    {
+		long tid = strtol(arg, &end, 10);
+
+		if(end == arg || tid < 0 || (*end != ',' && *end != '\0'))
+		    return false;
+		threads.insert(tid);
+		arg = end + 1;
+	    } while(*end == ',');
+	    return true;
+	}
+
+    /* Handle one of the sliceOptions. Return false, with a message,
+     * if the argument is invalid. */
+    bool parseOption(int c, const char *arg)
+	{
+	    bool ok = (c == OPT_FROM && setFrom(arg)) || (c == OPT_TO && setTo(arg))
+		|| (c == OPT_THREADS && setThreads(arg));
+
+	    if(!ok)
+		std::cerr << "Invalid argument for --"
+			  << sliceOptions[c - OPT_FROM].name << ": " << arg << std::endl;
+	    return ok;
+	}
+
+    bool wantThread(int tid) const
+	{
+	    return threads.empty() || threads.count(tid) > 0;
+	}
+};
+
+class TraceStream
+{
+public:
+    /* The trace is read from fname, or from the standard input
+     * if fname is "-". The ring buffer holds up to numSlots batches
+     * of up to batchSize records each.
+     */
+    TraceStream(const char *fname, size_t numSlots = 64, size_t batchSize = 4096)
+	: fname(fname), record(0), allocations(false), slots(numSlots),
+	  batchSize(batchSize), head(0), tail(0), count(0), done(false) {}
+
+    /* Only stream the given slice of the trace. Call before start(). */
+    void select(const TraceSlice &slice)
+	{
+	    this->slice = slice;
+	}
+
+    /* Stream the allocation records too (isAlloc is set). They are not
+     * counted as records of the slice, and are always streamed. Call
+     * before start().
+     */
+    void withAllocations()
+	{
+	    allocations = true;
+	}
+
+    ~TraceStream()
+	{
+	    if(reader.joinable())
+		reader.join();
+	}
+
+    /* Open the trace, seek to the slice if we can, and start the
+     * reader thread. Return false if we could not open the trace.
+     */
+    bool start()
+	{
+	    TraceIndex index;
+	    const Checkpoint *cp = NULL;
+	    bool indexed = false;
+
+	    if(std::string(fname).compare("-") == 0)
+	    {
+		std::ios::sync_with_stdio(false);
+		in = &std::cin;
+	    }
+	    else
+	    {
+		traceFile.open(fname);
+		if(!traceFile.is_open())
+		    return false;
+		in = &traceFile;
+	    }
+
+	    int first = in->peek();
+	    if(first == (unsigned char)PACKED_MAGIC[0])
+	    {
+		packed.reset(new PackedReader(*in));
+		if(!packed->start())
+		    return false;
+	    }
+
+	    /* The definitions of a packed trace are in the index too,
+	     * so we can start reading it anywhere.
+	     */
+	    if(in == &traceFile)
+		indexed = index.load(fname, packed.get());
+
+	    if(slice.fromTime || slice.toTime)
+	    {
+		if(!indexed)
+		{
+		    std::cerr << "Selecting records by time needs the index of the trace "
+			      << "(memtracker -i)" << std::endl;
+		    return false;
+		}
+		if(slice.fromTime)
+		    slice.from = index.recordAt(slice.from);
+		if(slice.toTime)
+		    slice.to = index.recordAfter(slice.to);
+		slice.fromTime = slice.toTime = false;
+	    }
+
+	    if(indexed && slice.from > 0 && (cp = index.findRecord(slice.from)) != NULL)
+		record = cp->records;
+	    std::streamoff offset = cp ? cp->offset : 0;
+
+	    if(first == (unsigned char)FRAME_MAGIC[0])
+	    {
+		bool allocs = allocations;
+
+		frames.reset(new ParallelFrameReader<std::vector<TraceRecord>>(*in,
+		    [allocs](const char *text, size_t len, std::vector<TraceRecord> &batch)
+		    { parseFrame(text, len, batch, allocs); }));
+		if(!frames->start(offset))
+		    return false;
+	    }
+	    else if(offset != 0 && !in->seekg(offset))
+		return false;
+
+	    reader = std::thread(&TraceStream::readTrace, this);
+	    return true;
+	}
+
+    /* Get the next batch of records. The previous contents of the
+     * batch are discarded. Return false once the trace is over.
+     */
+    bool next(std::vector<TraceRecord> &batch)
+	{
+	    std::unique_lock<std::mutex> lk(m);
+
+	    notEmpty.wait(lk, [this]{ return count > 0 || done; });
+	    if(count == 0)
+		return false;
+
+	    batch.swap(slots[head]);
+	    head = (head + 1) % slots.size();
+	    count--;
+	    notFull.notify_one();
+	    return true;
+	}
+
+private:
+    const char *fname;
+    TraceSlice slice;
+    uint64_t record;  /* the number of the next record */
+    bool allocations;
+    std::ifstream traceFile;
+    std::istream *in;
+    std::thread reader;
+    std::unique_ptr<ParallelFrameReader<std::vector<TraceRecord>>> frames;
+    std::unique_ptr<PackedReader> packed;
+
+    /* The ring buffer */
+    std::vector<std::vector<TraceRecord>> slots;
+    size_t batchSize;
+    size_t head, tail, count;
+    bool done;
+    std::mutex m;
+    std::condition_variable notEmpty, notFull;
+
+    void push(std::vector<TraceRecord> &batch)
+	{
+	    std::unique_lock<std::mutex> lk(m);
+
+	    notFull.wait(lk, [this]{ return count < slots.size(); });
+	    batch.swap(slots[tail]);
+	    tail = (tail + 1) % slots.size();
+	    count++;
+	    notEmpty.notify_one();
+	}
+
+    /* Parse the access records, and the allocation records if asked
+     * to, of a frame of a compressed trace
+     */
+    static void parseFrame(const char *text, size_t len, std::vector<TraceRecord> &batch,
+			   bool allocations)
+	{
+	    const char *end = text + len;
+	    std::string line;
+	    TraceRecord rec;
+
+	    batch.clear();
+	    while(text < end)
+	    {
+		const char *nl = (const char*)memchr(text, '\n', end - text);
+
+		if(nl == NULL)
+		    nl = end;
+		line.assign(text, nl - text);
+		text = nl + 1;
+
+		if(parseAccessRecord(line, rec)
+		   || (allocations && parseAllocRecord(line, rec)))
+		    batch.push_back(rec);
+	    }
+	}
+
+    /* Drop the records of the batch that are not in the slice.
+     * Return false if we are past the end of the slice.
+     */
+    bool cut(std::vector<TraceRecord> &batch)
+	{
+	    size_t kept = 0;
+
+	    for(size_t i = 0; i < batch.size() && record < slice.to; i++)
+	    {
+		/* Allocations are not counted, and always kept */
+		if(!batch[i].isAlloc
+		   && (record++ < slice.from || !slice.wantThread(batch[i].tid)))
+		    continue;
+		if(kept != i)
+		    std::swap(batch[kept], batch[i]);
+		kept++;
+	    }
+	    batch.resize(kept);
+	    return record < slice.to;
+	}
+
+    void readTrace()
+	{
+	    std::vector<TraceRecord> batch;
+	    std::string line;
+	    TraceRecord rec;
+	    bool more = true;
+
+	    if(frames)
+	    {
+		while(more && frames->next(batch))
+		{
+		    more = cut(batch);
+		    if(batch.size() > 0)
+			push(batch);
+		}
+		if(frames->failed())
+		    std::cerr << "The compressed trace is truncated or corrupt" << std::endl;
+		finish();
+		return;
+	    }
+
+	    if(packed)
+	    {
+		readPacked();
+		finish();
+		return;
+	    }
+
+	    batch.reserve(batchSize);
+	    while(more && getline(*in, line))
+	    {
+		if(!parseAccessRecord(line, rec)
+		   && !(allocations && parseAllocRecord(line, rec)))
+		    continue;
+
+		batch.push_back(rec);
+		if(batch.size() == batchSize)
+		{
+		    more = cut(batch);
+		    if(batch.size() > 0)
+			push(batch);
+		    batch.clear();
+		    batch.reserve(batchSize);
+		}
+	    }
+
+	    if(more)
+		cut(batch);
+	    if(batch.size() > 0)
+		push(batch);
+	    finish();
+	}
+
+    /* Record numbers and slices refer to the order of the accesses in
+     * the file, so we cut the slice out of every block before we put
+     * the accesses in the order of their timestamps.
+     */
+    void readPacked()
+	{
+	    std::vector<TraceRecord> batch;
+	    std::vector<PackedAccess> accesses;
+	    TimeOrder order;
+	    PackedAccess pa;
+	    TraceRecord rec;
+	    uint64_t tid, numAccesses;
+	    bool more = true;
+
+	    batch.reserve(batchSize);
+	    while(more)
+	    {
+		more = record < slice.to && packed->nextBlock(tid, numAccesses);
+		if(more && (record + numAccesses <= slice.from || !slice.wantThread(tid)))
+		{
+		    more = packed->skipBlock();
+		    record += numAccesses;
+		    if(more)
+			continue;
+		}
+		if(more && (more = packed->readBlock(accesses)))
+		{
+		    size_t kept = 0;
+
+		    for(size_t i = 0; i < accesses.size(); i++, record++)
+			if(record >= slice.from && record < slice.to)
+			    accesses[kept++] = accesses[i];
+		    accesses.resize(kept);
+		    order.add(tid, accesses);
+		}
+
+		/* Go through the text format, so the records are
+		 * exactly what we would get from a text trace.
+		 */
+		uint64_t watermark = more ? packed->watermark() : TimeOrder::ALL;
+		while(order.next(watermark, tid, pa))
+		{
+		    if(parseAccessRecord(packed->text(tid, pa), rec))
+			batch.push_back(rec);
+		    if(batch.size() == batchSize)
+		    {
+			push(batch);
+			batch.clear();
+			batch.reserve(batchSize);
+		    }
+		}
+	    }
+
+	    if(batch.size() > 0)
+		push(batch);
+	    if(packed->failed())
+		std::cerr << "The packed trace is truncated or corrupt" << std::endl;
+	}
+
+    void finish()
+	{
+	    std::unique_lock<std::mutex> lk(m);
+	    done = true;
+	    notEmpty.notify_one();
+	}
+};
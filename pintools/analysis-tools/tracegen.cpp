@@ -0,0 +1,573 @@
+/*
+ * This tool generates synthetic memtracker traces, for testing the
+ * analysis tools at scale without running Pin. The traces have the
+ * allocation and access records that memtracker writes, in any of its
+ * formats, for a configurable number of threads, allocations, access
+ * sites and access patterns:
+ *
+ *   stream      every thread reads its allocations sequentially
+ *   random      uniformly random accesses to the thread's allocations
+ *   strided     accesses a fixed stride apart
+ *   zipf        a Zipf-distributed hot set of the thread's allocations
+ *   falseshare  pairs of threads write to different halves of a shared
+ *               cache line
+ *   mix         all of the above, chosen at random for every access
+ *
+ * The threads run in bursts of a few accesses, round-robin, so their
+ * accesses are interleaved as in a real trace. With -C, every thread
+ * replaces one of its allocations every so often, with a new one at a
+ * new address. The trace is deterministic for a given seed.
+ *
+ * With -g, the tool writes the ground truth of the trace to a file:
+ * the number of accesses of every thread, variable and pattern, and the
+ * cache lines that pairs of threads falsely share, so that the results
+ * of the analyses can be checked as well as their speed.
+ *
+ * Usage:
+ *   tracegen [-o <file>] [-z | -b | -c] [-g <file>] [-n <accesses>]
+ *            [-t <threads>] [-p <pattern>] [-V <variables>] [-S <sites>]
+ *            [-A <bytes>] [-d <bytes>] [-Z <skew>] [-C <accesses>] [-r <seed>]
+ *
+ * By default the trace is written to stdout, as text.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../columnar.hpp"
+#include "../packed-trace.hpp"
+#include "../trace-frames.hpp"
+
+using namespace std;
+
+#define LINE_SIZE 64
+#define HEAP_START 0x10000000ULL
+#define MAX_BURST 16
+
+enum pattern_t { STREAM, RANDOM, STRIDED, ZIPF, FALSESHARE, NUM_PATTERNS, MIX };
+
+static const char *patternNames[] = { "stream", "random", "strided", "zipf", "falseshare" };
+
+/* The weights of the patterns in the mix */
+static const int mixWeights[] = { 30, 20, 20, 20, 10 };
+
+/* Writes the records in the format the user asked for */
+class TraceOutput
+{
+public:
+    enum format_t { TEXT, COMPRESSED, PACKED, COLUMNAR };
+
+    TraceOutput()
+	: format(TEXT), out(stdout) {}
+
+    bool open(const char *fname, format_t format, int numThreads)
+	{
+	    this->format = format;
+	    if(format == COLUMNAR)
+		return fname != NULL && columnar.open(fname);
+
+	    if(fname != NULL && (out = fopen(fname, "w")) == NULL)
+		return false;
+	    if(format == COMPRESSED)
+		fwrite(FRAME_MAGIC, 1, FRAME_MAGIC_LEN, out);
+	    if(format == PACKED)
+	    {
+		fwrite(PACKED_MAGIC, 1, PACKED_MAGIC_LEN, out);
+		buffers.resize(numThreads);
+	    }
+	    return true;
+	}
+
+    /* The binary formats only have the access records */
+    void alloc(int tid, uint64_t address, uint64_t size, const string &site,
+	       const string &name, const string &type)
+	{
+	    char line[512];
+
+	    if(format == PACKED || format == COLUMNAR)
+		return;
+
+	    snprintf(line, sizeof(line), "alloc: %d 0x%016llx malloc %llu 1 %s %s %s\n",
+		     tid, (unsigned long long)address, (unsigned long long)size,
+		     site.c_str(), name.c_str(), type.c_str());
+	    write(line);
+	}
+
+    void access(int tid, uint64_t time, uint64_t address, uint32_t size, bool isWrite,
+		uint32_t siteId, const string &function, const string &source,
+		uint32_t varId, const string &var)
+	{
+	    if(format == COLUMNAR)
+	    {
+		columnar.append(address, size, tid, isWrite, source, function, var);
+		return;
+	    }
+
+	    if(format == PACKED)
+	    {
+		PackedAccess pa;
+
+		define(siteId, varId, function, source, var);
+		pa.address = address;
+		pa.time = time;
+		pa.siteId = siteId;
+		pa.varId = varId;
+		pa.size = size;
+		pa.isWrite = isWrite;
+		buffers[tid].push_back(pa);
+		if(buffers[tid].size() == PACKED_BLOCK_ACCESSES)
+		    flushBlock(tid, time + 1);
+		return;
+	    }
+
+	    char line[512];
+	    snprintf(line, sizeof(line), "%s %d 0x%016llx %u %s %s %s\n",
+		     isWrite ? "write:" : "read:", tid, (unsigned long long)address,
+		     size, function.c_str(), source.c_str(), var.c_str());
+	    write(line);
+	}
+
+    /* Write out what is buffered. Return false if any of the writes failed. */
+    bool close(uint64_t time)
+	{
+	    if(format == COLUMNAR)
+		return columnar.close();
+
+	    if(format == PACKED)
+	    {
+		for(size_t tid = 0; tid < buffers.size(); tid++)
+		    flushBlock(tid, time);
+	    }
+	    if(format == COMPRESSED)
+		writeFrame(text.length());
+	    else if(format == TEXT)
+		fwrite(text.data(), 1, text.length(), out);
+	    return !ferror(out) && fclose(out) == 0;
+	}
+
+private:
+    enum { PACKED_BLOCK_ACCESSES = 4096 };
+
+    format_t format;
+    FILE *out;
+    string text;
+    ColumnarWriter columnar;
+
+    vector<vector<PackedAccess> > buffers;
+    vector<bool> sitesDefined, variablesDefined;
+    PackedEncoder encoder;
+    string rec;
+
+    void write(const char *line)
+	{
+	    text += line;
+	    if(text.length() < FRAME_SIZE)
+		return;
+
+	    if(format == COMPRESSED)
+		writeFrame(text.rfind('\n', FRAME_SIZE - 1) + 1);
+	    else
+	    {
+		fwrite(text.data(), 1, text.length(), out);
+		text.clear();
+	    }
+	}
+
+    /* Compress the first len bytes of the text as a frame */
+    void writeFrame(size_t len)
+	{
+	    string frame;
+
+	    if(len == 0)
+		return;
+	    if(!compressFrame(text.data(), len, frame, Z_BEST_SPEED))
+	    {
+		cerr << "Failed to compress a frame" << endl;
+		exit(-1);
+	    }
+	    fwrite(frame.data(), 1, frame.length(), out);
+	    text.erase(0, len);
+	}
+
+    /* Define the site and the variable before the first block using them */
+    void define(uint32_t siteId, uint32_t varId, const string &function,
+		const string &source, const string &var)
+	{
+	    if(sitesDefined.size() <= siteId)
+		sitesDefined.resize(siteId + 1);
+	    if(!sitesDefined[siteId])
+	    {
+		encodeSite(siteId, function, source, rec);
+		fwrite(rec.data(), 1, rec.length(), out);
+		sitesDefined[siteId] = true;
+	    }
+
+	    if(variablesDefined.size() <= varId)
+		variablesDefined.resize(varId + 1);
+	    if(varId != 0 && !variablesDefined[varId])
+	    {
+		encodeVariable(varId, var, rec);
+		fwrite(rec.data(), 1, rec.length(), out);
+		variablesDefined[varId] = true;
+	    }
+	}
+
+    /* Write the thread's buffer as a block, followed by an epoch marker.
+     * Nothing older than the oldest access still buffered by any thread
+     * comes after the marker.
+     */
+    void flushBlock(size_t tid, uint64_t now)
+	{
+	    string block;
+	    uint64_t watermark = now;
+
+	    if(buffers[tid].empty())
+		return;
+
+	    encoder.encodeBlock(tid, buffers[tid], block);
+	    fwrite(block.data(), 1, block.length(), out);
+	    buffers[tid].clear();
+
+	    for(const vector<PackedAccess> &b: buffers)
+		if(!b.empty())
+		    watermark = min(watermark, b[0].time);
+	    /* One access per microsecond */
+	    encodeEpoch(now, now, watermark, rec);
+	    fwrite(rec.data(), 1, rec.length(), out);
+	}
+};
+
+/* An allocation of a thread */
+class Allocation
+{
+public:
+    uint64_t base;
+    uint32_t varId;
+    string var;   /* as in the access records */
+};
+
+/* The state of a thread */
+class Thread
+{
+public:
+    vector<Allocation> allocations;
+    uint64_t accesses;
+    size_t streamAlloc, strideAlloc;
+    uint64_t streamOffset, strideOffset;
+
+    Thread()
+	: accesses(0), streamAlloc(0), strideAlloc(0), streamOffset(0), strideOffset(0) {}
+};
+
+/* The ground truth of the trace */
+class GroundTruth
+{
+public:
+    uint64_t accesses;
+    vector<uint64_t> threadAccesses;
+    uint64_t patternAccesses[NUM_PATTERNS];
+    map<string, pair<uint64_t, uint64_t> > varAccesses;  /* reads, writes */
+    map<uint64_t, pair<int, int> > sharedLines;
+
+    GroundTruth()
+	: accesses(0)
+	{
+	    memset(patternAccesses, 0, sizeof(patternAccesses));
+	}
+
+    bool write(const char *fname) const
+	{
+	    ofstream f(fname);
+
+	    f << "# tracegen ground truth" << endl;
+	    f << "accesses " << accesses << endl;
+	    for(size_t t = 0; t < threadAccesses.size(); t++)
+		f << "thread " << t << " " << threadAccesses[t] << endl;
+	    for(int p = 0; p < NUM_PATTERNS; p++)
+		f << "pattern " << patternNames[p] << " " << patternAccesses[p] << endl;
+	    for(map<string, pair<uint64_t, uint64_t> >::const_iterator it = varAccesses.begin();
+		it != varAccesses.end(); it++)
+		f << "variable " << it->first << " " << it->second.first << " reads "
+		  << it->second.second << " writes" << endl;
+	    for(map<uint64_t, pair<int, int> >::const_iterator it = sharedLines.begin();
+		it != sharedLines.end(); it++)
+		f << "false-sharing 0x" << hex << it->first << dec << " threads "
+		  << it->second.first << " " << it->second.second << endl;
+	    f.close();
+	    return !f.fail();
+	}
+};
+
+static void usage()
+{
+    cerr << "Usage: tracegen [-o <file>] [-z | -b | -c] [-g <file>] [-n <accesses>]" << endl
+	 << "                [-t <threads>] [-p <pattern>] [-V <variables>] [-S <sites>]" << endl
+	 << "                [-A <bytes>] [-d <bytes>] [-Z <skew>] [-C <accesses>] [-r <seed>]" << endl;
+    exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+    char *outName = NULL, *truthName = NULL;
+    TraceOutput::format_t format = TraceOutput::TEXT;
+    uint64_t numAccesses = 1000000;
+    int numThreads = 4, numVariables = 16, numSites = 64;
+    uint64_t allocSize = 4096, stride = 256, churn = 0, seed = 1;
+    double skew = 0.99;
+    int pattern = MIX;
+    int c;
+
+    while ((c = getopt (argc, argv, "o:zbcg:n:t:p:V:S:A:d:Z:C:r:")) != -1)
+	switch(c)
+	{
+	case 'o':
+	    outName = optarg;
+	    break;
+	case 'z':
+	    format = TraceOutput::COMPRESSED;
+	    break;
+	case 'b':
+	    format = TraceOutput::PACKED;
+	    break;
+	case 'c':
+	    format = TraceOutput::COLUMNAR;
+	    break;
+	case 'g':
+	    truthName = optarg;
+	    break;
+	case 'n':
+	    numAccesses = strtoull(optarg, NULL, 10);
+	    break;
+	case 't':
+	    numThreads = atoi(optarg);
+	    break;
+	case 'p':
+	    pattern = -1;
+	    if(strcmp(optarg, "mix") == 0)
+		pattern = MIX;
+	    for(int p = 0; p < NUM_PATTERNS; p++)
+		if(strcmp(optarg, patternNames[p]) == 0)
+		    pattern = p;
+	    if(pattern < 0)
+	    {
+		cerr << "Unknown pattern " << optarg << ". Please use stream, random, "
+		     << "strided, zipf, falseshare or mix." << endl;
+		exit(-1);
+	    }
+	    break;
+	case 'V':
+	    numVariables = atoi(optarg);
+	    break;
+	case 'S':
+	    numSites = atoi(optarg);
+	    break;
+	case 'A':
+	    allocSize = strtoull(optarg, NULL, 10);
+	    break;
+	case 'd':
+	    stride = strtoull(optarg, NULL, 10);
+	    break;
+	case 'Z':
+	    skew = atof(optarg);
+	    break;
+	case 'C':
+	    churn = strtoull(optarg, NULL, 10);
+	    break;
+	case 'r':
+	    seed = strtoull(optarg, NULL, 10);
+	    break;
+	case '?':
+	default:
+	    usage();
+	}
+
+    if(numThreads < 1 || numVariables < 1 || numSites < 1 || allocSize < 8 || stride < 1)
+    {
+	cerr << "Need at least one thread, variable and site, allocations of "
+	     << "at least 8 bytes and a stride of at least 1." << endl;
+	exit(-1);
+    }
+    if(format == TraceOutput::COLUMNAR && outName == NULL)
+    {
+	cerr << "The columnar format (-c) needs an output file (-o)" << endl;
+	exit(-1);
+    }
+
+    TraceOutput out;
+    if(!out.open(outName, format, numThreads))
+    {
+	cerr << "Failed to create file " << (outName ? outName : "stdout") << endl;
+	exit(-1);
+    }
+
+    mt19937_64 rng(seed);
+    GroundTruth truth;
+    vector<Thread> threads(numThreads);
+    uint64_t heap = HEAP_START;
+    uint32_t numVarIds = 1;   /* 0 is for no variable */
+    char buf[256];
+
+    truth.threadAccesses.resize(numThreads);
+
+    /* The access sites */
+    vector<string> functions(numSites), sources(numSites);
+    for(int s = 0; s < numSites; s++)
+    {
+	functions[s] = "gen_func_" + to_string(s % 16);
+	sources[s] = "gen.c:" + to_string(100 + s);
+    }
+
+    /* Allocate a variable, at a new address, aligned to a cache line */
+    auto allocate = [&](int tid, int slot, uint64_t size, const string &name,
+			Allocation &a) {
+	string site = "gen.c:" + to_string(1000 + slot);
+	string type = "gen_type_" + to_string(slot % 8);
+
+	a.base = heap;
+	a.varId = numVarIds++;
+	a.var = site + " " + name + " " + type;
+	heap += (size + LINE_SIZE - 1) / LINE_SIZE * LINE_SIZE;
+	out.alloc(tid, a.base, size, site, name, type);
+    };
+
+    for(int t = 0; t < numThreads; t++)
+    {
+	threads[t].allocations.resize(numVariables);
+	for(int v = 0; v < numVariables; v++)
+	{
+	    snprintf(buf, sizeof(buf), "t%d_v%d", t, v);
+	    allocate(t, v, allocSize, buf, threads[t].allocations[v]);
+	}
+    }
+
+    /* The lines shared by pairs of threads */
+    Allocation shared;
+    int numPairs = numThreads / 2;
+    allocate(0, numVariables, (numPairs ? numPairs : 1) * LINE_SIZE, "shared_pairs", shared);
+
+    /* The Zipf distribution over the allocations of a thread */
+    vector<double> zipfCdf(numVariables);
+    double total = 0;
+    for(int v = 0; v < numVariables; v++)
+	zipfCdf[v] = (total += 1.0 / pow(v + 1, skew));
+    for(int v = 0; v < numVariables; v++)
+	zipfCdf[v] /= total;
+
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    int totalWeight = 0;
+    for(int p = 0; p < NUM_PATTERNS; p++)
+	totalWeight += mixWeights[p];
+
+    uint64_t time = 0;
+    int tid = 0;
+    while(time < numAccesses)
+    {
+	Thread &th = threads[tid];
+	uint64_t burst = 1 + rng() % MAX_BURST;
+
+	for(uint64_t i = 0; i < burst && time < numAccesses; i++)
+	{
+	    int p = pattern;
+	    if(p == MIX)
+	    {
+		int w = rng() % totalWeight;
+		for(p = 0; w >= mixWeights[p]; p++)
+		    w -= mixWeights[p];
+	    }
+
+	    /* A thread without a partner has nobody to falsely share with */
+	    if(p == FALSESHARE && tid >= 2 * numPairs)
+		p = RANDOM;
+
+	    Allocation *a;
+	    uint64_t offset;
+	    uint32_t size = 8;
+	    bool isWrite = rng() % 4 == 0;
+
+	    switch(p)
+	    {
+	    case STREAM:
+		a = &th.allocations[th.streamAlloc];
+		offset = th.streamOffset;
+		if((th.streamOffset += size) + size > allocSize)
+		{
+		    th.streamOffset = 0;
+		    th.streamAlloc = (th.streamAlloc + 1) % numVariables;
+		}
+		break;
+	    case STRIDED:
+		a = &th.allocations[th.strideAlloc];
+		offset = th.strideOffset;
+		if((th.strideOffset += stride) + size > allocSize)
+		{
+		    th.strideOffset = 0;
+		    th.strideAlloc = (th.strideAlloc + 1) % numVariables;
+		}
+		break;
+	    case ZIPF:
+		a = &th.allocations[lower_bound(zipfCdf.begin(), zipfCdf.end(), unit(rng))
+				    - zipfCdf.begin()];
+		offset = rng() % (allocSize / size) * size;
+		break;
+	    case FALSESHARE:
+		a = &shared;
+		offset = (tid / 2) * LINE_SIZE + (tid % 2) * (LINE_SIZE / 2);
+		isWrite = true;
+		truth.sharedLines[a->base + (tid / 2) * LINE_SIZE] =
+		    make_pair(tid - tid % 2, tid - tid % 2 + 1);
+		break;
+	    case RANDOM:
+	    default:
+		size = 1 << (rng() % 4);
+		a = &th.allocations[rng() % numVariables];
+		offset = rng() % (allocSize / size) * size;
+		break;
+	    }
+
+	    int site = (a->varId * NUM_PATTERNS + p) % numSites;
+	    out.access(tid, time, a->base + offset, size, isWrite, site,
+		       functions[site], sources[site], a->varId, a->var);
+
+	    truth.accesses++;
+	    truth.threadAccesses[tid]++;
+	    truth.patternAccesses[p]++;
+	    if(isWrite)
+		truth.varAccesses[a->var].second++;
+	    else
+		truth.varAccesses[a->var].first++;
+	    time++;
+
+	    /* Replace one of the thread's allocations with a new one */
+	    if(churn && ++th.accesses % churn == 0)
+	    {
+		int v = rng() % numVariables;
+
+		snprintf(buf, sizeof(buf), "t%d_v%d", tid, v);
+		allocate(tid, v, allocSize, buf, th.allocations[v]);
+	    }
+	}
+	tid = (tid + 1) % numThreads;
+    }
+
+    if(!out.close(time))
+    {
+	cerr << "Failed to write the trace" << endl;
+	exit(-1);
+    }
+    if(truthName != NULL && !truth.write(truthName))
+    {
+	cerr << "Failed to write the ground truth to " << truthName << endl;
+	exit(-1);
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * This tool prints a packed trace, written by memtracker with -b (see
+ * ../packed-trace.hpp), in the text format of the trace, so it can be
+ * used with the tools that only read text traces. With -s it instead
+ * prints how many accesses and blocks the trace has, and how many bytes
+ * an access takes on average.
+ *
+ * The accesses are printed in the order of their timestamps, or with -b
+ * in the order of the blocks in the trace.
+ *
+ * Usage:
+ *   unpack [-s] [-b] [-f <trace>]
+ *
+ * By default the trace is read from stdin.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../packed-trace.hpp"
+
+using namespace std;
+
+static void printAccess(const PackedReader &reader, uint64_t tid, const PackedAccess &pa)
+{
+    string line = reader.text(tid, pa);
+
+    line.push_back('\n');
+    fwrite(line.data(), 1, line.length(), stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    char *fname = NULL;
+    int c;
+    bool stats = false;
+    bool blockOrder = false;
+    ifstream traceFile;
+    istream *in = &cin;
+
+    while ((c = getopt (argc, argv, "bf:s")) != -1)
+	switch(c)
+	{
+	case 'b':
+	    blockOrder = true;
+	    break;
+	case 'f':
+	    fname = optarg;
+	    break;
+	case 's':
+	    stats = true;
+	    break;
+	case '?':
+	default:
+	    cerr << "Unknown option or missing option argument." << endl;
+	    exit(-1);
+	}
+
+    if(fname != NULL && string(fname).compare("-") != 0)
+    {
+	traceFile.open(fname, ios::binary);
+	if(!traceFile.is_open())
+	{
+	    cerr << "Failed to open file " << fname << endl;
+	    exit(-1);
+	}
+	in = &traceFile;
+    }
+
+    PackedReader reader(*in);
+    if(!reader.start())
+    {
+	cerr << "This is not a packed trace" << endl;
+	exit(-1);
+    }
+
+    vector<PackedAccess> accesses;
+    TimeOrder order;
+    PackedAccess pa;
+    uint64_t tid;
+    size_t numAccesses = 0, numBlocks = 0;
+    bool more = true;
+
+    while(more)
+    {
+	more = reader.next(tid, accesses);
+	if(more)
+	{
+	    numBlocks++;
+	    numAccesses += accesses.size();
+	    if(stats)
+		continue;
+
+	    if(blockOrder)
+	    {
+		for(PackedAccess &pa: accesses)
+		    printAccess(reader, tid, pa);
+		continue;
+	    }
+	    order.add(tid, accesses);
+	}
+
+	/* At the end of the trace, everything left is in order */
+	uint64_t watermark = more ? reader.watermark() : TimeOrder::ALL;
+	while(order.next(watermark, tid, pa))
+	    printAccess(reader, tid, pa);
+    }
+
+    if(stats)
+    {
+	in->clear();
+	streamoff bytes = in->tellg();
+
+	cout << "Accesses: " << numAccesses << endl;
+	cout << "Blocks: " << numBlocks << endl;
+	if(bytes > 0 && numAccesses > 0)
+	    cout << "Bytes per access: " << (double)bytes / numAccesses << endl;
+    }
+
+    if(reader.failed())
+    {
+	cerr << "The packed trace is truncated or corrupt" << endl;
+	return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,480 @@
+/*
+ * This tool reads a memtracker trace (in any of the formats read by
+ * TraceStream) and reports how the working set of the program changes
+ * over time, and the phases the program goes through.
+ *
+ * The working set is the number of distinct cache lines, and of distinct
+ * pages, accessed in a window of the last -w accesses, for the whole
+ * program and for every thread (in a window of the thread's own
+ * accesses). The window slides with every access: we keep the last
+ * access of every line in the window, and a ring of the lines of the
+ * last -w accesses, so that we know which line leaves the window when.
+ * We sample the working sets every -S accesses.
+ *
+ * To find the phases, we cut the trace into intervals of -w accesses and
+ * count the accesses of every site in every interval, as SimPoint does
+ * with basic blocks (Sherwood et al., ASPLOS 2002). Two intervals are in
+ * the same phase if the Manhattan distance between their normalized site
+ * vectors is below -t. An interval goes to the first phase close enough
+ * to the interval that started it, or starts a new phase. For every
+ * phase we report the interval closest to the average of its intervals,
+ * which is a good place for a short trace of the phase.
+ *
+ * With -c the samples are printed in CSV format, to plot.
+ */
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <utility>
+#include <unistd.h>
+#include <getopt.h>
+#include <ctgmath>
+#include <stdlib.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "trace-stream.hpp"
+
+using namespace std;
+
+int CACHE_LINE_SIZE = 64;  /* in bytes */
+int PAGE_SIZE = 4096;      /* in bytes */
+int lineOffsetBits, pageOffsetBits;
+size_t WINDOW = 100000;    /* accesses */
+size_t STEP = 0;           /* accesses between samples, WINDOW / 4 by default */
+double PHASE_THRESHOLD = 0.4;
+
+/* Sites of a phase to print */
+#define PHASE_TOP_SITES 5
+
+/* The distinct lines, or pages, accessed in a sliding window of
+ * accesses */
+class WorkingSet
+{
+public:
+    WorkingSet()
+	: now(0) {}
+
+    void access(size_t unit)
+	{
+	    if(ring.empty())
+		ring.resize(WINDOW);
+
+	    size_t slot = now % WINDOW;
+
+	    /* The oldest access leaves the window. If it was the last
+	     * access to its unit, the unit leaves the working set. */
+	    if(now >= WINDOW)
+	    {
+		unordered_map<size_t, size_t>::iterator it = last.find(ring[slot]);
+
+		if(it->second == now - WINDOW)
+		    last.erase(it);
+	    }
+	    ring[slot] = unit;
+	    last[unit] = now;
+	    now++;
+	}
+
+    size_t size()
+	{
+	    return last.size();
+	}
+
+private:
+    size_t now;
+    vector<size_t> ring;                 /* the units of the last accesses */
+    unordered_map<size_t, size_t> last;  /* unit -> its last access */
+};
+
+class Footprint
+{
+public:
+    WorkingSet lines, pages;
+    size_t maxLines, maxPages;
+
+    Footprint()
+	: maxLines(0), maxPages(0) {}
+
+    void access(size_t address)
+	{
+	    lines.access(address >> lineOffsetBits);
+	    pages.access(address >> pageOffsetBits);
+	}
+
+    void sample()
+	{
+	    maxLines = max(maxLines, lines.size());
+	    maxPages = max(maxPages, pages.size());
+	}
+};
+
+/* The working sets at some point, of the program or of a thread */
+class Sample
+{
+public:
+    size_t record;
+    int tid;            /* -1 for the whole program */
+    size_t lines, pages;
+};
+
+/* Accesses per site, normalized so that they add up to one */
+typedef map<int, double> SiteVector;
+
+double distance(const SiteVector &a, const SiteVector &b)
+{
+    SiteVector::const_iterator i = a.begin(), j = b.begin();
+    double d = 0;
+
+    while(i != a.end() || j != b.end())
+    {
+	if(j == b.end() || (i != a.end() && i->first < j->first))
+	    d += (i++)->second;
+	else if(i == a.end() || j->first < i->first)
+	    d += (j++)->second;
+	else
+	    d += fabs((i++)->second - (j++)->second);
+    }
+    return d / 2;   /* from 0 (the same) to 1 (no sites in common) */
+}
+
+class Interval
+{
+public:
+    size_t from, to;    /* records */
+    SiteVector sites;
+    size_t lines, pages; /* the largest working sets sampled in it */
+    int phase;
+};
+
+class Phase
+{
+public:
+    SiteVector leader;   /* of the interval that started the phase */
+    vector<int> intervals;
+};
+
+Footprint global;
+map<int, Footprint> threadFootprints;
+unordered_map<string, int> siteIds;
+vector<string> siteNames;
+vector<Interval> intervals;
+vector<Phase> phases;
+
+/* The samples of the current interval, printed once we know its phase */
+vector<Sample> pending;
+map<int, size_t> intervalCounts;  /* accesses of every site */
+
+void takeSample(size_t record)
+{
+    Sample s;
+
+    global.sample();
+    s.record = record;
+    s.tid = -1;
+    s.lines = global.lines.size();
+    s.pages = global.pages.size();
+    pending.push_back(s);
+
+    for(auto &t: threadFootprints)
+    {
+	t.second.sample();
+	s.tid = t.first;
+	s.lines = t.second.lines.size();
+	s.pages = t.second.pages.size();
+	pending.push_back(s);
+    }
+}
+
+void printSamples(int phase, bool csv)
+{
+    if(!csv)
+	return;
+
+    for(Sample &s: pending)
+	cout << s.record << "," << (s.tid < 0 ? "global" : "thread " + to_string(s.tid))
+	     << "," << s.lines << "," << s.lines * CACHE_LINE_SIZE << "," << s.pages
+	     << "," << s.pages * PAGE_SIZE << "," << phase << endl;
+}
+
+/* Close the interval that ends before the given record, find its
+ * phase and print its samples */
+void endInterval(size_t record, bool csv)
+{
+    Interval in;
+    size_t total = 0;
+
+    if(intervalCounts.empty())
+    {
+	printSamples(intervals.empty() ? 0 : intervals.back().phase, csv);
+	pending.clear();
+	return;
+    }
+
+    in.from = intervals.empty() ? 0 : intervals.back().to;
+    in.to = record;
+    in.lines = in.pages = 0;
+    for(Sample &s: pending)
+	if(s.tid < 0)
+	{
+	    in.lines = max(in.lines, s.lines);
+	    in.pages = max(in.pages, s.pages);
+	}
+
+    for(auto &c: intervalCounts)
+	total += c.second;
+    for(auto &c: intervalCounts)
+	in.sites[c.first] = (double)c.second / total;
+
+    in.phase = -1;
+    for(size_t p = 0; p < phases.size() && in.phase < 0; p++)
+	if(distance(in.sites, phases[p].leader) < PHASE_THRESHOLD)
+	    in.phase = p;
+    if(in.phase < 0)
+    {
+	in.phase = phases.size();
+	phases.push_back(Phase());
+	phases.back().leader = in.sites;
+    }
+    phases[in.phase].intervals.push_back(intervals.size());
+    intervals.push_back(in);
+
+    printSamples(in.phase, csv);
+    pending.clear();
+    intervalCounts.clear();
+}
+
+/* The interval of the phase closest to the average of its intervals */
+int representative(Phase &phase)
+{
+    SiteVector centroid;
+
+    for(int i: phase.intervals)
+	for(auto &s: intervals[i].sites)
+	    centroid[s.first] += s.second / phase.intervals.size();
+
+    int best = phase.intervals[0];
+    double bestDistance = 2;
+    for(int i: phase.intervals)
+    {
+	double d = distance(intervals[i].sites, centroid);
+
+	if(d < bestDistance)
+	{
+	    best = i;
+	    bestDistance = d;
+	}
+    }
+    return best;
+}
+
+string sizeString(size_t bytes)
+{
+    if(bytes >= 1024 * 1024 * 1024)
+	return to_string(bytes / (1024 * 1024 * 1024)) + "G";
+    if(bytes >= 1024 * 1024)
+	return to_string(bytes / (1024 * 1024)) + "M";
+    if(bytes >= 1024)
+	return to_string(bytes / 1024) + "K";
+    return to_string(bytes);
+}
+
+void printReport(bool fullTrace, size_t base)
+{
+    cout << "Line size = " << CACHE_LINE_SIZE << ", page size = " << PAGE_SIZE
+	 << ", window = " << WINDOW << " accesses" << endl;
+
+    cout << "*************************************************" << endl;
+    cout << "           LARGEST WORKING SETS                  " << endl;
+    cout << "*************************************************" << endl;
+    cout << setw(10) << "" << setw(12) << "lines" << setw(10) << "bytes"
+	 << setw(12) << "pages" << setw(10) << "bytes" << endl;
+    cout << setw(10) << "global" << setw(12) << global.maxLines
+	 << setw(10) << sizeString(global.maxLines * CACHE_LINE_SIZE)
+	 << setw(12) << global.maxPages
+	 << setw(10) << sizeString(global.maxPages * PAGE_SIZE) << endl;
+    for(auto &t: threadFootprints)
+	cout << setw(10) << "thread " + to_string(t.first) << setw(12) << t.second.maxLines
+	     << setw(10) << sizeString(t.second.maxLines * CACHE_LINE_SIZE)
+	     << setw(12) << t.second.maxPages
+	     << setw(10) << sizeString(t.second.maxPages * PAGE_SIZE) << endl;
+
+    cout << endl;
+    cout << "*************************************************" << endl;
+    cout << "                  PHASES                         " << endl;
+    cout << "*************************************************" << endl;
+    cout << "Intervals:";
+    for(Interval &in: intervals)
+	cout << " " << in.phase;
+    cout << endl << endl;
+
+    for(size_t p = 0; p < phases.size(); p++)
+    {
+	Phase &phase = phases[p];
+	Interval &rep = intervals[representative(phase)];
+	size_t lines = 0, pages = 0;
+	map<int, double> sites;
+
+	for(int i: phase.intervals)
+	{
+	    lines = max(lines, intervals[i].lines);
+	    pages = max(pages, intervals[i].pages);
+	    for(auto &s: intervals[i].sites)
+		sites[s.first] += s.second / phase.intervals.size();
+	}
+
+	cout << "Phase " << p << ": " << phase.intervals.size() << " intervals, "
+	     << "working set up to " << lines << " lines ("
+	     << sizeString(lines * CACHE_LINE_SIZE) << "), " << pages << " pages ("
+	     << sizeString(pages * PAGE_SIZE) << ")" << endl;
+	if(fullTrace)
+	    cout << "\trepresentative interval: --from " << base + rep.from
+		 << " --to " << base + rep.to << endl;
+	else
+	    cout << "\trepresentative interval: records " << rep.from << " to "
+		 << rep.to << " of the slice" << endl;
+
+	vector<pair<double, int> > top;
+	for(auto &s: sites)
+	    top.push_back(make_pair(s.second, s.first));
+	sort(top.rbegin(), top.rend());
+	for(size_t i = 0; i < top.size() && i < PHASE_TOP_SITES; i++)
+	    cout << "\t" << fixed << setprecision(1) << setw(5) << 100 * top[i].first
+		 << "% " << siteNames[top[i].second] << endl;
+	cout.unsetf(ios::fixed);
+	cout << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char *fname = NULL;
+    char *nptr;
+    int c;
+    bool csv = false;
+    TraceSlice slice;
+
+    while ((c = getopt_long (argc, argv, "cf:l:p:S:t:w:", sliceOptions, NULL)) != -1)
+	switch(c)
+	{
+	case 'c':
+	    csv = true;
+	    break;
+	case 'f':
+	    fname = optarg;
+	    break;
+	case 'l':
+	    CACHE_LINE_SIZE = strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || CACHE_LINE_SIZE <= 0
+	       || (CACHE_LINE_SIZE & (CACHE_LINE_SIZE - 1)))
+	    {
+		cerr << "Invalid argument for the cache line size: "
+		     << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case 'p':
+	    PAGE_SIZE = strtol(optarg, &nptr, 10);
+	    if(nptr == optarg || PAGE_SIZE <= 0 || (PAGE_SIZE & (PAGE_SIZE - 1)))
+	    {
+		cerr << "Invalid argument for the page size: " << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case 'S': /* Accesses between samples */
+	    STEP = strtoul(optarg, &nptr, 10);
+	    if(nptr == optarg || STEP == 0)
+	    {
+		cerr << "Invalid argument for the sampling step: " << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case 't': /* Distance between phases */
+	    PHASE_THRESHOLD = strtod(optarg, &nptr);
+	    if(nptr == optarg || PHASE_THRESHOLD <= 0 || PHASE_THRESHOLD > 1)
+	    {
+		cerr << "Invalid argument for the phase threshold: " << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case 'w': /* Window, in accesses */
+	    WINDOW = strtoul(optarg, &nptr, 10);
+	    if(nptr == optarg || WINDOW == 0)
+	    {
+		cerr << "Invalid argument for the window: " << optarg << endl;
+		exit(-1);
+	    }
+	    break;
+	case OPT_FROM:
+	case OPT_TO:
+	case OPT_THREADS:
+	    if(!slice.parseOption(c, optarg))
+		exit(-1);
+	    break;
+	case '?':
+	default:
+	    cerr << "Unknown option or missing option argument." << endl;
+	    exit(-1);
+	}
+
+    if(fname == NULL)
+    {
+	cerr << "Please provide input trace file with the -f option." << endl;
+	exit(-1);
+    }
+
+    lineOffsetBits = log2(CACHE_LINE_SIZE);
+    pageOffsetBits = log2(PAGE_SIZE);
+    if(STEP == 0)
+	STEP = max(WINDOW / 4, (size_t)1);
+
+    TraceStream traceStream(fname);
+    traceStream.select(slice);
+    if(!traceStream.start())
+    {
+	cerr << "Failed to open file " << fname << endl;
+	exit(-1);
+    }
+
+    if(csv)
+	cout << "record,scope,lines,line_bytes,pages,page_bytes,phase" << endl;
+
+    vector<TraceRecord> batch;
+    size_t record = 0;
+
+    while(traceStream.next(batch))
+    {
+	for(TraceRecord &rec: batch)
+	{
+	    unordered_map<string, int>::iterator id = siteIds.find(rec.accessSite);
+
+	    if(id == siteIds.end())
+	    {
+		id = siteIds.insert(make_pair(rec.accessSite, (int)siteNames.size())).first;
+		siteNames.push_back(rec.accessSite);
+	    }
+	    intervalCounts[id->second]++;
+
+	    global.access(rec.address);
+	    threadFootprints[rec.tid].access(rec.address);
+
+	    record++;
+	    if(record % STEP == 0)
+		takeSample(record);
+	    if(record % WINDOW == 0)
+		endInterval(record, csv);
+	}
+    }
+    if(record % STEP != 0)
+	takeSample(record);
+    endInterval(record, csv);
+
+    if(!csv)
+	printReport(!slice.fromTime && slice.threads.empty(), slice.from);
+}
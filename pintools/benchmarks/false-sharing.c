@@ -0,0 +1,60 @@
+/*
+ * Multi-threaded counters that share a cache line: every thread
+ * increments its own counter, but the counters are packed next to each
+ * other, so the line bounces between the cores. With -p, the counters
+ * are padded to a line each, for comparison.
+ *
+ * Usage: false-sharing [-p] [threads] [increments]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE 64
+
+static char *counters;
+static long stride = sizeof(long);
+static long increments;
+
+static void *work(void *arg)
+{
+    volatile long *counter = (volatile long*)(counters + (long)arg * stride);
+    long i;
+
+    for(i = 0; i < increments; i++)
+	(*counter)++;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int arg = 1, threads;
+    pthread_t *tids;
+    long sum = 0, t;
+
+    if(argc > 1 && strcmp(argv[1], "-p") == 0)
+    {
+	stride = LINE;
+	arg++;
+    }
+    threads = argc > arg ? atoi(argv[arg]) : 4;
+    increments = argc > arg + 1 ? atol(argv[arg + 1]) : 1 << 20;
+
+    counters = aligned_alloc(LINE, threads * stride + LINE);
+    memset(counters, 0, threads * stride);
+    tids = malloc(threads * sizeof(pthread_t));
+
+    for(t = 0; t < threads; t++)
+	pthread_create(&tids[t], NULL, work, (void*)t);
+    for(t = 0; t < threads; t++)
+    {
+	pthread_join(tids[t], NULL);
+	sum += *(long*)(counters + t * stride);
+    }
+
+    printf("%ld\n", sum);
+    free(tids);
+    free(counters);
+    return 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * Allocation-heavy: keep a pool of live objects of random sizes and
+ * replace one of them at every step, touching each new object once.
+ * Measures the cost of tracking allocations.
+ *
+ * Usage: malloc-loop [allocations] [live objects]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char *argv[])
+{
+    long n = argc > 1 ? atol(argv[1]) : 1 << 16;
+    long live = argc > 2 ? atol(argv[2]) : 1024;
+    char **pool = calloc(live, sizeof(char*));
+    long sum = 0, i;
+
+    srand(1);
+    for(i = 0; i < n; i++)
+    {
+	long slot = rand() % live;
+	size_t size = 16 + rand() % 1024;
+
+	free(pool[slot]);
+	pool[slot] = malloc(size);
+	memset(pool[slot], (int)i, size);
+	sum += pool[slot][size / 2];
+    }
+
+    for(i = 0; i < live; i++)
+	free(pool[i]);
+    free(pool);
+    printf("%ld\n", sum);
+    return 0;
+}
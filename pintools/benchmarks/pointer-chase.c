@@ -0,0 +1,48 @@
+/*
+ * Pointer chasing: follow a random cyclic permutation of nodes, so every
+ * load depends on the one before it and misses the cache. One read per
+ * step.
+ *
+ * Usage: pointer-chase [nodes] [steps]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+struct node
+{
+    struct node *next;
+    long pad[7];   /* a node per cache line */
+};
+
+int main(int argc, char *argv[])
+{
+    long nodes = argc > 1 ? atol(argv[1]) : 1 << 16;
+    long steps = argc > 2 ? atol(argv[2]) : 1 << 20;
+    struct node *list = malloc(nodes * sizeof(struct node));
+    long *order = malloc(nodes * sizeof(long));
+    struct node *p;
+    long i;
+
+    /* A random cycle through all the nodes */
+    for(i = 0; i < nodes; i++)
+	order[i] = i;
+    srand(1);
+    for(i = nodes - 1; i > 0; i--)
+    {
+	long j = rand() % (i + 1), t = order[i];
+
+	order[i] = order[j];
+	order[j] = t;
+    }
+    for(i = 0; i < nodes; i++)
+	list[order[i]].next = &list[order[(i + 1) % nodes]];
+
+    p = &list[order[0]];
+    for(i = 0; i < steps; i++)
+	p = p->next;
+
+    printf("%ld\n", (long)(p - list));
+    free(order);
+    free(list);
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * Call-heavy: a naive recursive Fibonacci. Measures the cost of the
+ * function entry and exit records rather than that of the memory
+ * accesses, which are almost all to the stack.
+ *
+ * Usage: recursion [n]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+struct frame
+{
+    long n;
+};
+
+static long fib(struct frame *f)
+{
+    struct frame a, b;
+
+    if(f->n < 2)
+	return f->n;
+    a.n = f->n - 1;
+    b.n = f->n - 2;
+    return fib(&a) + fib(&b);
+}
+
+int main(int argc, char *argv[])
+{
+    struct frame *f = malloc(sizeof(struct frame));
+    long r;
+
+    f->n = argc > 1 ? atol(argv[1]) : 25;
+    r = fib(f);
+    printf("%ld\n", r);
+    free(f);
+    return 0;
+}
@@ -0,0 +1,110 @@
+#!/bin/bash
+
+#
+# Measures the overhead of memtracker on the workloads in this directory.
+# For every workload and every output mode of memtracker it reports:
+#
+#   - the slowdown compared to the native run and to a run under Pin
+#     with a tool that does nothing (null.so), i.e. what memtracker
+#     itself adds,
+#   - the size of the trace per recorded memory access,
+#   - the allocations recorded per second.
+#
+# Usage: run-benchmarks.sh [workload ...]
+#
+# By default all the workloads are run. pin.sh must be in the PATH (or
+# set PIN), and memtracker.so and null.so must be built in
+# $CUSTOM_PINTOOLS_HOME/obj-intel64 (or set TOOLS). Build the workloads
+# with make first. Every change to the analysis routines of memtracker
+# that is meant to make it faster should be judged with this.
+#
+
+PIN=${PIN:-pin.sh}
+TOOLS=${TOOLS:-$CUSTOM_PINTOOLS_HOME/obj-intel64}
+HERE=$(cd $(dirname $0) && pwd)
+
+WORKLOADS=${@:-pointer-chase stream-sum malloc-loop false-sharing recursion}
+
+# The arguments of every workload, small enough to trace in seconds
+declare -A ARGS=(
+    [pointer-chase]="65536 262144"
+    [stream-sum]="262144 2"
+    [malloc-loop]="16384 1024"
+    [false-sharing]="4 65536"
+    [recursion]="18"
+)
+
+# The output modes: the name and the options of memtracker
+MODES=(
+    "text|-o trace"
+    "compressed|-o trace -z"
+    "packed|-b trace -o trace.txt"
+    "per-thread|-b trace -pt -o trace.txt"
+    "columnar|-c trace -o trace.txt"
+)
+
+if [ ! -f $TOOLS/memtracker.so ] || [ ! -f $TOOLS/null.so ]; then
+    echo "Can't find memtracker.so and null.so in $TOOLS. Please set TOOLS."
+    exit 1
+fi
+
+# Print the value of an arithmetic expression
+calc() {
+    awk "BEGIN { print $1 }"
+}
+
+# Run a command in the current directory, with its output discarded,
+# and print how long it took in seconds
+elapsed() {
+    local start=$(date +%s.%N)
+    "$@" > /dev/null 2>&1
+    local end=$(date +%s.%N)
+    calc "$end - $start"
+}
+
+WORK=$(mktemp -d)
+trap "rm -rf $WORK" EXIT
+
+cp $HERE/../scripts/alloc.in $WORK/alloc.in
+echo "*" > $WORK/memtracker.in
+cd $WORK
+
+printf "%-14s %-11s %9s %9s %9s %12s %12s\n" \
+    workload mode seconds "x native" "x null" "bytes/acc" "allocs/s"
+
+for w in $WORKLOADS; do
+    prog="$HERE/$w ${ARGS[$w]}"
+
+    native=$(elapsed $prog)
+    null=$(elapsed $PIN -t $TOOLS/null.so -- $prog)
+    printf "%-14s %-11s %9.2f %9s %9s %12s %12s\n" $w native $native - - - -
+    printf "%-14s %-11s %9.2f %9.1f %9s %12s %12s\n" $w null $null \
+	$(calc "$null / $native") - - -
+
+    accesses=0
+    allocs=0
+    for m in "${MODES[@]}"; do
+	mode=${m%%|*}
+	opts=${m#*|}
+
+	rm -f trace*
+	secs=$(elapsed $PIN -t $TOOLS/memtracker.so $opts -- $prog)
+
+	# The text trace tells us how many accesses and allocations
+	# there are; the other modes record the same ones.
+	if [ $mode == text ]; then
+	    accesses=$(grep -c -E '^(read|write): ' trace)
+	    allocs=$(grep -c '^alloc: ' trace)
+	fi
+
+	bytes=$(cat trace* | wc -c)
+	if [ $mode != text ] && [ $mode != compressed ]; then
+	    bytes=$(( bytes - $(wc -c < trace.txt) ))
+	fi
+
+	printf "%-14s %-11s %9.2f %9.1f %9.1f %12.1f %12.1f\n" $w $mode $secs \
+	    $(calc "$secs / $native") $(calc "$secs / $null") \
+	    $(calc "$bytes / ($accesses + ($accesses == 0))") \
+	    $(calc "$allocs / $secs")
+    done
+done
@@ -0,0 +1,27 @@
+/*
+ * Streaming: sum a large array over and over. Sequential reads that the
+ * hardware prefetcher handles well, one read per element.
+ *
+ * Usage: stream-sum [elements] [passes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[])
+{
+    long n = argc > 1 ? atol(argv[1]) : 1 << 20;
+    long passes = argc > 2 ? atol(argv[2]) : 4;
+    long *a = malloc(n * sizeof(long));
+    long sum = 0, i, p;
+
+    for(i = 0; i < n; i++)
+	a[i] = i;
+
+    for(p = 0; p < passes; p++)
+	for(i = 0; i < n; i++)
+	    sum += a[i];
+
+    printf("%ld\n", sum);
+    free(a);
+    return 0;
+}
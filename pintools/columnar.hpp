@@ -0,0 +1,483 @@
+/*
+ * A columnar format for the memory access records of the trace, for
+ * loading into analytics engines and for analyses that only need a few
+ * of the fields. It is written by memtracker (-c) and read by the tools
+ * in analysis-tools.
+ *
+ * The records are stored in row groups of up to ROWS_PER_GROUP rows.
+ * Within a row group every column is stored contiguously, as a column
+ * chunk, with an encoding chosen for that chunk:
+ *
+ *   ENC_VARINT  every value as a varint
+ *   ENC_DELTA   the difference from the previous value, as a zig-zag varint
+ *   ENC_RLE     (value, run length) pairs of varints
+ *
+ * The strings (access site, function and variable) are dictionary
+ * encoded: the column stores an ID, and the dictionaries are stored
+ * once, in the footer. The footer also has an index of the row groups,
+ * with the position and encoding of every column chunk and the range of
+ * addresses and thread IDs in the row group, so a reader can read just
+ * the columns it needs and skip the row groups it does not care about.
+ *
+ * File layout:
+ *
+ *   "MTCOL001"
+ *   row group 0: chunk of column 0, ..., chunk of column NUM_COLUMNS-1
+ *   ...
+ *   footer
+ *   footer length (8 bytes, little endian)
+ *   "MTCOL001"
+ *
+ * Footer (all integers are varints):
+ *
+ *   number of columns, column names
+ *   number of row groups, and for every row group:
+ *       number of rows, min address, max address, min tid, max tid,
+ *       encoding, offset and length of every column chunk
+ *   for the site, function and variable columns:
+ *       number of strings, strings
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "varint.hpp"
+
+#define COLUMNAR_MAGIC "MTCOL001"
+#define COLUMNAR_MAGIC_LEN 8
+
+enum column_t {
+    COL_ADDRESS,
+    COL_SIZE,
+    COL_TID,
+    COL_TYPE,      /* 0 for a read, 1 for a write */
+    COL_SITE,      /* source location of the access */
+    COL_FUNCTION,
+    COL_VARIABLE,  /* allocation site, name and type; empty if unknown */
+    NUM_COLUMNS
+};
+
+enum encoding_t {
+    ENC_VARINT,
+    ENC_DELTA,
+    ENC_RLE
+};
+
+inline const char *columnName(int column)
+{
+    static const char *names[NUM_COLUMNS] = {
+	"address", "size", "tid", "type", "site", "function", "variable"
+    };
+
+    return names[column];
+}
+
+inline bool isDictionaryColumn(int column)
+{
+    return column == COL_SITE || column == COL_FUNCTION || column == COL_VARIABLE;
+}
+
+class ColumnChunk
+{
+public:
+    int encoding;
+    uint64_t offset;
+    uint64_t length;
+};
+
+class RowGroupInfo
+{
+public:
+    uint64_t numRows;
+    uint64_t minAddress, maxAddress;
+    uint64_t minTid, maxTid;
+    ColumnChunk chunks[NUM_COLUMNS];
+
+    RowGroupInfo()
+	: numRows(0), minAddress(~(uint64_t)0), maxAddress(0),
+	  minTid(~(uint64_t)0), maxTid(0) {}
+};
+
+inline void encodeColumn(const std::vector<uint64_t> &values, int encoding,
+			 std::string &out)
+{
+    uint64_t prev = 0;
+
+    out.clear();
+    for(size_t i = 0; i < values.size(); i++)
+    {
+	switch(encoding)
+	{
+	case ENC_VARINT:
+	    putVarint(out, values[i]);
+	    break;
+	case ENC_DELTA:
+	    putVarint(out, zigzag((int64_t)(values[i] - prev)));
+	    prev = values[i];
+	    break;
+	case ENC_RLE:
+	{
+	    size_t run = 1;
+
+	    while(i + run < values.size() && values[i + run] == values[i])
+		run++;
+	    putVarint(out, values[i]);
+	    putVarint(out, run);
+	    i += run - 1;
+	    break;
+	}
+	}
+    }
+}
+
+/* Decode a column chunk of numRows values.
+ * Return false if the chunk is corrupt.
+ */
+inline bool decodeColumn(const uint8_t *p, const uint8_t *end, int encoding,
+			 uint64_t numRows, std::vector<uint64_t> &values)
+{
+    uint64_t value, prev = 0, run;
+
+    values.clear();
+    values.reserve(numRows);
+    while(values.size() < numRows)
+    {
+	if(!getVarint(p, end, value))
+	    return false;
+
+	switch(encoding)
+	{
+	case ENC_VARINT:
+	    values.push_back(value);
+	    break;
+	case ENC_DELTA:
+	    prev += (uint64_t)unzigzag(value);
+	    values.push_back(prev);
+	    break;
+	case ENC_RLE:
+	    if(!getVarint(p, end, run) || run == 0 || run > numRows - values.size())
+		return false;
+	    values.insert(values.end(), run, value);
+	    break;
+	default:
+	    return false;
+	}
+    }
+    return p == end;
+}
+
+/* Maps strings to IDs, in the order in which we first see them */
+class Dictionary
+{
+public:
+    std::vector<std::string> strings;
+
+    uint64_t id(const std::string &s)
+	{
+	    auto it = ids.find(s);
+
+	    if(it != ids.end())
+		return it->second;
+
+	    uint64_t newId = strings.size();
+	    ids[s] = newId;
+	    strings.push_back(s);
+	    return newId;
+	}
+
+private:
+    std::unordered_map<std::string, uint64_t> ids;
+};
+
+class ColumnarWriter
+{
+public:
+    enum { ROWS_PER_GROUP = 1 << 16 };
+
+    ColumnarWriter()
+	: f(NULL), offset(0), failed(false) {}
+
+    /* Return false if we could not create the file */
+    bool open(const char *fname)
+	{
+	    f = fopen(fname, "w");
+	    if(f == NULL)
+		return false;
+
+	    write(COLUMNAR_MAGIC, COLUMNAR_MAGIC_LEN);
+	    for(int c = 0; c < NUM_COLUMNS; c++)
+		columns[c].reserve(ROWS_PER_GROUP);
+	    return true;
+	}
+
+    void append(uint64_t address, uint64_t size, uint64_t tid, bool isWrite,
+		const std::string &site, const std::string &function,
+		const std::string &variable)
+	{
+	    columns[COL_ADDRESS].push_back(address);
+	    columns[COL_SIZE].push_back(size);
+	    columns[COL_TID].push_back(tid);
+	    columns[COL_TYPE].push_back(isWrite ? 1 : 0);
+	    columns[COL_SITE].push_back(dictionaries[COL_SITE].id(site));
+	    columns[COL_FUNCTION].push_back(dictionaries[COL_FUNCTION].id(function));
+	    columns[COL_VARIABLE].push_back(dictionaries[COL_VARIABLE].id(variable));
+
+	    if(columns[COL_ADDRESS].size() == ROWS_PER_GROUP)
+		flushRowGroup();
+	}
+
+    /* Write the last row group and the footer.
+     * Return false if any of the writes failed.
+     */
+    bool close()
+	{
+	    std::string footer;
+
+	    if(f == NULL)
+		return false;
+
+	    flushRowGroup();
+
+	    putVarint(footer, NUM_COLUMNS);
+	    for(int c = 0; c < NUM_COLUMNS; c++)
+		putString(footer, columnName(c));
+
+	    putVarint(footer, rowGroups.size());
+	    for(RowGroupInfo &rg: rowGroups)
+	    {
+		putVarint(footer, rg.numRows);
+		putVarint(footer, rg.minAddress);
+		putVarint(footer, rg.maxAddress);
+		putVarint(footer, rg.minTid);
+		putVarint(footer, rg.maxTid);
+		for(int c = 0; c < NUM_COLUMNS; c++)
+		{
+		    putVarint(footer, rg.chunks[c].encoding);
+		    putVarint(footer, rg.chunks[c].offset);
+		    putVarint(footer, rg.chunks[c].length);
+		}
+	    }
+
+	    for(int c = 0; c < NUM_COLUMNS; c++)
+	    {
+		if(!isDictionaryColumn(c))
+		    continue;
+		putVarint(footer, dictionaries[c].strings.size());
+		for(std::string &s: dictionaries[c].strings)
+		    putString(footer, s);
+	    }
+
+	    uint8_t length[8];
+	    for(int i = 0; i < 8; i++)
+		length[i] = (uint8_t)(footer.length() >> (8 * i));
+
+	    write(footer.data(), footer.length());
+	    write(length, sizeof(length));
+	    write(COLUMNAR_MAGIC, COLUMNAR_MAGIC_LEN);
+
+	    if(fclose(f) != 0)
+		failed = true;
+	    f = NULL;
+	    return !failed;
+	}
+
+private:
+    FILE *f;
+    uint64_t offset;
+    bool failed;
+    std::vector<uint64_t> columns[NUM_COLUMNS];
+    Dictionary dictionaries[NUM_COLUMNS];
+    std::vector<RowGroupInfo> rowGroups;
+
+    void write(const void *p, size_t len)
+	{
+	    if(fwrite(p, 1, len, f) != len)
+		failed = true;
+	    offset += len;
+	}
+
+    /* Encode every column of the row group with each of the encodings
+     * that suit it, and keep the shortest. Addresses are mostly close to
+     * the previous one, so we try delta encoding for them. Sizes, thread
+     * IDs, access types and sites come in runs, so we try RLE for those.
+     */
+    void flushRowGroup()
+	{
+	    RowGroupInfo rg;
+	    std::string chunk, alternative;
+
+	    rg.numRows = columns[COL_ADDRESS].size();
+	    if(rg.numRows == 0)
+		return;
+
+	    for(size_t i = 0; i < rg.numRows; i++)
+	    {
+		rg.minAddress = std::min(rg.minAddress, columns[COL_ADDRESS][i]);
+		rg.maxAddress = std::max(rg.maxAddress, columns[COL_ADDRESS][i]);
+		rg.minTid = std::min(rg.minTid, columns[COL_TID][i]);
+		rg.maxTid = std::max(rg.maxTid, columns[COL_TID][i]);
+	    }
+
+	    for(int c = 0; c < NUM_COLUMNS; c++)
+	    {
+		int encoding = ENC_VARINT;
+		int other = (c == COL_ADDRESS) ? ENC_DELTA : ENC_RLE;
+
+		encodeColumn(columns[c], encoding, chunk);
+		encodeColumn(columns[c], other, alternative);
+		if(alternative.length() < chunk.length())
+		{
+		    encoding = other;
+		    chunk.swap(alternative);
+		}
+
+		rg.chunks[c].encoding = encoding;
+		rg.chunks[c].offset = offset;
+		rg.chunks[c].length = chunk.length();
+		write(chunk.data(), chunk.length());
+		columns[c].clear();
+	    }
+
+	    rowGroups.push_back(rg);
+	}
+};
+
+class ColumnarReader
+{
+public:
+    std::vector<RowGroupInfo> rowGroups;
+    uint64_t numRows;
+
+    /* Bytes of column chunks we have read so far */
+    uint64_t bytesRead;
+
+    ColumnarReader()
+	: numRows(0), bytesRead(0), f(NULL) {}
+
+    ~ColumnarReader()
+	{
+	    if(f != NULL)
+		fclose(f);
+	}
+
+    /* Open the file and read the footer.
+     * Return false if this is not a valid columnar trace.
+     */
+    bool open(const char *fname)
+	{
+	    char magic[COLUMNAR_MAGIC_LEN];
+	    uint8_t length[8];
+	    uint64_t footerLength = 0;
+
+	    f = fopen(fname, "r");
+	    if(f == NULL)
+		return false;
+
+	    if(fread(magic, 1, COLUMNAR_MAGIC_LEN, f) != COLUMNAR_MAGIC_LEN
+	       || memcmp(magic, COLUMNAR_MAGIC, COLUMNAR_MAGIC_LEN) != 0)
+		return false;
+
+	    if(fseeko(f, -(off_t)(sizeof(length) + COLUMNAR_MAGIC_LEN), SEEK_END) != 0
+	       || fread(length, 1, sizeof(length), f) != sizeof(length)
+	       || fread(magic, 1, COLUMNAR_MAGIC_LEN, f) != COLUMNAR_MAGIC_LEN
+	       || memcmp(magic, COLUMNAR_MAGIC, COLUMNAR_MAGIC_LEN) != 0)
+		return false;
+
+	    for(int i = 0; i < 8; i++)
+		footerLength |= (uint64_t)length[i] << (8 * i);
+
+	    std::vector<uint8_t> footer(footerLength);
+	    if(fseeko(f, -(off_t)(footerLength + sizeof(length) + COLUMNAR_MAGIC_LEN),
+		      SEEK_END) != 0
+	       || fread(footer.data(), 1, footerLength, f) != footerLength)
+		return false;
+
+	    return parseFooter(footer.data(), footer.data() + footerLength);
+	}
+
+    /* The strings of a dictionary-encoded column, indexed by ID */
+    const std::vector<std::string> &dictionary(int column) const
+	{
+	    return dictionaries[column];
+	}
+
+    /* Read and decode one column chunk of a row group.
+     * Return false if we could not read it or it is corrupt.
+     */
+    bool readColumn(const RowGroupInfo &rg, int column, std::vector<uint64_t> &values)
+	{
+	    const ColumnChunk &chunk = rg.chunks[column];
+
+	    buf.resize(chunk.length);
+	    if(fseeko(f, chunk.offset, SEEK_SET) != 0
+	       || fread(buf.data(), 1, chunk.length, f) != chunk.length)
+		return false;
+	    bytesRead += chunk.length;
+
+	    return decodeColumn(buf.data(), buf.data() + chunk.length,
+				chunk.encoding, rg.numRows, values);
+	}
+
+private:
+    FILE *f;
+    std::vector<std::string> dictionaries[NUM_COLUMNS];
+    std::vector<uint8_t> buf;
+
+    bool parseFooter(const uint8_t *p, const uint8_t *end)
+	{
+	    uint64_t numColumns, numGroups, count, value;
+	    std::string name;
+
+	    if(!getVarint(p, end, numColumns) || numColumns != NUM_COLUMNS)
+		return false;
+	    for(int c = 0; c < NUM_COLUMNS; c++)
+		if(!getString(p, end, name) || name.compare(columnName(c)) != 0)
+		    return false;
+
+	    if(!getVarint(p, end, numGroups))
+		return false;
+	    for(uint64_t g = 0; g < numGroups; g++)
+	    {
+		RowGroupInfo rg;
+
+		if(!getVarint(p, end, rg.numRows)
+		   || !getVarint(p, end, rg.minAddress)
+		   || !getVarint(p, end, rg.maxAddress)
+		   || !getVarint(p, end, rg.minTid)
+		   || !getVarint(p, end, rg.maxTid))
+		    return false;
+
+		for(int c = 0; c < NUM_COLUMNS; c++)
+		{
+		    if(!getVarint(p, end, value)
+		       || !getVarint(p, end, rg.chunks[c].offset)
+		       || !getVarint(p, end, rg.chunks[c].length))
+			return false;
+		    rg.chunks[c].encoding = (int)value;
+		}
+
+		numRows += rg.numRows;
+		rowGroups.push_back(rg);
+	    }
+
+	    for(int c = 0; c < NUM_COLUMNS; c++)
+	    {
+		if(!isDictionaryColumn(c))
+		    continue;
+		if(!getVarint(p, end, count))
+		    return false;
+		dictionaries[c].resize(count);
+		for(uint64_t i = 0; i < count; i++)
+		    if(!getString(p, end, dictionaries[c][i]))
+			return false;
+	    }
+
+	    return p == end;
+	}
+};
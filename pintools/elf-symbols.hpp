@@ -0,0 +1,93 @@
+/*
+ * Looks up symbols in the symbol tables of an ELF file. Pin tells us
+ * where a symbol is, but not how large it is, and to watch the accesses
+ * to a global variable (memtracker -w) we need both. The sizes are in
+ * the st_size fields of the .symtab and .dynsym sections, so we read
+ * those sections, and their string tables, straight from the file.
+ */
+#pragma once
+
+#include <elf.h>
+#include <stdint.h>
+#include <string.h>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+class ElfSymbol
+{
+public:
+    uint64_t value;   /* the address, before relocation */
+    uint64_t size;
+};
+
+template <class Ehdr, class Shdr, class Sym>
+bool readElfSymbols(std::ifstream &f, const std::set<std::string> &names,
+		    std::map<std::string, ElfSymbol> &found)
+{
+    Ehdr eh;
+
+    f.seekg(0);
+    if(!f.read((char*)&eh, sizeof(eh)) || eh.e_shentsize != sizeof(Shdr))
+	return false;
+
+    std::vector<Shdr> sections(eh.e_shnum);
+    f.seekg(eh.e_shoff);
+    if(!f.read((char*)sections.data(), sections.size() * sizeof(Shdr)))
+	return false;
+
+    for(const Shdr &sh: sections)
+    {
+	if((sh.sh_type != SHT_SYMTAB && sh.sh_type != SHT_DYNSYM)
+	   || sh.sh_link >= sections.size() || sh.sh_entsize != sizeof(Sym))
+	    continue;
+
+	const Shdr &strSection = sections[sh.sh_link];
+	std::vector<Sym> syms(sh.sh_size / sizeof(Sym));
+	std::vector<char> strs(strSection.sh_size + 1);
+
+	f.seekg(sh.sh_offset);
+	if(!f.read((char*)syms.data(), syms.size() * sizeof(Sym)))
+	    return false;
+	f.seekg(strSection.sh_offset);
+	if(!f.read(strs.data(), strSection.sh_size))
+	    return false;
+
+	for(const Sym &sym: syms)
+	{
+	    /* Variables only */
+	    if(ELF64_ST_TYPE(sym.st_info) != STT_OBJECT
+	       || sym.st_shndx == SHN_UNDEF || sym.st_name >= strSection.sh_size)
+		continue;
+
+	    std::string name(&strs[sym.st_name]);
+	    if(names.count(name) && !found.count(name))
+	    {
+		found[name].value = sym.st_value;
+		found[name].size = sym.st_size;
+	    }
+	}
+    }
+    return true;
+}
+
+/* Look up the given variables in the file and add the ones we find to
+ * found. Return false if the file can't be read or isn't ELF.
+ */
+inline bool findElfSymbols(const std::string &fname, const std::set<std::string> &names,
+			   std::map<std::string, ElfSymbol> &found)
+{
+    std::ifstream f(fname.c_str(), std::ios::binary);
+    unsigned char ident[EI_NIDENT];
+
+    if(!f.read((char*)ident, EI_NIDENT) || memcmp(ident, ELFMAG, SELFMAG) != 0)
+	return false;
+
+    if(ident[EI_CLASS] == ELFCLASS64)
+	return readElfSymbols<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym>(f, names, found);
+    if(ident[EI_CLASS] == ELFCLASS32)
+	return readElfSymbols<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym>(f, names, found);
+    return false;
+}
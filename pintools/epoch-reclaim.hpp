@@ -0,0 +1,117 @@
+/*
+ * Epoch-based reclamation, so that memtracker can publish read-only
+ * snapshots of its data structures to the threads recording accesses,
+ * and free the old snapshots once no thread can be looking at them.
+ *
+ * A reader enters the domain before loading the pointer to a snapshot,
+ * and exits it when it is done with the snapshot. Entering is a store
+ * of the current epoch to the reader's own slot and a fence, so readers
+ * never wait for anybody. The writer, after replacing a snapshot, retires
+ * the old one and advances the epoch. A retired snapshot is freed when
+ * every reader still inside the domain entered after it was retired.
+ *
+ * There is one writer at a time (memtracker retires snapshots with its
+ * lock held). Threads with IDs beyond EPOCH_MAX_THREADS have no slot:
+ * enter() fails for them, and they have to take the locked path.
+ */
+#pragma once
+
+#include <vector>
+
+#include "pin.H"
+
+#define EPOCH_MAX_THREADS 256
+
+class EpochDomain
+{
+public:
+    EpochDomain()
+	: epoch(1)
+	{
+	    for(int i = 0; i < EPOCH_MAX_THREADS; i++)
+		readers[i].epoch = 0;
+	}
+
+    bool enter(THREADID tid)
+	{
+	    if(tid >= EPOCH_MAX_THREADS)
+		return false;
+	    readers[tid].epoch = epoch;
+	    __sync_synchronize();
+	    return true;
+	}
+
+    void exit(THREADID tid)
+	{
+	    __sync_synchronize();
+	    readers[tid].epoch = 0;
+	}
+
+    /* Free old with delete once no reader can hold it. The new
+     * snapshot must already be published.
+     */
+    template <class T>
+    void retire(T *old)
+	{
+	    Retired r;
+
+	    r.epoch = epoch;
+	    r.object = old;
+	    r.destroy = &destroy<T>;
+	    retired.push_back(r);
+
+	    __sync_synchronize();
+	    epoch++;
+	    __sync_synchronize();
+	    reclaim();
+	}
+
+    /* Free what the readers are done with */
+    void reclaim()
+	{
+	    UINT64 oldest = epoch;
+
+	    for(int i = 0; i < EPOCH_MAX_THREADS; i++)
+	    {
+		UINT64 e = readers[i].epoch;
+
+		if(e != 0 && e < oldest)
+		    oldest = e;
+	    }
+
+	    size_t kept = 0;
+	    for(size_t i = 0; i < retired.size(); i++)
+	    {
+		if(retired[i].epoch < oldest)
+		    retired[i].destroy(retired[i].object);
+		else
+		    retired[kept++] = retired[i];
+	    }
+	    retired.resize(kept);
+	}
+
+private:
+    class Reader
+    {
+    public:
+	volatile UINT64 epoch;   /* zero when outside */
+    } __attribute__((aligned(64)));
+
+    class Retired
+    {
+    public:
+	UINT64 epoch;
+	void *object;
+	void (*destroy)(void *);
+    };
+
+    template <class T>
+    static void destroy(void *object)
+	{
+	    delete (T*)object;
+	}
+
+    volatile UINT64 epoch;
+    Reader readers[EPOCH_MAX_THREADS];
+    std::vector<Retired> retired;
+};
@@ -1,6 +1,6 @@
 ##!/bin/sh
 
-declare -a packages=("libelf-dev" "libdwarf-dev")
+declare -a packages=("libelf-dev" "libdwarf-dev" "zlib1g-dev")
 
 for p in "${packages[@]}"
 do
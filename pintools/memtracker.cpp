@@ -30,7 +30,11 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 END_LEGAL */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -40,12 +44,24 @@ END_LEGAL */
 #include <stdio.h>
 #include <sstream> 
 #include <map>
+#include <set>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
 #include <utility>
 #include <unistd.h>
 #include <sys/syscall.h>
 #include "pin.H"
 
 #include "varinfo.hpp"
+#include "columnar.hpp"
+#include "elf-symbols.hpp"
+#include "epoch-reclaim.hpp"
+#include "packed-trace.hpp"
+#include "self-profile.hpp"
+#include "shadow-map.hpp"
+#include "trace-index.hpp"
+#include "trace-writer.hpp"
 
 /* ===================================================================== */
 /* Global Variables */
@@ -116,6 +132,8 @@ Stack processStack(0, 0, 0);
 Stack **threadStacks = NULL;
 size_t threadStacksSize = 0;
 
+Stack* get_stack_containing(pid_t pid, pid_t tid, ADDRINT sp);
+
 // End stack-related definitions
 
 /* In this map we keep the paths to Image build locations
@@ -167,6 +185,84 @@ KNOB<bool> KnobTrackStackAccesses(KNOB_MODE_WRITEONCE, "pintool",
 				  "s", "false", "Include stack memory accesses into the "
 				  "trace. Default is false. ");
 
+KNOB<string> KnobSelectionFile(KNOB_MODE_WRITEONCE, "pintool",
+			       "sel", "", "Only record the accesses to the allocations "
+			       "selected in this file, by allocation site, variable "
+			       "or type (see below for format). Default: record "
+			       "all accesses.");
+
+KNOB<string> KnobWatchFile(KNOB_MODE_WRITEONCE, "pintool",
+			   "w", "", "Only record the accesses to the global "
+			   "variables and address ranges listed in this file "
+			   "(see below for format). Default: record all accesses.");
+
+KNOB<string> KnobColumnarFile(KNOB_MODE_WRITEONCE, "pintool",
+			      "c", "", "Write the memory access records to this file "
+			      "in the columnar format (see columnar.hpp) instead "
+			      "of printing them. Other records are still printed.");
+
+KNOB<string> KnobHeapSnapshot(KNOB_MODE_WRITEONCE, "pintool",
+			      "heap", "", "When attaching to a running process, "
+			      "read the allocations that are live at the time "
+			      "of attach from this file (see below for format). "
+			      "Default: none.");
+
+KNOB<string> KnobPackedFile(KNOB_MODE_WRITEONCE, "pintool",
+			    "b", "", "Write the memory access records to this file "
+			    "in the packed binary format (see packed-trace.hpp) "
+			    "instead of printing them. Other records are still "
+			    "printed.");
+
+KNOB<string> KnobHeatmapFile(KNOB_MODE_WRITEONCE, "pintool",
+			     "heat", "", "Instead of recording the memory accesses, "
+			     "count the reads and writes of every field of every "
+			     "type, and the fields accessed together, and write "
+			     "them to this file at exit (see below). Default: no.");
+
+KNOB<UINT32> KnobHeatmapWindow(KNOB_MODE_WRITEONCE, "pintool",
+			       "heatw", "8", "With -heat, count two fields of an "
+			       "object as accessed together if a thread accesses "
+			       "them within this many accesses. Default is 8.");
+
+#ifdef MEMTRACKER_PROFILE
+KNOB<UINT32> KnobProfileInterval(KNOB_MODE_WRITEONCE, "pintool",
+				 "profi", "0", "Print the self-profile every this "
+				 "many million recorded accesses. Default: only at exit.");
+#endif
+
+KNOB<string> KnobControlPipe(KNOB_MODE_WRITEONCE, "pintool",
+			     "ctl", "", "Read commands to start and stop "
+			     "recording, rotate the trace and print statistics "
+			     "from this named pipe (see below). Default: none.");
+
+KNOB<bool> KnobStartIdle(KNOB_MODE_WRITEONCE, "pintool",
+			 "idle", "false", "With -ctl, don't record memory "
+			 "accesses until told to start. Default is false.");
+
+KNOB<bool> KnobPerThreadFiles(KNOB_MODE_WRITEONCE, "pintool",
+				"pt", "false", "With -b, write the accesses of every "
+				"thread to its own packed trace, <file>.<tid>, "
+				"without any lock. memtracker-merge merges them. "
+				"Default is false.");
+
+KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
+			    "o", "", "Write the trace to this file instead of "
+			    "stdout.");
+
+KNOB<bool> KnobCompressTrace(KNOB_MODE_WRITEONCE, "pintool",
+			     "z", "false", "Compress the trace written with -o "
+			     "in independent zlib frames. Default is false.");
+
+KNOB<int> KnobCompressionThreads(KNOB_MODE_WRITEONCE, "pintool",
+				 "zt", "2", "Number of internal threads "
+				 "compressing the trace. Default is 2.");
+
+KNOB<bool> KnobIndexTrace(KNOB_MODE_WRITEONCE, "pintool",
+			  "i", "false", "Write an index of the trace to <file>.idx, "
+			  "so the analysis tools can seek in it (see trace-index.hpp). "
+			  "Indexes the packed trace if there is one (-b), otherwise "
+			  "the trace written with -o. Default is false.");
+
 
 
 
@@ -224,16 +320,243 @@ public:
     size_t base;
     size_t item_size;
     size_t item_number;
+    bool selected;
+    UINT32 id;   /* the same for allocations described the same way */
 
     AllocRecord(string file, int line, 
 		string varname, string vartype, VarInfo *v,
 		size_t base_addr, size_t size, size_t number):
 	sourceFile(file), sourceLine(line), varName(varname), 
-	varType(vartype), vi(v), base(base_addr), item_size(size), item_number(number) {};
+	varType(vartype), vi(v), base(base_addr), item_size(size), item_number(number),
+	selected(false), id(0) {};
 };
 
 map<MemoryRange, AllocRecord> allocmap;
 
+/* Allocations are rare and lookups are not, so the threads recording
+ * accesses look the allocations up in a read-only copy of allocmap,
+ * published through allocSnapshot, without taking the lock. Writers
+ * change allocmap with the lock held, as before, and publish a new
+ * copy once enough has changed; allocEpochs frees the old copies.
+ *
+ * allocVersion counts the changes to allocmap and allocErases the
+ * allocations replaced in it. A copy is up to date if its version is
+ * the current one; otherwise the allocations found in it are still
+ * good as long as none was replaced, but an address not found in it
+ * may be in a newer allocation, and the reader has to look in allocmap.
+ */
+#define ALLOC_PUBLISH_BATCH 64
+#define ALLOC_PUBLISH_RATIO 8
+
+class AllocSnapshot
+{
+public:
+    vector<MemoryRange> ranges;   /* sorted, like the keys of allocmap */
+    vector<AllocRecord> records;
+    UINT64 version;
+    UINT64 erases;
+
+    /* The index of the allocation overlapping [addr, addr + size), as
+     * allocmap.find would find it, or -1.
+     */
+    long find(ADDRINT addr, UINT32 size) const
+	{
+	    MemoryRange mr(addr, size);
+	    vector<MemoryRange>::const_iterator it =
+		lower_bound(ranges.begin(), ranges.end(), mr);
+
+	    if(it == ranges.end() || mr < *it)
+		return -1;
+	    return it - ranges.begin();
+	}
+};
+
+AllocSnapshot * volatile allocSnapshot = NULL;
+EpochDomain allocEpochs;
+volatile UINT64 allocVersion = 0;
+volatile UINT64 allocErases = 0;
+
+/* Changes not yet published, and lookups that had to go to allocmap
+ * since the last publication. Protected by the lock.
+ */
+UINT64 allocUnpublished = 0;
+UINT64 allocMisses = 0;
+
+/* The ids of the descriptions of the allocations */
+map<string, UINT32> allocIds;
+
+/* Publish a copy of allocmap. Must be called with the lock held. */
+VOID publishAllocations()
+{
+    AllocSnapshot *s = new AllocSnapshot();
+    AllocSnapshot *old = allocSnapshot;
+
+    s->ranges.reserve(allocmap.size());
+    s->records.reserve(allocmap.size());
+    for(map<MemoryRange, AllocRecord>::iterator it = allocmap.begin();
+	it != allocmap.end(); it++)
+    {
+	s->ranges.push_back(it->first);
+	s->records.push_back(it->second);
+    }
+    s->version = allocVersion;
+    s->erases = allocErases;
+
+    allocSnapshot = s;
+    allocUnpublished = 0;
+    allocMisses = 0;
+    if(old)
+	allocEpochs.retire(old);
+}
+
+/* Copying allocmap costs in proportion to its size, so the more
+ * allocations there are, the more changes we let accumulate.
+ */
+bool allocPublishDue(UINT64 count)
+{
+    return count >= ALLOC_PUBLISH_BATCH + allocmap.size() / ALLOC_PUBLISH_RATIO;
+}
+
+/* Record a change to allocmap, and publish it if it's time. Must be
+ * called with the lock held, after the change.
+ */
+VOID allocmapChanged(bool erased)
+{
+    if(erased)
+	allocErases++;
+    allocVersion++;
+    if(allocPublishDue(++allocUnpublished))
+	publishAllocations();
+}
+
+/* A lookup couldn't do with the published allocations and had to go to
+ * allocmap. If that keeps happening, publish them again. Must be called
+ * with the lock held.
+ */
+VOID noteAllocMiss()
+{
+    if(allocSnapshot->version != allocVersion && allocPublishDue(++allocMisses))
+	publishAllocations();
+}
+
+/* Give the allocation the id of its description */
+VOID assignAllocId(AllocRecord &ar)
+{
+    string key = ar.sourceFile + ":" + to_string(ar.sourceLine) + " "
+	+ ar.varName + " " + ar.varType;
+    map<string, UINT32>::iterator it = allocIds.find(key);
+
+    if(it == allocIds.end())
+	it = allocIds.insert(make_pair(key, (UINT32)allocIds.size())).first;
+    ar.id = it->second;
+}
+
+/* When Pin attaches to a running process (pin -pid), main() was called
+ * long ago and the allocations made so far were never seen. We keep the
+ * heap and the anonymous mappings that existed at the time of attach in
+ * preAttachMemory, and attribute the accesses to them that don't belong
+ * to a known allocation to a "pre-attach" allocation of the mapping.
+ */
+bool attached = false;
+map<MemoryRange, string> preAttachMemory;
+
+void get_pre_attach_memory(pid_t pid);
+
+/* The allocations the user wants to see the accesses to (-sel), by
+ * allocation site ("site <file>:<line>" or "site <file>"), variable
+ * ("var <name>") or type ("type <name>"). A name ending with a '*'
+ * matches any name beginning with what comes before it.
+ */
+class AllocSelection
+{
+public:
+    vector<string> sites, vars, types;
+
+    bool selects(const string &file, int line, const string &var,
+		 const string &type) const
+	{
+	    string fileLine = file + ":" + to_string(line);
+
+	    for(const string &site: sites)
+	    {
+		if(endsWith(fileLine, site) || endsWith(file, site))
+		    return true;
+	    }
+	    for(const string &v: vars)
+	    {
+		if(matches(var, v))
+		    return true;
+	    }
+	    for(const string &t: types)
+	    {
+		if(matches(type, t))
+		    return true;
+	    }
+	    return false;
+	}
+
+private:
+    /* The site may be given without the directories of the file */
+    static bool endsWith(const string &path, const string &site)
+	{
+	    return path.length() >= site.length()
+		&& path.compare(path.length() - site.length(), site.length(), site) == 0
+		&& (path.length() == site.length()
+		    || path[path.length() - site.length() - 1] == '/');
+	}
+
+    static bool matches(const string &name, const string &pattern)
+	{
+	    if(pattern.length() > 0 && pattern[pattern.length() - 1] == '*')
+		return name.compare(0, pattern.length() - 1, pattern, 0,
+				    pattern.length() - 1) == 0;
+	    return name.compare(pattern) == 0;
+	}
+};
+
+/* With -sel, the lines of the selected allocations are marked here,
+ * and only the accesses to marked lines make it to recordMemoryAccess.
+ */
+AllocSelection *allocSelection = NULL;
+ShadowBitmap *selectedLines = NULL;
+
+/* The memory the user wants to watch (-w): global variables, by the
+ * name of their symbol, and address ranges. The symbols are looked up
+ * in every image that is loaded, until they are found.
+ */
+class WatchList
+{
+public:
+    set<string> symbols;	   /* not found yet */
+    map<ADDRINT, ADDRINT> ranges;  /* base -> end, not overlapping */
+
+    bool contains(ADDRINT addr) const
+	{
+	    map<ADDRINT, ADDRINT>::const_iterator it = ranges.upper_bound(addr);
+
+	    if(it == ranges.begin())
+		return false;
+	    --it;
+	    return addr < it->second;
+	}
+};
+
+/* Up to this many watched ranges are tested inline, one comparison
+ * each. With more, the lines of the ranges are marked in watchedLines.
+ */
+#define WATCH_INLINE_RANGES 4
+
+WatchList *watchList = NULL;
+ADDRINT watchBase[WATCH_INLINE_RANGES];
+ADDRINT watchSize[WATCH_INLINE_RANGES];
+int watchSlots = 0;
+ShadowBitmap *watchedLines = NULL;
+
+/* The If routine in front of recordMemoryAccess, or NULL to record
+ * every access.
+ */
+AFUNPTR accessFilter = NULL;
+
 vector<string> TrackedFuncsList;
 vector<string> AllocFuncsList;
 
@@ -313,6 +636,94 @@ typedef enum {
 
 vector<intracked_flag_t> inTracked;
 
+/* The columnar output, if the user asked for it */
+ColumnarWriter *columnarTrace = NULL;
+
+/* The packed output, if the user asked for it. Every thread collects
+ * its accesses in its own buffer, and encodes and writes them out as
+ * a block when the buffer fills up. packedLock protects the file.
+ *
+ * Every EPOCH_TICKS of the time stamp counter, the thread writing a block
+ * also writes an epoch marker, with the timestamp of the oldest access
+ * still sitting in any of the buffers as the watermark.
+ *
+ * With per-thread files, every thread writes its blocks to its own file
+ * instead, and needs no lock to do it. The definitions of the sites and
+ * variables are then kept in packedSiteDefs and packedVariableDefs, and a
+ * thread copies a definition to its file before the first block using it.
+ */
+#define PACKED_BLOCK_ACCESSES 4096
+#define EPOCH_TICKS (1 << 22)
+
+class PackedThreadBuffer
+{
+public:
+    vector<PackedAccess> accesses;
+    PackedEncoder encoder;
+    string block;
+
+    /* No access in the buffer is older than this. Zero if the buffer is
+     * empty. Written by the thread, read by whoever writes the marker.
+     */
+    volatile UINT64 pending;
+
+    /* With per-thread files */
+    FILE *file;
+    string defs;  /* to be written before the next block */
+    vector<bool> sitesDefined, variablesDefined;
+
+    /* The ids of the sites and variables the thread has used, so that
+     * it needs no lock to use them again, and the number of accesses it
+     * recorded without the lock.
+     */
+    map<ADDRINT, uint32_t> sites;
+    unordered_map<string, uint32_t> variables;
+    volatile UINT64 recorded;
+
+    PackedThreadBuffer()
+	: pending(0), file(NULL), recorded(0) {}
+};
+
+bool packedOutput = false;
+FILE *packedTrace = NULL;
+PIN_LOCK packedLock;
+/* A slot for every possible thread, made in main() so that the vector
+ * is never reallocated under the threads indexing it. A slot is NULL
+ * until its thread starts. */
+vector<PackedThreadBuffer*> packedBuffers;
+map<ADDRINT, uint32_t> packedSites;
+Dictionary packedVariables;
+bool packedPerThread = false;
+vector<string> packedSiteDefs, packedVariableDefs;
+
+/* Whether memory accesses are being recorded. Turned on and off through
+ * the control pipe (-ctl), which is read by controlThread. While
+ * recording is off, the memory accesses are not instrumented at all.
+ * recordedAccesses and rotations are protected by the lock.
+ */
+#define CONTROL_POLL_MS 100
+
+volatile bool recordingOn = true;
+volatile bool controlDone = false;
+int controlPipe = -1;
+PIN_THREAD_UID controlThreadUid;
+UINT64 recordedAccesses = 0;
+int rotations = 0;
+
+/* Where cout goes if the user asked for an output file */
+ofstream traceFile;
+FramedTraceBuf *framedTrace = NULL;
+
+/* The index of the trace, if the user asked for it. For a packed
+ * trace we keep track of where the next block goes, under packedLock.
+ */
+TraceIndexWriter *traceIndex = NULL;
+uint64_t packedOffset = PACKED_MAGIC_LEN;
+uint64_t packedRecords = 0;
+vector<uint64_t> packedThreadRecords;
+UINT64 lastEpoch = 0;
+UINT64 traceStartTime = 0;
+
 
 /* ===================================================================== */
 /* Helper routines                                                       */
@@ -983,7 +1394,12 @@ VOID callAfterAlloc(FuncRecord *fr, THREADID tid, ADDRINT addr)
 	return;
     }
 
-    assert((*fr->thrAllocData)[tid]->calledFromAddr != 0);
+    /* We did not see the call to this function. This happens when we
+     * attach to a thread that is already inside an alloc function, so
+     * we get the exit without the enter. Don't do anything.
+     */
+    if((*fr->thrAllocData)[tid]->calledFromAddr == 0)
+	return;
 
     if((*fr->thrAllocData)[tid]->retptr == 0)
     {
@@ -1001,24 +1417,30 @@ VOID callAfterAlloc(FuncRecord *fr, THREADID tid, ADDRINT addr)
 		      KnobAppPtrSize/BITS_PER_BYTE);
     }
     
-    PIN_GetLock(&lock, PIN_ThreadId() + 1);
+    PROFILE_GET_LOCK(&lock, PIN_ThreadId() + 1);
     {
 	INT32 column = 0, line = 0;
 	string filename; 
 	string varname, vartype;
 
 	/* Let's get the source file and line */
-	PIN_LockClient();
-	PIN_GetSourceLocation((*fr->thrAllocData)[tid]->calledFromAddr, 
-			      &column, &line, &filename);
+	{
+	    PROFILE_PHASE(PHASE_SOURCE_LOCATION);
+	    PIN_LockClient();
+	    PIN_GetSourceLocation((*fr->thrAllocData)[tid]->calledFromAddr, 
+				  &column, &line, &filename);
 	
-	PIN_UnlockClient();
+	    PIN_UnlockClient();
+	}
 
 	if(filename.length() > 0 && line > 0)
 	{
-	    varname = 
-		findAllocVarName(filename, line, fr->name, fr->retaddr,
-				 *(fr->otherFuncProto));
+	    {
+		PROFILE_PHASE(PHASE_ALLOC_VAR_NAME);
+		varname = 
+		    findAllocVarName(filename, line, fr->name, fr->retaddr,
+				     *(fr->otherFuncProto));
+	    }
 
 	    /* Let's find the variable type */
 	    if(varname.length() > 0 && fr->vi)
@@ -1038,8 +1460,15 @@ VOID callAfterAlloc(FuncRecord *fr, THREADID tid, ADDRINT addr)
 
 	  map<MemoryRange, AllocRecord>::iterator it =
 	    allocmap.find(*mr);
+	  bool replaced = it != allocmap.end();
 	  
-	  if(it != allocmap.end())
+	  if(allocSelection && allocSelection->selects(filename, line, varname, vartype))
+	  {
+	      ar->selected = true;
+	      selectedLines->mark(base, size);
+	  }
+
+	  if(replaced)
 	  {
 	      /* If we found an allocation in the same range as the
 	       * new one, chances are someone has freed that allocation.
@@ -1051,8 +1480,9 @@ VOID callAfterAlloc(FuncRecord *fr, THREADID tid, ADDRINT addr)
 	      allocmap.erase(it);
 	  }
 
+	  assignAllocId(*ar);
 	  allocmap.insert(make_pair(*mr, *ar));
-	
+	  allocmapChanged(replaced);
 	}
 	
 	cout << "alloc: " << tid 
@@ -1084,7 +1514,7 @@ VOID callBeforeAfterFunction(VOID *rtnAddr, func_event_t eventType)
     if(!go)
 	return;
 
-    PIN_GetLock(&lock, PIN_ThreadId() + 1);
+    PROFILE_GET_LOCK(&lock, PIN_ThreadId() + 1);
 
     {
 	string name = RTN_FindNameByAddress((ADDRINT)rtnAddr);
@@ -1118,201 +1548,981 @@ VOID callBeforeAfterFunction(VOID *rtnAddr, func_event_t eventType)
     PIN_ReleaseLock(&lock);
 }
 
-VOID recordMemoryAccess(ADDRINT addr, UINT32 size, ADDRINT codeAddr, 
-		       VOID *rtnAddr, VOID *accessType)
+/* The source file and line of the instruction at codeAddr */
+string sourceLocation(ADDRINT codeAddr)
 {
+    string filename;
+    INT32 column = 0, line = 0;
 
-    /* Don't track until we hit main() */
-    if(!go)
-	return;
+    PROFILE_PHASE(PHASE_SOURCE_LOCATION);
+    PIN_LockClient();
+    PIN_GetSourceLocation(codeAddr, &column, &line, &filename);
+    PIN_UnlockClient();
 
-    if(inTracked[PIN_ThreadId()] == NO)
+    if(filename.length() > 0)
+	return filename + ":" + to_string(line);
+    return "<unknown>";
+}
+
+/* The "pre-attach" allocation of a mapping that existed when we
+ * attached, for the accesses to it outside of any known allocation.
+ */
+bool preAttachVariable(ADDRINT addr, string &var)
+{
+    if(preAttachMemory.empty())
+	return false;
+
+    map<MemoryRange, string>::iterator it = preAttachMemory.find(MemoryRange(addr, 1));
+    if(it == preAttachMemory.end())
+	return false;
+
+    var = "pre-attach:0 " + it->second + " ";
+    return true;
+}
+
+/* The descriptions of the variables a thread has found, by the id of
+ * the allocation and the offset into it, so that next time it can find
+ * them without the lock. Only the thread itself uses its cache.
+ */
+#define FIELD_CACHE_ENTRIES 65536
+
+unordered_map<UINT64, string> *fieldCaches[EPOCH_MAX_THREADS];
+
+VOID cacheVariable(UINT32 id, size_t offset, const string &var)
+{
+    THREADID tid = PIN_ThreadId();
+
+    if(tid >= EPOCH_MAX_THREADS || offset >> 32 != 0)
 	return;
+    if(!fieldCaches[tid])
+	fieldCaches[tid] = new unordered_map<UINT64, string>();
+    if(fieldCaches[tid]->size() >= FIELD_CACHE_ENTRIES)
+	fieldCaches[tid]->clear();
+    (*fieldCaches[tid])[(UINT64)id << 32 | offset] = var;
+}
 
-    if(!KnobTrackStackAccesses)
+/* Find the allocation that the access at addr falls into, and describe
+ * the variable as "<alloc source>:<line> <name>[-><field>] <type>".
+ * Return false if the address is not in any allocation we know of
+ * (or, after attaching, a mapping that existed before), or, with -sel,
+ * in any of the selected allocations.
+ * Must be called with the lock held.
+ */
+bool findVariable(ADDRINT addr, UINT32 size, string &var)
+{
+    /* Let's retrieve the allocation information for this access */
+    MemoryRange mr(addr, size);
+    map<MemoryRange, AllocRecord>::iterator it;
+
+    noteAllocMiss();
     {
-	if(processStack.contains((size_t)addr))
-	    return;
+	PROFILE_PHASE(PHASE_ALLOCMAP_FIND);
+	it = allocmap.find(mr);
+    }
 
-	if(!threadStacks[PIN_ThreadId()])
-	{
-	    cerr << "Warning: null stack for thread " << PIN_ThreadId() << endl;
-	}
-	else if(threadStacks[PIN_ThreadId()]->contains((size_t)addr))
-	    return;
+    if(it == allocmap.end())
+	return !allocSelection && preAttachVariable(addr, var);
+    if(allocSelection && !it->second.selected)
+	return false;
+
+    /* We found the allocation record corresponding to that memory access.
+     * If it is a part of a larger structure, let's find out the field name.
+     * Need to retrieve the offset into the data structure. If this allocation
+     * contains multiple items (e.g., calloc-type), need to take the modulo
+     * of the item size.
+     */
+
+    if(!it->first.contains(addr))
+    {
+	cout << "WARNING!!! " << hex << addr <<"+" << size 
+	     << " is not contained in (" << 
+	    it->first.base << ", " << (it->first.base + it->first.size) << ")"
+	     << dec << endl;
+
+	cerr << "WARNING!!! " << hex << addr <<"+" << size 
+	     << " is not contained in (" << 
+	    it->first.base << ", " << (it->first.base + it->first.size) << ")"
+	     << dec << endl;
 
     }
+
+    string field = "";
+    size_t offset = (addr - it->first.base) % it->second.item_size;
     
-    PIN_GetLock(&lock, PIN_ThreadId()+1);
+    if(offset >= 0 && it->second.vi)
     {
-	string filename;
-	INT32 column = 0, line = 0;
-	string source = "<unknown>";
+	PROFILE_PHASE(PHASE_FIELD_NAME);
+	field = it->second.vi->fieldname(it->second.sourceFile, 
+					 it->second.sourceLine, 
+					 it->second.varName, offset);
+    }
 
-	string name = RTN_FindNameByAddress((ADDRINT)rtnAddr);
-    
-	PIN_LockClient();
-	PIN_GetSourceLocation(codeAddr, &column, &line, &filename);
-	PIN_UnlockClient();
-   
-	if(filename.length() > 0)
-	{
-	    source = filename + ":" + to_string(line);
-	}
+    if(field.length() == 0)
+	cout << "Could not determine field for the following access type. "
+	     << "Allocation base was " << hex << it->second.base 
+	     << " Size " << dec << it->second.item_size << ", number " 
+	     << it->second.item_number << ". Offset provided was " << offset << endl;
+
+    var = it->second.sourceFile + ":" + to_string(it->second.sourceLine)
+	+ " " + it->second.varName;
+    if(field.length() > 0)
+	var += "->" + field;
+    var += " " + it->second.varType;
+
+    if(field.length() > 0)
+	cacheVariable(it->second.id, offset, var);
+    return true;
+}
 
-	/* Let's retrieve the allocation information for this access */
-	MemoryRange mr(addr, size);
-	map<MemoryRange, AllocRecord>::iterator it = allocmap.find(mr);
+/* Find the variable of the access like findVariable, in the published
+ * allocations and the thread's cache, without taking the lock. Return
+ * false if that's not enough: the address may be in an allocation that
+ * isn't published yet, or the thread hasn't seen the field before.
+ * Otherwise set found, and var, to what findVariable would return.
+ */
+bool findPublishedVariable(ADDRINT addr, UINT32 size, string &var, bool &found)
+{
+    THREADID tid = PIN_ThreadId();
+    bool known = false;
 
-	if(it != allocmap.end())
+    if(!allocEpochs.enter(tid))
+	return false;
+    {
+	const AllocSnapshot *s = allocSnapshot;
+	long i;
 	{
-	    /* We found the allocation record corresponding to that memory access.
-	     * If it is a part of a larger structure, let's find out the field name.
-	     * Need to retrieve the offset into the data structure. If this allocation
-	     * contains multiple items (e.g., calloc-type), need to take the modulo
-	     * of the item size.
-	     */
+	    PROFILE_PHASE(PHASE_ALLOCMAP_FIND);
+	    i = s->find(addr, size);
+	}
 
-	    if(!it->first.contains(addr))
+	if(i < 0)
+	{
+	    if(s->version == allocVersion)
 	    {
-		cout << "WARNING!!! " << hex << addr <<"+" << size 
-		     << " is not contained in (" << 
-		    it->first.base << ", " << (it->first.base + it->first.size) << ")"
-		     << dec << endl;
-
-		cerr << "WARNING!!! " << hex << addr <<"+" << size 
-		     << " is not contained in (" << 
-		    it->first.base << ", " << (it->first.base + it->first.size) << ")"
-		     << dec << endl;
-
+		found = !allocSelection && preAttachVariable(addr, var);
+		known = true;
 	    }
-
-	    string field = "";
-	    size_t offset = (addr - it->first.base) % it->second.item_size;
-	    
-	    if(offset >= 0 && it->second.vi)
-		field = it->second.vi->fieldname(it->second.sourceFile, 
-						 it->second.sourceLine, 
-						 it->second.varName, offset);
-
-	    if(field.length() == 0)
-		cout << "Could not determine field for the following access type. "
-		     << "Allocation base was " << hex << it->second.base 
-		     << " Size " << dec << it->second.item_size << ", number " 
-		     << it->second.item_number << ". Offset provided was " << offset << endl;
-	    
-	    cout << (char*)accessType << " " << PIN_ThreadId() << " 0x" << hex << setw(16) 
-		 << setfill('0') << addr << dec << " " << size << " " 
-		 << name << " " << source << " " << it->second.sourceFile
-		 << ":" << it->second.sourceLine << " " << it->second.varName;
-
-	    if(field.length() > 0)
-		cout << "->" << field;
- 
-	    cout << " " << it->second.varType << endl;
 	}
-	else
+	else if(s->erases == allocErases && s->ranges[i].contains(addr))
 	{
-	    cout << (char*)accessType << " " << PIN_ThreadId() << " 0x" << hex << setw(16) 
-		 << setfill('0') << addr << dec << " " << size << " " 
-		 << name << " " << source << endl;
+	    const AllocRecord &ar = s->records[i];
+	    unordered_map<UINT64, string> *cache = fieldCaches[tid];
+
+	    if(allocSelection && !ar.selected)
+	    {
+		found = false;
+		known = true;
+	    }
+	    else if(cache)
+	    {
+		size_t offset = (addr - s->ranges[i].base) % ar.item_size;
+		unordered_map<UINT64, string>::iterator it =
+		    cache->find((UINT64)ar.id << 32 | offset);
+
+		if(offset >> 32 == 0 && it != cache->end())
+		{
+		    var = it->second;
+		    found = true;
+		    known = true;
+		}
+	    }
 	}
     }
-    cout.flush();
-    PIN_ReleaseLock(&lock);
+    allocEpochs.exit(tid);
+    return known;
 }
 
-
-
 /* ===================================================================== */
-/* Instrumentation routines                                              */
+/* Field heatmap (-heat)                                                 */
 /* ===================================================================== */
-   
-VOID instrumentRoutine(RTN rtn, VOID * unused)
-{
-    RTN_Open(rtn);
-	    
 
-    /* Instrument entry and exit to the routine to report
-     * function-begin and function-end events.
-     */
-    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)callBeforeAfterFunction,
-		   IARG_PTR, RTN_Address(rtn), 
-		   IARG_UINT32, FUNC_BEGIN, 
-		   IARG_END);
-    RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)callBeforeAfterFunction,
-		   IARG_PTR, RTN_Address(rtn),
-		   IARG_UINT32, FUNC_END,  
-		   IARG_END);
+/* Instead of the trace, every thread counts the reads and writes of
+ * every field, a field being an offset into an item of a type, and how
+ * often two fields of the same item are accessed within the last
+ * -heatw accesses of the thread. Allocations of an unknown type count
+ * as a type of their own, named after the allocation.
+ */
+#define HEAT_TOP_PAIRS 16
 
-    RTN_Close(rtn);
-}
+class HeatField
+{
+public:
+    string type;
+    size_t itemSize;
+    size_t offset;
+    string name;
+};
 
-// Is called for every instruction and instruments reads and writes
-VOID Instruction(INS ins, VOID *v)
+class HeatThread
 {
-    /* Instruments memory accesses using a predicated call, i.e.
-     * the instrumentation is called iff the instruction will actually be executed.
-     *
-     * On the IA-32 and Intel(R) 64 architectures conditional moves and REP 
-     * prefixed instructions appear as predicated instructions in Pin.
+public:
+    /* Field ids by allocation id and offset, so that we only take the
+     * lock to look up a field the first time
      */
-    UINT32 memOperands = INS_MemoryOperandCount(ins);
-    ADDRINT insAddr = INS_Address(ins);
-    RTN rtn = RTN_FindByAddress(insAddr);
+    unordered_map<UINT64, UINT32> fields;
+    vector<UINT64> reads, writes;
 
-    // Iterate over each memory operand of the instruction.
-    for (UINT32 memOp = 0; memOp < memOperands; memOp++)
-    {
-        if (INS_MemoryOperandIsRead(ins, memOp))
-        {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)recordMemoryAccess,
-		IARG_MEMORYOP_EA, memOp, 
-		IARG_MEMORYREAD_SIZE, 
-		IARG_INST_PTR,
-		IARG_PTR, RTN_Address(rtn),
-		IARG_PTR, readStr, 
-                IARG_END);
-
-        }
-        // Note that in some architectures a single memory operand can be 
-        // both read and written (for instance incl (%eax) on IA-32)
-        // In that case we instrument it once for read and once for write.
-        if (INS_MemoryOperandIsWritten(ins, memOp))
-        {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)recordMemoryAccess,
-		IARG_MEMORYOP_EA, memOp, 
-		IARG_MEMORYWRITE_SIZE, 
-		IARG_INST_PTR,
-		IARG_PTR, RTN_Address(rtn),
-		IARG_PTR, writeStr, 
-                IARG_END);
+    /* The last accesses, as item base and field id */
+    deque<pair<ADDRINT, UINT32> > window;
+    map<pair<UINT32, UINT32>, UINT64> together;
+    volatile UINT64 counted;
 
-        }
-    }
-}
+    HeatThread()
+	: counted(0) {}
+};
 
+bool fieldHeatmap = false;
+vector<HeatField> heatFields;   /* protected by the lock */
+map<string, UINT32> heatFieldIds;
+vector<HeatThread*> heatThreads;   /* like packedBuffers */
 
-VOID Image(IMG img, VOID *v)
+/* The id of the field of the allocation at offset. Must be called with
+ * the lock held.
+ */
+UINT32 heatFieldId(const AllocRecord &ar, size_t offset)
 {
-    cerr << "Loading image " << IMG_Name(img) << endl;
+    string type = ar.varType;
 
-    /* Find main. We won't do anything before main starts. */
-    RTN rtn = RTN_FindByName(img, "main");
-    if(RTN_Valid(rtn))
+    if(type.length() == 0 || type.compare("<Unknown>") == 0)
+	type = ar.sourceFile + ":" + to_string(ar.sourceLine) + " " + ar.varName;
+
+    string key = type + " " + to_string(offset);
+    map<string, UINT32>::iterator it = heatFieldIds.find(key);
+    if(it != heatFieldIds.end())
+	return it->second;
+
+    HeatField hf;
+    hf.type = type;
+    hf.itemSize = ar.item_size;
+    hf.offset = offset;
+    if(ar.vi)
     {
-	RTN_Open(rtn);
-	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)callBeforeMain, IARG_END);
-	RTN_Close(rtn);
+	PROFILE_PHASE(PHASE_FIELD_NAME);
+	hf.name = ar.vi->fieldname(ar.sourceFile, ar.sourceLine, ar.varName, offset);
     }
+    if(hf.name.length() == 0 || hf.name.compare("<Unknown>") == 0)
+	hf.name = "+" + to_string(offset);
 
-    /* Go over all the allocation routines we are instrumenting and insert the
-     * instrumentation.
-     */
-    bool varInfoAllocated = false;
-    VarInfo *vi = NULL;
+    heatFields.push_back(hf);
+    heatFieldIds[key] = heatFields.size() - 1;
+    return heatFields.size() - 1;
+}
+
+/* Count the access to the field it falls into, if it falls into an
+ * allocation. Like findPublishedVariable, we only take the lock when
+ * the published allocations and the thread's own fields aren't enough.
+ */
+VOID countFieldAccess(ADDRINT addr, UINT32 size, bool isWrite)
+{
+    THREADID tid = PIN_ThreadId();
+    HeatThread *ht = heatThreads[tid];
+    ADDRINT itemBase = 0;
+    UINT32 fieldId = 0;
+    bool cached = false;
+
+    if(allocEpochs.enter(tid))
+    {
+	const AllocSnapshot *s = allocSnapshot;
+	long i;
+	{
+	    PROFILE_PHASE(PHASE_ALLOCMAP_FIND);
+	    i = s->find(addr, size);
+	}
+	bool outside = i < 0 && s->version == allocVersion;
+
+	if(i >= 0 && s->erases == allocErases && s->ranges[i].contains(addr))
+	{
+	    const AllocRecord &ar = s->records[i];
+	    size_t offset = (addr - s->ranges[i].base) % ar.item_size;
+	    unordered_map<UINT64, UINT32>::iterator it =
+		ht->fields.find((UINT64)ar.id << 32 | offset);
+
+	    outside = allocSelection && !ar.selected;
+	    if(it != ht->fields.end() && offset >> 32 == 0)
+	    {
+		itemBase = addr - offset;
+		fieldId = it->second;
+		cached = true;
+	    }
+	}
+	allocEpochs.exit(tid);
+
+	if(outside)
+	    return;
+    }
+
+    if(!cached)
+    {
+	PROFILE_GET_LOCK(&lock, tid + 1);
+	map<MemoryRange, AllocRecord>::iterator it;
+
+	noteAllocMiss();
+	{
+	    PROFILE_PHASE(PHASE_ALLOCMAP_FIND);
+	    it = allocmap.find(MemoryRange(addr, size));
+	}
+	if(it == allocmap.end() || !it->first.contains(addr)
+	   || (allocSelection && !it->second.selected))
+	{
+	    PIN_ReleaseLock(&lock);
+	    return;
+	}
+
+	size_t offset = (addr - it->first.base) % it->second.item_size;
+	UINT64 allocId = it->second.id;
+
+	itemBase = addr - offset;
+	fieldId = heatFieldId(it->second, offset);
+	PIN_ReleaseLock(&lock);
+
+	/* The record may be gone once we release the lock */
+	if(offset >> 32 == 0)
+	    ht->fields[allocId << 32 | offset] = fieldId;
+    }
+
+    if(ht->reads.size() <= fieldId)
+    {
+	ht->reads.resize(fieldId + 1);
+	ht->writes.resize(fieldId + 1);
+    }
+    if(isWrite)
+	ht->writes[fieldId]++;
+    else
+	ht->reads[fieldId]++;
+    ht->counted++;
+    PROFILE_PERIODIC(ht->counted, KnobProfileInterval, cerr);
+
+    /* Every other field of the item in the window, once */
+    for(size_t i = 0; i < ht->window.size(); i++)
+    {
+	UINT32 other = ht->window[i].second;
+	bool seen = false;
+
+	if(ht->window[i].first != itemBase || other == fieldId)
+	    continue;
+	for(size_t j = i + 1; j < ht->window.size() && !seen; j++)
+	    seen = ht->window[j].first == itemBase && ht->window[j].second == other;
+	if(!seen)
+	    ht->together[make_pair(min(other, fieldId), max(other, fieldId))]++;
+    }
+
+    ht->window.push_back(make_pair(itemBase, fieldId));
+    if(ht->window.size() > KnobHeatmapWindow.Value())
+	ht->window.pop_front();
+}
+
+/* Write the heatmap. The types with the most accesses come first, with
+ * their fields by offset, and the pairs of fields accessed together the
+ * most. Called at exit.
+ */
+VOID writeHeatmap(const char *fname)
+{
+    ofstream f(fname);
+    vector<UINT64> reads(heatFields.size()), writes(heatFields.size());
+    map<pair<UINT32, UINT32>, UINT64> together;
+    map<string, UINT64> typeAccesses;
+    map<string, vector<UINT32> > typeFields;
+
+    if(!f.is_open())
+    {
+	cerr << "Failed to create file " << fname << endl;
+	return;
+    }
+
+    for(HeatThread *ht: heatThreads)
+    {
+	if(ht == NULL)
+	    continue;
+	for(UINT32 id = 0; id < ht->reads.size(); id++)
+	{
+	    reads[id] += ht->reads[id];
+	    writes[id] += ht->writes[id];
+	}
+	for(map<pair<UINT32, UINT32>, UINT64>::iterator it = ht->together.begin();
+	    it != ht->together.end(); it++)
+	    together[it->first] += it->second;
+    }
+
+    for(UINT32 id = 0; id < heatFields.size(); id++)
+    {
+	typeAccesses[heatFields[id].type] += reads[id] + writes[id];
+	typeFields[heatFields[id].type].push_back(id);
+    }
+
+    vector<pair<UINT64, string> > types;
+    for(map<string, UINT64>::iterator it = typeAccesses.begin(); it != typeAccesses.end(); it++)
+	types.push_back(make_pair(it->second, it->first));
+    sort(types.rbegin(), types.rend());
+
+    f << "heatmap: " << KnobHeatmapWindow.Value() << endl;
+    for(pair<UINT64, string> &t: types)
+    {
+	vector<UINT32> &ids = typeFields[t.second];
+	vector<pair<UINT64, pair<UINT32, UINT32> > > pairs;
+
+	sort(ids.begin(), ids.end(), [](UINT32 a, UINT32 b)
+	     { return heatFields[a].offset < heatFields[b].offset; });
+	f << "type: " << heatFields[ids[0]].itemSize << " " << t.first
+	  << " " << t.second << endl;
+
+	for(UINT32 id: ids)
+	{
+	    f << "field: " << heatFields[id].offset << " " << heatFields[id].name
+	      << " " << reads[id] << " " << writes[id];
+	    for(THREADID tid = 0; tid < heatThreads.size(); tid++)
+	    {
+		HeatThread *ht = heatThreads[tid];
+
+		if(ht && id < ht->reads.size() && ht->reads[id] + ht->writes[id] > 0)
+		    f << " " << tid << ":" << ht->reads[id] << ":" << ht->writes[id];
+	    }
+	    f << endl;
+	}
+
+	for(map<pair<UINT32, UINT32>, UINT64>::iterator it = together.begin();
+	    it != together.end(); it++)
+	{
+	    if(heatFields[it->first.first].type.compare(t.second) == 0)
+		pairs.push_back(make_pair(it->second, it->first));
+	}
+	sort(pairs.rbegin(), pairs.rend());
+	for(size_t i = 0; i < pairs.size() && i < HEAT_TOP_PAIRS; i++)
+	    f << "together: " << heatFields[pairs[i].second.first].name << " "
+	      << heatFields[pairs[i].second.second].name << " " << pairs[i].first << endl;
+    }
+
+    if(f.fail())
+	cerr << "Failed to write the heatmap to " << fname << endl;
+}
+
+/* The time stamp counter, the timestamp of the accesses in a packed trace */
+static inline UINT64 readTimestamp()
+{
+    UINT32 lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return (UINT64)hi << 32 | lo;
+}
+
+/* Write an epoch marker if it is time. Called with packedLock held. */
+VOID writePackedEpoch()
+{
+    UINT64 now = readTimestamp();
+    UINT64 watermark = now;
+    string rec;
+
+    if(now - lastEpoch < EPOCH_TICKS)
+	return;
+    lastEpoch = now;
+
+    /* A thread starting a new buffer sets pending before it reads the
+     * timestamp of the access, so if we don't see it here, the access
+     * will be later than now.
+     */
+    __sync_synchronize();
+    for(PackedThreadBuffer *pb: packedBuffers)
+    {
+	if(pb == NULL)
+	    continue;
+
+	UINT64 pending = pb->pending;
+
+	if(pending != 0 && pending < watermark)
+	    watermark = pending;
+    }
+
+    encodeEpoch(now, indexClock() - traceStartTime, watermark, rec);
+    fwrite(rec.data(), 1, rec.length(), packedTrace);
+    packedOffset += rec.length();
+}
+
+/* Encode the accesses in the thread's buffer and write them out.
+ * The encoding is done outside of any lock.
+ */
+VOID flushPackedBuffer(THREADID tid)
+{
+    PackedThreadBuffer *pb = packedBuffers[tid];
+
+    if(pb->accesses.empty())
+	return;
+
+    size_t numAccesses = pb->accesses.size();
+    UINT64 lastTime = pb->accesses.back().time;
+
+    pb->encoder.encodeBlock(tid, pb->accesses, pb->block);
+    pb->accesses.clear();
+
+    /* The accesses of the thread are in order, so its own file
+     * needs no other watermark than the end of the block.
+     */
+    if(packedPerThread)
+    {
+	string rec;
+
+	encodeEpoch(readTimestamp(), indexClock() - traceStartTime, lastTime + 1, rec);
+	fwrite(pb->defs.data(), 1, pb->defs.length(), pb->file);
+	fwrite(pb->block.data(), 1, pb->block.length(), pb->file);
+	fwrite(rec.data(), 1, rec.length(), pb->file);
+	pb->defs.clear();
+	pb->pending = 0;
+	return;
+    }
+
+    PIN_GetLock(&packedLock, tid + 1);
+    if(traceIndex)
+    {
+	traceIndex->checkpoint(packedOffset, packedRecords, traceIndex->now(),
+			       packedThreadRecords);
+	packedRecords += numAccesses;
+	if(packedThreadRecords.size() < tid + 1)
+	    packedThreadRecords.resize(tid + 1);
+	packedThreadRecords[tid] += numAccesses;
+    }
+    fwrite(pb->block.data(), 1, pb->block.length(), packedTrace);
+    packedOffset += pb->block.length();
+    pb->pending = 0;
+    writePackedEpoch();
+    PIN_ReleaseLock(&packedLock);
+}
+
+/* Write a site or variable definition to the packed trace, and
+ * to its index. Must be called with the lock held, so that definitions
+ * are written before any block that uses them. With per-thread files
+ * the definition is just kept in defs.
+ */
+VOID writePackedDefinition(const string &rec, vector<string> &defs)
+{
+    /* Kept for the per-thread files, and for rotating the trace */
+    defs.push_back(rec);
+    if(packedPerThread)
+	return;
+
+    PIN_GetLock(&packedLock, PIN_ThreadId() + 1);
+    if(traceIndex)
+	traceIndex->definition(rec);
+    fwrite(rec.data(), 1, rec.length(), packedTrace);
+    packedOffset += rec.length();
+    PIN_ReleaseLock(&packedLock);
+}
+
+/* Queue the definitions of the site and the variable of the access
+ * for the thread's file, unless they are already there. Called with
+ * the lock held.
+ */
+VOID copyPackedDefinitions(PackedThreadBuffer *pb, const PackedAccess &pa)
+{
+    if(pb->sitesDefined.size() <= pa.siteId)
+	pb->sitesDefined.resize(pa.siteId + 1);
+    if(!pb->sitesDefined[pa.siteId])
+    {
+	pb->defs += packedSiteDefs[pa.siteId];
+	pb->sitesDefined[pa.siteId] = true;
+    }
+
+    if(pa.varId == 0)
+	return;
+    if(pb->variablesDefined.size() <= pa.varId)
+	pb->variablesDefined.resize(pa.varId + 1);
+    if(!pb->variablesDefined[pa.varId])
+    {
+	pb->defs += packedVariableDefs[pa.varId];
+	pb->variablesDefined[pa.varId] = true;
+    }
+}
+
+/* Record the access in the thread's buffer for the packed trace.
+ * We only take the lock to look up the site and the variable. The
+ * source location of a site is looked up once, the first time we see
+ * the instruction.
+ */
+VOID recordPackedAccess(ADDRINT addr, UINT32 size, ADDRINT codeAddr,
+			VOID *rtnAddr, bool isWrite)
+{
+    THREADID tid = PIN_ThreadId();
+    PackedThreadBuffer *pb = packedBuffers[tid];
+    PackedAccess pa;
+    string rec;
+
+    if(pb->accesses.empty())
+    {
+	pb->pending = readTimestamp();
+	__sync_synchronize();
+    }
+    pa.time = readTimestamp();
+
+    string var;
+    bool found = false;
+    bool known = !watchList && findPublishedVariable(addr, size, var, found);
+
+    /* If the thread has used the site and the variable before, it has
+     * all it needs and doesn't have to take the lock.
+     */
+    if(known)
+    {
+	map<ADDRINT, uint32_t>::iterator site = pb->sites.find(codeAddr);
+	unordered_map<string, uint32_t>::iterator variable;
+
+	if(allocSelection && !found)
+	{
+	    if(pb->accesses.empty())
+		pb->pending = 0;
+	    return;
+	}
+	if(found)
+	    variable = pb->variables.find(var);
+
+	if(site != pb->sites.end() && (!found || variable != pb->variables.end()))
+	{
+	    pa.siteId = site->second;
+	    pa.varId = found ? variable->second : 0;
+	    pb->recorded++;
+	    PROFILE_PERIODIC(pb->recorded, KnobProfileInterval, cerr);
+	    goto record;
+	}
+    }
+
+    PROFILE_GET_LOCK(&lock, tid + 1);
+    {
+	map<ADDRINT, uint32_t>::iterator it = packedSites.find(codeAddr);
+
+	if(!known)
+	    found = findVariable(addr, size, var);
+
+	/* Not one of the selected allocations or watched ranges */
+	if((allocSelection && !found) || (watchList && !watchList->contains(addr)))
+	{
+	    PIN_ReleaseLock(&lock);
+	    if(pb->accesses.empty())
+		pb->pending = 0;
+	    return;
+	}
+	recordedAccesses++;
+	PROFILE_PERIODIC(recordedAccesses, KnobProfileInterval, cerr);
+
+	if(it == packedSites.end())
+	{
+	    pa.siteId = packedSites.size();
+	    packedSites[codeAddr] = pa.siteId;
+	    encodeSite(pa.siteId, RTN_FindNameByAddress((ADDRINT)rtnAddr),
+		       sourceLocation(codeAddr), rec);
+	    writePackedDefinition(rec, packedSiteDefs);
+	}
+	else
+	    pa.siteId = it->second;
+
+	pa.varId = 0;
+	if(found)
+	{
+	    size_t numVariables = packedVariables.strings.size();
+
+	    pa.varId = packedVariables.id(var);
+	    if(pa.varId == numVariables)
+	    {
+		encodeVariable(pa.varId, var, rec);
+		writePackedDefinition(rec, packedVariableDefs);
+	    }
+	}
+
+	if(packedPerThread)
+	    copyPackedDefinitions(pb, pa);
+    }
+    cout.flush();
+    PIN_ReleaseLock(&lock);
+
+    pb->sites[codeAddr] = pa.siteId;
+    if(found)
+	pb->variables[var] = pa.varId;
+
+  record:
+    pa.address = addr;
+    pa.size = size;
+    pa.isWrite = isWrite;
+
+    pb->accesses.push_back(pa);
+    if(pb->accesses.size() == PACKED_BLOCK_ACCESSES)
+	flushPackedBuffer(tid);
+}
+
+VOID recordMemoryAccess(ADDRINT addr, UINT32 size, ADDRINT codeAddr, 
+		       VOID *rtnAddr, VOID *accessType)
+{
+
+    /* Don't track until we hit main() */
+    if(!go)
+	return;
+
+    /* Code instrumented before recording was turned off may still run */
+    if(!recordingOn)
+	return;
+
+    if(inTracked[PIN_ThreadId()] == NO)
+	return;
+
+    if(!KnobTrackStackAccesses)
+    {
+	if(processStack.contains((size_t)addr))
+	    return;
+
+	if(!threadStacks[PIN_ThreadId()])
+	{
+	    cerr << "Warning: null stack for thread " << PIN_ThreadId() << endl;
+	}
+	else if(threadStacks[PIN_ThreadId()]->contains((size_t)addr))
+	    return;
+
+    }
+
+    if(fieldHeatmap)
+    {
+	countFieldAccess(addr, size, accessType == writeStr);
+	return;
+    }
+
+    if(packedOutput)
+    {
+	recordPackedAccess(addr, size, codeAddr, rtnAddr, accessType == writeStr);
+	return;
+    }
+    
+    /* Look the variable up before taking the lock, if we can */
+    string var;
+    bool found = false;
+    bool known = !watchList && findPublishedVariable(addr, size, var, found);
+
+    if(known && allocSelection && !found)
+	return;
+
+    PROFILE_GET_LOCK(&lock, PIN_ThreadId()+1);
+    {
+	if(!known)
+	    found = findVariable(addr, size, var);
+
+	/* Not one of the selected allocations or watched ranges */
+	if((allocSelection && !found) || (watchList && !watchList->contains(addr)))
+	{
+	    PIN_ReleaseLock(&lock);
+	    return;
+	}
+	recordedAccesses++;
+
+	PROFILE_PERIODIC(recordedAccesses, KnobProfileInterval, cerr);
+
+	string source = sourceLocation(codeAddr);
+	string name = RTN_FindNameByAddress((ADDRINT)rtnAddr);
+
+	PROFILE_PHASE(PHASE_OUTPUT);
+	if(columnarTrace)
+	{
+	    columnarTrace->append(addr, size, PIN_ThreadId(), accessType == writeStr,
+				  source, name, var);
+	}
+	else
+	{
+	    cout << (char*)accessType << " " << PIN_ThreadId() << " 0x" << hex << setw(16) 
+		 << setfill('0') << addr << dec << " " << size << " " 
+		 << name << " " << source;
+
+	    if(found)
+		cout << " " << var;
+
+	    cout << endl;
+	}
+    }
+    cout.flush();
+    PIN_ReleaseLock(&lock);
+}
+
+
+
+/* ===================================================================== */
+/* Instrumentation routines                                              */
+/* ===================================================================== */
+   
+VOID instrumentRoutine(RTN rtn, VOID * unused)
+{
+    RTN_Open(rtn);
+	    
+
+    /* Instrument entry and exit to the routine to report
+     * function-begin and function-end events.
+     */
+    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)callBeforeAfterFunction,
+		   IARG_PTR, RTN_Address(rtn), 
+		   IARG_UINT32, FUNC_BEGIN, 
+		   IARG_END);
+    RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)callBeforeAfterFunction,
+		   IARG_PTR, RTN_Address(rtn),
+		   IARG_UINT32, FUNC_END,  
+		   IARG_END);
+
+    RTN_Close(rtn);
+}
+
+/* The inlined checks in front of recordMemoryAccess. With -sel, is
+ * the line of addr in one of the selected allocations? With -w, is addr
+ * in one of the watched ranges, or in one of their lines if there are
+ * too many to compare with?
+ */
+ADDRINT PIN_FAST_ANALYSIS_CALL isSelectedLine(ADDRINT addr)
+{
+    return selectedLines->test(addr);
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL isWatchedAddress(ADDRINT addr)
+{
+    return (addr - watchBase[0] < watchSize[0])
+	| (addr - watchBase[1] < watchSize[1])
+	| (addr - watchBase[2] < watchSize[2])
+	| (addr - watchBase[3] < watchSize[3]);
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL isWatchedLine(ADDRINT addr)
+{
+    return watchedLines->test(addr);
+}
+
+/* Call recordMemoryAccess for the memory operand, or, with -sel or -w,
+ * only if it passes the accessFilter.
+ */
+VOID insertAccessCall(INS ins, UINT32 memOp, IARG_TYPE sizeArg, RTN rtn, char *accessType)
+{
+    if(accessFilter)
+    {
+	INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, accessFilter,
+				   IARG_FAST_ANALYSIS_CALL,
+				   IARG_MEMORYOP_EA, memOp,
+				   IARG_END);
+	INS_InsertThenPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)recordMemoryAccess,
+				     IARG_MEMORYOP_EA, memOp,
+				     sizeArg,
+				     IARG_INST_PTR,
+				     IARG_PTR, RTN_Address(rtn),
+				     IARG_PTR, accessType,
+				     IARG_END);
+    }
+    else
+    {
+	INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)recordMemoryAccess,
+				 IARG_MEMORYOP_EA, memOp,
+				 sizeArg,
+				 IARG_INST_PTR,
+				 IARG_PTR, RTN_Address(rtn),
+				 IARG_PTR, accessType,
+				 IARG_END);
+    }
+}
+
+// Is called for every instruction and instruments reads and writes
+VOID Instruction(INS ins, VOID *v)
+{
+    /* Instruments memory accesses using a predicated call, i.e.
+     * the instrumentation is called iff the instruction will actually be executed.
+     *
+     * On the IA-32 and Intel(R) 64 architectures conditional moves and REP 
+     * prefixed instructions appear as predicated instructions in Pin.
+     */
+    UINT32 memOperands = INS_MemoryOperandCount(ins);
+    ADDRINT insAddr = INS_Address(ins);
+    RTN rtn = RTN_FindByAddress(insAddr);
+
+    if(!recordingOn)
+	return;
+
+    // Iterate over each memory operand of the instruction.
+    for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+    {
+        if (INS_MemoryOperandIsRead(ins, memOp))
+            insertAccessCall(ins, memOp, IARG_MEMORYREAD_SIZE, rtn, readStr);
+        // Note that in some architectures a single memory operand can be 
+        // both read and written (for instance incl (%eax) on IA-32)
+        // In that case we instrument it once for read and once for write.
+        if (INS_MemoryOperandIsWritten(ins, memOp))
+            insertAccessCall(ins, memOp, IARG_MEMORYWRITE_SIZE, rtn, writeStr);
+    }
+}
+
+
+/* Start watching [base, base + size). Must be called with the lock held. */
+VOID addWatchedRange(ADDRINT base, ADDRINT size)
+{
+    ADDRINT end = base + size;
+    map<ADDRINT, ADDRINT> &ranges = watchList->ranges;
+
+    if(size == 0)
+	return;
+
+    if(watchedLines)
+	watchedLines->mark(base, size);
+    else
+    {
+	assert(watchSlots < WATCH_INLINE_RANGES);
+	watchBase[watchSlots] = base;
+	watchSize[watchSlots] = size;
+	watchSlots++;
+    }
+
+    /* Merge it with the ranges it overlaps */
+    map<ADDRINT, ADDRINT>::iterator it = ranges.upper_bound(base);
+    if(it != ranges.begin())
+    {
+	map<ADDRINT, ADDRINT>::iterator prev = it;
+	if((--prev)->second >= base)
+	{
+	    base = prev->first;
+	    end = max(end, prev->second);
+	    it = ranges.erase(prev);
+	}
+    }
+    while(it != ranges.end() && it->first <= end)
+    {
+	end = max(end, it->second);
+	it = ranges.erase(it);
+    }
+    ranges[base] = end;
+}
+
+/* Look for the watched symbols that we haven't found yet in the image */
+VOID watchSymbols(IMG img)
+{
+    map<string, ElfSymbol> found;
+
+    if(!findElfSymbols(IMG_Name(img), watchList->symbols, found))
+	return;
+
+    PROFILE_GET_LOCK(&lock, PIN_ThreadId() + 1);
+    for(map<string, ElfSymbol>::iterator it = found.begin(); it != found.end(); it++)
+    {
+	ADDRINT base = it->second.value + IMG_LoadOffset(img);
+
+	cerr << "Watching " << it->first << " at 0x" << hex << base << dec
+	     << ", " << it->second.size << " bytes" << endl;
+	addWatchedRange(base, it->second.size);
+	watchList->symbols.erase(it->first);
+    }
+    PIN_ReleaseLock(&lock);
+}
+
+VOID Image(IMG img, VOID *v)
+{
+    cerr << "Loading image " << IMG_Name(img) << endl;
+
+    if(watchList && !watchList->symbols.empty())
+	watchSymbols(img);
+
+    /* Find main. We won't do anything before main starts. */
+    RTN rtn = RTN_FindByName(img, "main");
+    if(RTN_Valid(rtn))
+    {
+	RTN_Open(rtn);
+	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)callBeforeMain, IARG_END);
+	RTN_Close(rtn);
+    }
+
+    /* Go over all the allocation routines we are instrumenting and insert the
+     * instrumentation.
+     */
+    bool varInfoAllocated = false;
+    VarInfo *vi = NULL;
     for(FuncProto *fp: funcProto)
     {
 
@@ -1341,7 +2551,7 @@ VOID Image(IMG img, VOID *v)
 	    FuncRecord *fr;
 	    cout << "Procedure " << fp->name << " located." << endl;
 
-	    PIN_GetLock(&lock, PIN_ThreadId() + 1);
+	    PROFILE_GET_LOCK(&lock, PIN_ThreadId() + 1);
 	    if((fr = findFuncRecord(&funcRecords, fp->name)) == NULL)
 	    {
 		fr = allocateAndAdd(&funcRecords, fp, vi);
@@ -1402,97 +2612,502 @@ VOID Image(IMG img, VOID *v)
 
 	    RTN_Close(rtn);
 
-	}
-    }   
+	}
+    }   
+}
+
+
+/* ===================================================================== */
+/* Parse the list of functions we want to instrument.                    */
+/* Return false if we can't open the file or it is empty.                */
+/* Return true otherwise.                                                */
+/* ===================================================================== */
+
+bool parseFunctionList(const char *fname, vector<string> &list, file_mode_t mode)
+{
+    bool selective = true;
+    ifstream f;
+    
+    f.open(fname);
+    
+    if(f.fail())
+    {
+	cerr << "Failed to open required file " << fname << endl;
+	exit(-1);
+    }
+
+    cout << "Routines specified for instrumentation:" << endl;
+    while(!f.eof())
+    {
+	string name;
+	getline(f, name);
+	cout << name << endl;
+	
+	/* Lines beginning with a # are to be ignored */
+	if(name.find("#") == 0)
+	    continue;
+
+	/* Trim the string to get rid of empty ones */
+	trim(name);
+
+	if(name.length() == 0)
+	    continue;
+
+        /* See if we have a line with only * on it. 
+	 * If so, we are tracking all functions.
+	 */
+	if(name.compare("*") == 0)
+	{
+	    if(mode == TRACKED)
+	    {
+		selective = false;
+		continue;
+	    }
+	    else if(mode == ALLOC)
+	    {
+		cerr << "Found a line with '*' and nothing else on it. "
+		    "This makes no sense in the allocation function "
+		    "config file. Please read the documentation on the "
+		    "correct format." << endl;
+		exit(-1);
+	    }
+	}
+	
+	list.push_back(name);
+    }
+
+    f.close();
+    
+    if(list.size() == 0)
+    {
+	if(mode == TRACKED && selective)
+	{
+	    cerr << "No function names in file " << fname << 
+		" and no line with '*'. " 
+		"Please specify what you want to track. " << endl;
+	    exit(-1);
+	}
+	else
+	    return false;
+    }
+    else
+    {
+	if(mode == TRACKED && !selective)
+	{
+	    cerr << "There appear to be names of function to track "
+		"in file " << fname << " as well as a line with '*'. "
+		"Don't understand if you want to track everything or just "
+		"selected functions. " << endl;
+	    exit(-1);
+	}
+	else
+	    return true;
+    }
+}
+
+/* ===================================================================== */
+/* Attaching to a running process                                        */
+/* ===================================================================== */
+
+/* Read the snapshot of the allocations that were live when we attached
+ * (-heap). Every line is "<address> <size> [<variable> [<type>]]".
+ * The allocations are recorded as made at "pre-attach:0".
+ */
+VOID loadHeapSnapshot(const char *fname)
+{
+    ifstream f(fname);
+    string line;
+
+    if(f.fail())
+    {
+	cerr << "Failed to open required file " << fname << endl;
+	exit(-1);
+    }
+
+    while(getline(f, line))
+    {
+	/* Lines beginning with a # are to be ignored */
+	if(line.find("#") == 0)
+	    continue;
+
+	trim(line);
+	if(line.length() == 0)
+	    continue;
+
+	istringstream words(line);
+	string baseStr, sizeStr, varname, vartype;
+	char *end1, *end2;
+
+	words >> baseStr >> sizeStr >> varname >> vartype;
+	ADDRINT base = strtoull(baseStr.c_str(), &end1, 0);
+	ADDRINT size = strtoull(sizeStr.c_str(), &end2, 0);
+	if(baseStr.length() == 0 || sizeStr.length() == 0
+	   || *end1 != '\0' || *end2 != '\0' || size == 0)
+	{
+	    cerr << "Bad allocation \"" << line << "\" in " << fname << endl;
+	    exit(-1);
+	}
+
+	AllocRecord ar("pre-attach", 0, varname, vartype, NULL, base, size, 1);
+	if(allocSelection && allocSelection->selects("pre-attach", 0, varname, vartype))
+	{
+	    ar.selected = true;
+	    selectedLines->mark(base, size);
+	}
+	assignAllocId(ar);
+	allocmap.erase(MemoryRange(base, size));
+	allocmap.insert(make_pair(MemoryRange(base, size), ar));
+
+	cout << "alloc: 0"
+	     << " 0x" << hex << setfill('0') << setw(16) << base
+	     << dec << " pre-attach " << size << " 1 pre-attach:0 "
+	     << varname << " " << vartype << endl;
+    }
+    cout.flush();
+
+    allocVersion++;
+    publishAllocations();
+}
+
+/* Set up what callBeforeMain would have: we are past main() already */
+VOID startAttached()
+{
+    cerr << "Attached to a running process" << endl;
+
+    get_process_stack(getpid());
+    get_pre_attach_memory(getpid());
+    if(KnobHeapSnapshot.Value().length() > 0)
+	loadHeapSnapshot(KnobHeapSnapshot.Value().c_str());
+    go = true;
+}
+
+/* ===================================================================== */
+/* The control pipe (-ctl)                                               */
+/* ===================================================================== */
+
+/* Start or stop recording. Instruction() only instruments the memory
+ * accesses while recording, so have Pin throw away the code it has
+ * instrumented and instrument it again as it runs.
+ */
+VOID setRecording(bool on)
+{
+    if(recordingOn == on)
+	return;
+
+    recordingOn = on;
+    PIN_LockClient();
+    PIN_RemoveInstrumentation();
+    PIN_UnlockClient();
+
+    cerr << "memtracker: recording " << (on ? "started" : "stopped") << endl;
+}
+
+/* Continue the trace in new files, named like the old ones with the
+ * number of the rotation appended.
+ */
+VOID rotateTrace()
+{
+    if(framedTrace || traceIndex || packedPerThread
+       || (!traceFile.is_open() && !columnarTrace && !packedTrace))
+    {
+	cerr << "memtracker: can't rotate the trace. Only uncompressed, "
+	    "unindexed traces written with -o, -c or -b can be rotated." << endl;
+	return;
+    }
+
+    PROFILE_GET_LOCK(&lock, PIN_ThreadId() + 1);
+    string suffix = "." + to_string(++rotations);
+
+    if(traceFile.is_open())
+    {
+	cout.flush();
+	traceFile.close();
+	traceFile.open((KnobOutputFile.Value() + suffix).c_str());
+	if(!traceFile.is_open())
+	    cerr << "Failed to create file " << KnobOutputFile.Value() + suffix << endl;
+    }
+
+    if(columnarTrace)
+    {
+	if(!columnarTrace->close())
+	    cerr << "Failed to write the columnar trace" << endl;
+	delete columnarTrace;
+	columnarTrace = new ColumnarWriter();
+	if(!columnarTrace->open((KnobColumnarFile.Value() + suffix).c_str()))
+	    cerr << "Failed to create file " << KnobColumnarFile.Value() + suffix << endl;
+    }
+
+    /* Blocks still in the buffers may use any of the sites and variables
+     * defined so far, so the new file starts with all of them.
+     */
+    if(packedTrace)
+    {
+	string name = KnobPackedFile.Value() + suffix;
+	FILE *f = fopen(name.c_str(), "w");
+
+	PIN_GetLock(&packedLock, PIN_ThreadId() + 1);
+	if(f == NULL)
+	    cerr << "Failed to create file " << name << ", still writing to the old one" << endl;
+	else
+	{
+	    if(fclose(packedTrace) != 0)
+		cerr << "Failed to write the packed trace" << endl;
+	    packedTrace = f;
+	    fwrite(PACKED_MAGIC, 1, PACKED_MAGIC_LEN, packedTrace);
+	    for(const string &def: packedSiteDefs)
+		fwrite(def.data(), 1, def.length(), packedTrace);
+	    for(const string &def: packedVariableDefs)
+		fwrite(def.data(), 1, def.length(), packedTrace);
+	}
+	PIN_ReleaseLock(&packedLock);
+    }
+    PIN_ReleaseLock(&lock);
+
+    cerr << "memtracker: rotated the trace to *" << suffix << endl;
+}
+
+VOID printStats()
+{
+    PROFILE_GET_LOCK(&lock, PIN_ThreadId() + 1);
+    UINT64 recorded = recordedAccesses;
+
+    for(PackedThreadBuffer *pb: packedBuffers)
+	if(pb)
+	    recorded += pb->recorded;
+    for(HeatThread *ht: heatThreads)
+	if(ht)
+	    recorded += ht->counted;
+
+    cerr << "memtracker: recording " << (recordingOn ? "on" : "off")
+	 << ", " << recorded << " accesses recorded, "
+	 << allocmap.size() << " allocations known, "
+	 << rotations << " rotations" << endl;
+    PROFILE_PRINT(cerr);
+    PIN_ReleaseLock(&lock);
+}
+
+VOID runControlCommand(const string &cmd)
+{
+    if(cmd.compare("start") == 0)
+	setRecording(true);
+    else if(cmd.compare("stop") == 0)
+	setRecording(false);
+    else if(cmd.compare("rotate") == 0)
+	rotateTrace();
+    else if(cmd.compare("stats") == 0)
+	printStats();
+    else if(cmd.length() > 0)
+	cerr << "memtracker: unknown command \"" << cmd << "\" on the control pipe. "
+	    "Please use start, stop, rotate or stats." << endl;
+}
+
+/* Read commands from the control pipe, one per line. The pipe is open
+ * for writing as well, so we never see the end of it when a writer goes
+ * away, and we wake up every now and then to see if we should exit.
+ */
+VOID controlThread(VOID *arg)
+{
+    string pending;
+    char buf[256];
+
+    while(!controlDone)
+    {
+	struct pollfd pfd;
+	ssize_t n;
+	size_t nl;
+
+	pfd.fd = controlPipe;
+	pfd.events = POLLIN;
+	if(poll(&pfd, 1, CONTROL_POLL_MS) <= 0
+	   || (n = read(controlPipe, buf, sizeof(buf))) <= 0)
+	    continue;
+
+	pending.append(buf, n);
+	while((nl = pending.find('\n')) != string::npos)
+	{
+	    string cmd = pending.substr(0, nl);
+
+	    pending.erase(0, nl + 1);
+	    trim(cmd);
+	    runControlCommand(cmd);
+	}
+    }
+    close(controlPipe);
+}
+
+/* The control thread must be gone before the tool exits */
+VOID PrepareForFini(VOID *v)
+{
+    controlDone = true;
+    PIN_WaitForThreadTermination(controlThreadUid, PIN_INFINITE_TIMEOUT, NULL);
+}
+
+/* The compression threads must be gone before the tool exits too, or
+ * Pin may kill them in the middle of a frame */
+VOID PrepareTraceForFini(VOID *v)
+{
+    framedTrace->stopWorkers();
+}
+
+/* Create the control pipe, unless it exists, and start reading it */
+VOID startControl(const char *fname)
+{
+    if(mkfifo(fname, 0600) != 0 && errno != EEXIST)
+    {
+	cerr << "Failed to create the control pipe " << fname << endl;
+	exit(-1);
+    }
+
+    controlPipe = open(fname, O_RDWR | O_NONBLOCK);
+    if(controlPipe < 0)
+    {
+	cerr << "Failed to open the control pipe " << fname << endl;
+	exit(-1);
+    }
+
+    if(PIN_SpawnInternalThread(controlThread, NULL, 0, &controlThreadUid)
+       == INVALID_THREADID)
+    {
+	cerr << "Failed to start the thread reading the control pipe" << endl;
+	exit(-1);
+    }
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
 }
 
-
 /* ===================================================================== */
-/* Parse the list of functions we want to instrument.                    */
-/* Return false if we can't open the file or it is empty.                */
-/* Return true otherwise.                                                */
+/* Parse the file of memory to watch (-w). Every line is                 */
+/* "symbol <name>" or "range <start> <end>|+<size>".                     */
 /* ===================================================================== */
 
-bool parseFunctionList(const char *fname, vector<string> &list, file_mode_t mode)
+VOID parseWatchList(const char *fname)
 {
-    bool selective = true;
-    ifstream f;
-    
-    f.open(fname);
-    
+    WatchList *wl = new WatchList();
+    vector<pair<ADDRINT, ADDRINT> > ranges;
+    ifstream f(fname);
+
     if(f.fail())
     {
 	cerr << "Failed to open required file " << fname << endl;
 	exit(-1);
     }
 
-    cout << "Routines specified for instrumentation:" << endl;
-    while(!f.eof())
+    string line;
+    while(getline(f, line))
     {
-	string name;
-	getline(f, name);
-	cout << name << endl;
-	
 	/* Lines beginning with a # are to be ignored */
-	if(name.find("#") == 0)
+	if(line.find("#") == 0)
 	    continue;
 
-	/* Trim the string to get rid of empty ones */
-	trim(name);
-
-	if(name.length() == 0)
+	trim(line);
+	if(line.length() == 0)
 	    continue;
 
-        /* See if we have a line with only * on it. 
-	 * If so, we are tracking all functions.
-	 */
-	if(name.compare("*") == 0)
+	istringstream words(line);
+	string kind, first, second;
+
+	words >> kind >> first >> second;
+	if(kind.compare("symbol") == 0 && first.length() > 0 && second.length() == 0)
+	    wl->symbols.insert(first);
+	else if(kind.compare("range") == 0 && first.length() > 0 && second.length() > 0)
 	{
-	    if(mode == TRACKED)
-	    {
-		selective = false;
-		continue;
-	    }
-	    else if(mode == ALLOC)
+	    char *end;
+	    ADDRINT base = strtoull(first.c_str(), &end, 0);
+	    bool ok = *end == '\0';
+	    ADDRINT size;
+
+	    if(second[0] == '+')
+		size = strtoull(second.c_str() + 1, &end, 0);
+	    else
+		size = strtoull(second.c_str(), &end, 0) - base;
+	    if(!ok || *end != '\0' || size == 0 || size > ~base)
 	    {
-		cerr << "Found a line with '*' and nothing else on it. "
-		    "This makes no sense in the allocation function "
-		    "config file. Please read the documentation on the "
-		    "correct format." << endl;
+		cerr << "Bad address range \"" << line << "\" in " << fname << endl;
 		exit(-1);
 	    }
+	    ranges.push_back(make_pair(base, size));
+	}
+	else
+	{
+	    cerr << "Don't understand \"" << line << "\" in " << fname
+		 << ". Please use \"symbol <name>\" or "
+		 << "\"range <start> <end>|+<size>\"." << endl;
+	    exit(-1);
 	}
-	
-	list.push_back(name);
     }
 
-    f.close();
-    
-    if(list.size() == 0)
+    if(wl->symbols.empty() && ranges.empty())
     {
-	if(mode == TRACKED && selective)
+	cerr << "Nothing to watch in file " << fname << endl;
+	exit(-1);
+    }
+
+    /* A symbol takes a range once it is found */
+    if(wl->symbols.size() + ranges.size() > WATCH_INLINE_RANGES)
+	watchedLines = new ShadowBitmap();
+
+    watchList = wl;
+    for(pair<ADDRINT, ADDRINT> &r: ranges)
+	addWatchedRange(r.first, r.second);
+}
+
+/* ===================================================================== */
+/* Parse the file of allocations to record the accesses to (-sel).       */
+/* Every line is "site <file>[:<line>]", "var <name>" or "type <name>".  */
+/* ===================================================================== */
+
+AllocSelection *parseAllocSelection(const char *fname)
+{
+    AllocSelection *sel = new AllocSelection();
+    ifstream f(fname);
+
+    if(f.fail())
+    {
+	cerr << "Failed to open required file " << fname << endl;
+	exit(-1);
+    }
+
+    string line;
+    while(getline(f, line))
+    {
+	/* Lines beginning with a # are to be ignored */
+	if(line.find("#") == 0)
+	    continue;
+
+	trim(line);
+	if(line.length() == 0)
+	    continue;
+
+	size_t space = line.find_first_of(" \t");
+	string kind = line.substr(0, space);
+	string name = space == string::npos ? "" : line.substr(space + 1);
+
+	trim(name);
+	if(name.length() == 0)
 	{
-	    cerr << "No function names in file " << fname << 
-		" and no line with '*'. " 
-		"Please specify what you want to track. " << endl;
+	    cerr << "Missing name in line \"" << line << "\" of " << fname << endl;
 	    exit(-1);
 	}
+
+	if(kind.compare("site") == 0)
+	    sel->sites.push_back(name);
+	else if(kind.compare("var") == 0)
+	    sel->vars.push_back(name);
+	else if(kind.compare("type") == 0)
+	    sel->types.push_back(name);
 	else
-	    return false;
-    }
-    else
-    {
-	if(mode == TRACKED && !selective)
 	{
-	    cerr << "There appear to be names of function to track "
-		"in file " << fname << " as well as a line with '*'. "
-		"Don't understand if you want to track everything or just "
-		"selected functions. " << endl;
+	    cerr << "Unknown selection \"" << kind << "\" in " << fname
+		 << ". Please use site, var or type." << endl;
 	    exit(-1);
 	}
-	else
-	    return true;
     }
+
+    if(sel->sites.empty() && sel->vars.empty() && sel->types.empty())
+    {
+	cerr << "No allocations selected in file " << fname << endl;
+	exit(-1);
+    }
+    return sel;
 }
 
 
@@ -1536,6 +3151,18 @@ VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
      */
     get_and_refresh_thread_stacks(getpid(), syscall(SYS_gettid));
 
+    /* After attaching, the threads may have been running for a while */
+    if(attached && !threadStacks[threadid])
+    {
+	Stack *stack = get_stack_containing(getpid(), syscall(SYS_gettid),
+					    PIN_GetContextReg(ctxt, REG_STACK_PTR));
+
+	threadStacks[threadid] = stack;
+	if(stack)
+	    cerr << "Stack " << *stack << " found around the stack pointer of thread "
+		 << threadid << endl;
+    }
+
     /* Thread IDs are monotonically increasing and are not reused
      * if a thread exits. */
     largestUnusedThreadID = threadid+1;
@@ -1551,6 +3178,35 @@ VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
     /* A thread is not in an alloc func when it starts */
     inAlloc.push_back(false);
 
+    if(fieldHeatmap)
+    {
+	if(heatThreads[threadid] == NULL)
+	    heatThreads[threadid] = new HeatThread();
+    }
+
+    if(packedOutput)
+    {
+	if(packedBuffers[threadid] == NULL)
+	{
+	    packedBuffers[threadid] = new PackedThreadBuffer();
+	    packedBuffers[threadid]->accesses.reserve(PACKED_BLOCK_ACCESSES);
+	}
+    }
+
+    if(packedPerThread)
+    {
+	string fname = KnobPackedFile.Value() + "." + to_string(threadid);
+	FILE *file = fopen(fname.c_str(), "w");
+
+	if(file == NULL)
+	{
+	    cerr << "Failed to create file " << fname << endl;
+	    exit(-1);
+	}
+	fwrite(PACKED_MAGIC, 1, PACKED_MAGIC_LEN, file);
+	packedBuffers[threadid]->file = file;
+    }
+
     for(FuncRecord *fr: funcRecords)
     {
 	while(fr->thrAllocData->size() < (threadid + 1))
@@ -1571,12 +3227,58 @@ VOID ThreadFini(THREADID threadid, const CONTEXT *ctxt, INT32 code, VOID *v)
     cout << "Thread " << threadid << " [" << syscall(SYS_gettid)<< "] is exiting " << endl;
 
     threadStacks[threadid] = 0;
+
+    if(packedOutput)
+	flushPackedBuffer(threadid);
 }
 
 
 VOID Fini(INT32 code, VOID *v)
 {
+    if(columnarTrace && !columnarTrace->close())
+	cerr << "Failed to write the columnar trace to "
+	     << KnobColumnarFile.Value() << endl;
+
+    if(packedOutput)
+    {
+	for(THREADID tid = 0; tid < packedBuffers.size(); tid++)
+	{
+	    if(packedBuffers[tid] == NULL)
+		continue;
+	    flushPackedBuffer(tid);
+	    if(packedBuffers[tid]->file && fclose(packedBuffers[tid]->file) != 0)
+		cerr << "Failed to write the packed trace to "
+		     << KnobPackedFile.Value() << "." << tid << endl;
+	}
+	if(packedTrace && fclose(packedTrace) != 0)
+	    cerr << "Failed to write the packed trace to "
+		 << KnobPackedFile.Value() << endl;
+    }
+
+    if(watchList)
+    {
+	for(const string &name: watchList->symbols)
+	    cerr << "Warning: did not find the watched variable " << name << endl;
+    }
+
+    if(fieldHeatmap)
+	writeHeatmap(KnobHeatmapFile.Value().c_str());
+
+    PROFILE_PRINT(cerr);
+
     cout << "PR DONE" << endl;
+
+    if(framedTrace)
+    {
+	if(!framedTrace->close())
+	    cerr << "Failed to write the trace to "
+		 << KnobOutputFile.Value() << endl;
+    }
+    else if(traceFile.is_open())
+	traceFile.close();
+
+    if(traceIndex && !traceIndex->close())
+	cerr << "Failed to write the index of the trace" << endl;
 }
 
 
@@ -1595,6 +3297,74 @@ int main(int argc, char *argv[])
     }    
     
     PIN_InitLock(&lock);
+    publishAllocations();
+
+    if(KnobPerThreadFiles && (KnobPackedFile.Value().length() == 0 || KnobIndexTrace))
+    {
+	cerr << "Per-thread files (-pt) need a packed trace (-b), "
+	     << "and can't be indexed (-i)" << endl;
+	return Usage();
+    }
+
+    if(KnobIndexTrace)
+    {
+	string indexed = KnobPackedFile.Value().length() > 0 ?
+	    KnobPackedFile.Value() : KnobOutputFile.Value();
+
+	if(indexed.length() == 0)
+	{
+	    cerr << "The index (-i) needs a trace file (-o or -b)" << endl;
+	    return Usage();
+	}
+
+	traceIndex = new TraceIndexWriter();
+	if(!traceIndex->open(indexed))
+	{
+	    cerr << "Failed to create file " << indexed << INDEX_SUFFIX << endl;
+	    exit(-1);
+	}
+    }
+
+    if(KnobOutputFile.Value().length() > 0)
+    {
+	/* The text trace needs to be written in frames to be indexed */
+	bool indexText = traceIndex && KnobPackedFile.Value().length() == 0;
+
+	if(KnobCompressTrace || indexText)
+	{
+	    if(KnobCompressionThreads < 1)
+	    {
+		cerr << "Need at least one thread to compress the trace" << endl;
+		return Usage();
+	    }
+
+	    framedTrace = new FramedTraceBuf();
+	    if(!framedTrace->open(KnobOutputFile.Value().c_str(),
+				  KnobCompressionThreads, KnobCompressTrace,
+				  indexText ? traceIndex : NULL))
+	    {
+		cerr << "Failed to create file " << KnobOutputFile.Value() << endl;
+		exit(-1);
+	    }
+	    cout.rdbuf(framedTrace);
+	    PIN_AddPrepareForFiniFunction(PrepareTraceForFini, 0);
+	}
+	else
+	{
+	    traceFile.open(KnobOutputFile.Value().c_str());
+	    if(!traceFile.is_open())
+	    {
+		cerr << "Failed to create file " << KnobOutputFile.Value() << endl;
+		exit(-1);
+	    }
+	    cout.rdbuf(traceFile.rdbuf());
+	}
+    }
+    else if(KnobCompressTrace)
+    {
+	cerr << "Compression (-z) needs an output file (-o)" << endl;
+	return Usage();
+    }
 
     /* If the user wants to trace only the specific function (and whatever is
      * called from them), they would provide a list of functions of interest. 
@@ -1606,6 +3376,103 @@ int main(int argc, char *argv[])
     parseFunctionList(KnobAllocFuncsFile.Value().c_str(), AllocFuncsList, ALLOC);
     parseAllocFuncsProto(AllocFuncsList);
 
+    if(KnobSelectionFile.Value().length() > 0)
+    {
+	allocSelection = parseAllocSelection(KnobSelectionFile.Value().c_str());
+	selectedLines = new ShadowBitmap();
+	accessFilter = (AFUNPTR)isSelectedLine;
+    }
+
+    if(KnobWatchFile.Value().length() > 0)
+    {
+	if(allocSelection)
+	{
+	    cerr << "Please choose either allocations (-sel) or memory to watch (-w)" << endl;
+	    return Usage();
+	}
+	parseWatchList(KnobWatchFile.Value().c_str());
+	accessFilter = watchedLines ? (AFUNPTR)isWatchedLine : (AFUNPTR)isWatchedAddress;
+    }
+
+    if(KnobColumnarFile.Value().length() > 0 && KnobPackedFile.Value().length() > 0)
+    {
+	cerr << "Please choose either the columnar (-c) or the packed (-b) format" << endl;
+	return Usage();
+    }
+
+    if(KnobHeatmapFile.Value().length() > 0)
+    {
+	if(KnobColumnarFile.Value().length() > 0 || KnobPackedFile.Value().length() > 0
+	   || watchList)
+	{
+	    cerr << "The heatmap (-heat) replaces the trace of the accesses, and "
+		 << "counts the fields of allocations: it can't be combined with "
+		 << "-c, -b or -w" << endl;
+	    return Usage();
+	}
+	if(KnobHeatmapWindow.Value() == 0)
+	{
+	    cerr << "The co-access window (-heatw) must be at least 1" << endl;
+	    return Usage();
+	}
+	fieldHeatmap = true;
+	heatThreads.resize(PIN_MAX_THREADS, NULL);
+    }
+
+    if(KnobPackedFile.Value().length() > 0)
+    {
+	PIN_InitLock(&packedLock);
+	packedOutput = true;
+	packedPerThread = KnobPerThreadFiles;
+	packedBuffers.resize(PIN_MAX_THREADS, NULL);
+	if(!packedPerThread)
+	{
+	    packedTrace = fopen(KnobPackedFile.Value().c_str(), "w");
+	    if(packedTrace == NULL)
+	    {
+		cerr << "Failed to create file " << KnobPackedFile.Value() << endl;
+		exit(-1);
+	    }
+	    fwrite(PACKED_MAGIC, 1, PACKED_MAGIC_LEN, packedTrace);
+	}
+	traceStartTime = indexClock();
+
+	/* Variable 0 stands for no variable */
+	packedVariables.id("");
+	packedVariableDefs.push_back("");
+    }
+
+    if(KnobColumnarFile.Value().length() > 0)
+    {
+	columnarTrace = new ColumnarWriter();
+	if(!columnarTrace->open(KnobColumnarFile.Value().c_str()))
+	{
+	    cerr << "Failed to create file " << KnobColumnarFile.Value() << endl;
+	    exit(-1);
+	}
+    }
+
+    /* When attaching, main() won't be called, so start right away */
+    attached = PIN_IsAttaching();
+    if(attached)
+	startAttached();
+    else if(KnobHeapSnapshot.Value().length() > 0)
+    {
+	cerr << "The heap snapshot (-heap) is only for attaching (pin -pid)" << endl;
+	return Usage();
+    }
+
+    if(KnobControlPipe.Value().length() > 0)
+    {
+	recordingOn = !KnobStartIdle;
+	startControl(KnobControlPipe.Value().c_str());
+    }
+    else if(KnobStartIdle)
+    {
+	cerr << "Starting idle (-idle) needs a control pipe (-ctl)" << endl;
+	return Usage();
+    }
+
     /* Instrument all functions to output when they begin and end */
     RTN_AddInstrumentFunction(instrumentRoutine, 0);
 
@@ -1833,6 +3700,92 @@ get_process_stack(pid_t pid)
 
 
 
+/* Parse a line of /proc/<pid>/maps:
+ * "<start>-<end> <perms> <offset> <dev> <inode> [<path>]"
+ */
+bool
+parse_maps_line(const string &line, size_t *start, size_t *end,
+		string *perms, string *path)
+{
+    istringstream fields(line);
+    string range, offset, dev, inode;
+    char *end_ptr = 0;
+
+    if(!(fields >> range >> *perms >> offset >> dev >> inode))
+	return false;
+    getline(fields, *path);
+    trim(*path);
+
+    *start = strtoull(range.c_str(), &end_ptr, 16);
+    if(!end_ptr || end_ptr[0] != '-')
+	return false;
+    *end = strtoull(end_ptr + 1, NULL, 16);
+    return true;
+}
+
+/* Find the stack of a thread that is already running, as the mapping
+ * that its stack pointer is in. /proc only labels the stack of the
+ * main thread.
+ */
+Stack*
+get_stack_containing(pid_t pid, pid_t tid, ADDRINT sp)
+{
+    stringstream maps_name;
+    maps_name << "/proc/" << pid << "/maps";
+
+    ifstream maps(maps_name.str().c_str());
+    string line;
+
+    while(getline(maps, line))
+    {
+	size_t start, end;
+	string perms, path;
+
+	if(parse_maps_line(line, &start, &end, &perms, &path)
+	   && sp >= start && sp < end)
+	    return new Stack(start, end, tid);
+    }
+    return NULL;
+}
+
+/* Remember the heap and the anonymous writable mappings of the process,
+ * for the accesses to the memory allocated before we attached.
+ */
+void
+get_pre_attach_memory(pid_t pid)
+{
+    stringstream maps_name;
+    maps_name << "/proc/" << pid << "/maps";
+
+    ifstream maps(maps_name.str().c_str());
+    string line;
+
+    if(!maps.is_open())
+    {
+	cerr << "Could not read " << maps_name.str() << endl;
+	return;
+    }
+
+    while(getline(maps, line))
+    {
+	size_t start, end;
+	string perms, path;
+
+	if(!parse_maps_line(line, &start, &end, &perms, &path)
+	   || perms.compare(0, 2, "rw") != 0)
+	    continue;
+
+	if(path.compare("[heap]") == 0 || path.length() == 0)
+	{
+	    string name = path.length() ? path : "[anon]";
+
+	    preAttachMemory.insert(make_pair(MemoryRange(start, end - start), name));
+	    cerr << "Pre-attach memory " << name << ": 0x" << hex << start
+		 << "-0x" << end << dec << endl;
+	}
+    }
+}
+
 /* ===================================================================== */
 /* eof */
 /* ===================================================================== */
@@ -0,0 +1,25 @@
+/*
+ * A Pin tool that does nothing. Running a program under it measures the
+ * cost of Pin itself, which the benchmarks (see benchmarks/) subtract
+ * from memtracker's to see what memtracker adds.
+ */
+#include "pin.H"
+#include <iostream>
+
+using namespace std;
+
+INT32 Usage()
+{
+    cerr << "This tool runs the program under Pin without instrumenting it." << endl;
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    if(PIN_Init(argc, argv))
+	return Usage();
+
+    // Never returns
+    PIN_StartProgram();
+    return 0;
+}
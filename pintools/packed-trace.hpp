@@ -0,0 +1,426 @@
+/*
+ * The packed trace format, a compact binary encoding of the memory
+ * access records, written by memtracker (-b) and read by the tools in
+ * analysis-tools.
+ *
+ * memtracker collects the accesses of every thread in a per-thread
+ * buffer and encodes the buffer as a block when it fills up, outside of
+ * the global lock. Consecutive accesses of a thread usually come from
+ * the same site, with the same size and type, and touch addresses a few
+ * bytes or a stride apart from the previous access of that site. So a
+ * block is a sequence of runs of accesses that share the site, the
+ * variable, the size and the type, and every access in a run is stored
+ * as the difference from the previous address accessed from the same
+ * site, as a zig-zag varint. The addresses are reset at the beginning of
+ * every block, so blocks can be decoded on their own.
+ *
+ * Every access also has a timestamp, stored as the zig-zag difference
+ * from the timestamp of the previous access in the block. Since blocks
+ * are written when they fill up, the accesses of different threads are
+ * interleaved in the file only at the granularity of blocks, and it is
+ * the timestamps that give their order. memtracker uses the time stamp
+ * counter of the processor, which is cheap to read and, on the processors
+ * Pin runs on, synchronized across the cores.
+ *
+ * To let a reader put the accesses back in order without reading the
+ * whole trace first, memtracker periodically writes an epoch marker with
+ * a watermark: every access with an earlier timestamp is in a block that
+ * precedes the marker. The marker also pairs the timestamp counter with
+ * the wall-clock time, in microseconds since the start of the trace.
+ *
+ * Sites and variables are referred to by ID. The strings are defined
+ * by records that precede the first block using them. The IDs are the
+ * same in all the per-thread traces of a run (memtracker -pt), so a
+ * per-thread trace only defines the ones its thread uses.
+ *
+ * File layout (all integers are varints):
+ *
+ *   "\x8aMTP"
+ *   'S' site ID, function, source location
+ *   'V' variable ID, variable ("<alloc source> <name>[-><field>] <type>")
+ *   'B' thread ID, number of accesses, length of the block body,
+ *       runs: number of accesses, site ID, variable ID, size << 1 | is write,
+ *             address and timestamp deltas of every access
+ *   'E' timestamp, wall-clock time, watermark
+ *   ...
+ *
+ * Variable ID 0 is reserved for accesses to memory that was
+ * not allocated by any of the allocation functions we track.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "varint.hpp"
+
+#define PACKED_MAGIC "\x8aMTP"
+#define PACKED_MAGIC_LEN 4
+
+#define TAG_SITE 'S'
+#define TAG_VARIABLE 'V'
+#define TAG_BLOCK 'B'
+#define TAG_EPOCH 'E'
+
+/* Blocks larger than this must be corrupt */
+#define MAX_BLOCK_SIZE (64 * 1024 * 1024)
+
+/* And so must be IDs larger than this */
+#define MAX_DEFINITION_ID (16 * 1024 * 1024)
+
+class PackedAccess
+{
+public:
+    uint64_t address;
+    uint64_t time;
+    uint32_t siteId;
+    uint32_t varId;
+    uint32_t size;
+    bool isWrite;
+};
+
+inline void encodeSite(uint64_t id, const std::string &function,
+		       const std::string &source, std::string &rec)
+{
+    rec.clear();
+    rec.push_back(TAG_SITE);
+    putVarint(rec, id);
+    putString(rec, function);
+    putString(rec, source);
+}
+
+inline void encodeVariable(uint64_t id, const std::string &var, std::string &rec)
+{
+    rec.clear();
+    rec.push_back(TAG_VARIABLE);
+    putVarint(rec, id);
+    putString(rec, var);
+}
+
+inline void encodeEpoch(uint64_t timestamp, uint64_t wallTime, uint64_t watermark,
+			std::string &rec)
+{
+    rec.clear();
+    rec.push_back(TAG_EPOCH);
+    putVarint(rec, timestamp);
+    putVarint(rec, wallTime);
+    putVarint(rec, watermark);
+}
+
+class PackedEncoder
+{
+public:
+    /* Encode the accesses of a thread as a block */
+    void encodeBlock(uint64_t tid, const std::vector<PackedAccess> &accesses,
+		     std::string &block)
+	{
+	    uint64_t lastTime = 0;
+
+	    body.clear();
+	    lastAddress.clear();
+
+	    for(size_t i = 0; i < accesses.size(); )
+	    {
+		const PackedAccess &first = accesses[i];
+		size_t run = 1;
+
+		while(i + run < accesses.size() && sameRun(first, accesses[i + run]))
+		    run++;
+
+		putVarint(body, run);
+		putVarint(body, first.siteId);
+		putVarint(body, first.varId);
+		putVarint(body, (uint64_t)first.size << 1 | (first.isWrite ? 1 : 0));
+
+		uint64_t &last = lastAddress[first.siteId];
+		for(size_t j = i; j < i + run; j++)
+		{
+		    putVarint(body, zigzag((int64_t)(accesses[j].address - last)));
+		    putVarint(body, zigzag((int64_t)(accesses[j].time - lastTime)));
+		    last = accesses[j].address;
+		    lastTime = accesses[j].time;
+		}
+		i += run;
+	    }
+
+	    block.clear();
+	    block.push_back(TAG_BLOCK);
+	    putVarint(block, tid);
+	    putVarint(block, accesses.size());
+	    putVarint(block, body.length());
+	    block += body;
+	}
+
+private:
+    std::string body;
+    std::unordered_map<uint32_t, uint64_t> lastAddress;
+
+    static bool sameRun(const PackedAccess &a, const PackedAccess &b)
+	{
+	    return a.siteId == b.siteId && a.varId == b.varId
+		&& a.size == b.size && a.isWrite == b.isWrite;
+	}
+};
+
+/* Decode the body of a block of numAccesses accesses.
+ * Return false if the block is corrupt.
+ */
+inline bool decodeBlock(const uint8_t *p, const uint8_t *end, uint64_t numAccesses,
+			std::vector<PackedAccess> &accesses)
+{
+    std::unordered_map<uint32_t, uint64_t> lastAddress;
+    uint64_t run, siteId, varId, sizeAndType, delta, timeDelta;
+    uint64_t lastTime = 0;
+
+    accesses.clear();
+    while(accesses.size() < numAccesses)
+    {
+	if(!getVarint(p, end, run) || !getVarint(p, end, siteId)
+	   || !getVarint(p, end, varId) || !getVarint(p, end, sizeAndType)
+	   || run == 0 || run > numAccesses - accesses.size())
+	    return false;
+
+	PackedAccess pa;
+	pa.siteId = siteId;
+	pa.varId = varId;
+	pa.size = sizeAndType >> 1;
+	pa.isWrite = sizeAndType & 1;
+
+	uint64_t &last = lastAddress[siteId];
+	for(uint64_t i = 0; i < run; i++)
+	{
+	    if(!getVarint(p, end, delta) || !getVarint(p, end, timeDelta))
+		return false;
+	    last += (uint64_t)unzigzag(delta);
+	    lastTime += (uint64_t)unzigzag(timeDelta);
+	    pa.address = last;
+	    pa.time = lastTime;
+	    accesses.push_back(pa);
+	}
+    }
+    return p == end;
+}
+
+/* Reads a packed trace block by block */
+class PackedReader
+{
+public:
+    PackedReader(std::istream &in)
+	: in(in), corrupt(false), numAccesses(0), length(0), lastWatermark(0),
+	  variables(1) {}
+
+    /* Check the magic. Return false if this is not a packed trace. */
+    bool start()
+	{
+	    char magic[PACKED_MAGIC_LEN];
+
+	    return in.read(magic, PACKED_MAGIC_LEN)
+		&& std::string(magic, PACKED_MAGIC_LEN).compare(PACKED_MAGIC) == 0;
+	}
+
+    /* Read the next block of accesses, and the site and variable
+     * definitions before it. Return false at the end of the trace.
+     */
+    bool next(uint64_t &tid, std::vector<PackedAccess> &accesses)
+	{
+	    uint64_t n;
+
+	    return nextBlock(tid, n) && readBlock(accesses);
+	}
+
+    /* Read the definitions and the header of the next block, which
+     * must then be read with readBlock() or skipped with skipBlock().
+     * Return false at the end of the trace.
+     */
+    bool nextBlock(uint64_t &tid, uint64_t &numAccesses)
+	{
+	    int tag;
+
+	    while((tag = in.get()) != EOF)
+	    {
+		bool ok;
+
+		if(tag == TAG_BLOCK)
+		{
+		    ok = readVarint(in, tid) && readVarint(in, this->numAccesses)
+			&& readVarint(in, length) && length <= MAX_BLOCK_SIZE;
+		    numAccesses = this->numAccesses;
+		    if(ok)
+			return true;
+		}
+		else if(tag == TAG_EPOCH)
+		{
+		    uint64_t timestamp, wallTime;
+
+		    ok = readVarint(in, timestamp) && readVarint(in, wallTime)
+			&& readVarint(in, lastWatermark);
+		}
+		else
+		    ok = readDefinition(in, tag);
+
+		if(!ok)
+		{
+		    corrupt = true;
+		    return false;
+		}
+	    }
+	    return false;
+	}
+
+    bool readBlock(std::vector<PackedAccess> &accesses)
+	{
+	    buf.resize(length);
+	    if((length == 0 || in.read(&buf[0], length))
+	       && decodeBlock((const uint8_t*)buf.data(),
+			      (const uint8_t*)buf.data() + length,
+			      numAccesses, accesses)
+	       && checkIds(accesses))
+		return true;
+
+	    corrupt = true;
+	    return false;
+	}
+
+    bool skipBlock()
+	{
+	    if(in.ignore(length) && (uint64_t)in.gcount() == length)
+		return true;
+
+	    corrupt = true;
+	    return false;
+	}
+
+    /* Read the site or variable definition that follows the tag.
+     * Definitions can also come from the index of the trace.
+     */
+    bool readDefinition(std::istream &defs, int tag)
+	{
+	    uint64_t id;
+
+	    switch(tag)
+	    {
+	    case TAG_SITE:
+		if(!readVarint(defs, id) || id >= MAX_DEFINITION_ID)
+		    return false;
+		if(id >= sites.size())
+		    sites.resize(id + 1);
+		return readString(defs, sites[id].function, MAX_BLOCK_SIZE)
+		    && readString(defs, sites[id].source, MAX_BLOCK_SIZE);
+	    case TAG_VARIABLE:
+		if(!readVarint(defs, id) || id >= MAX_DEFINITION_ID)
+		    return false;
+		if(id >= variables.size())
+		    variables.resize(id + 1);
+		return readString(defs, variables[id], MAX_BLOCK_SIZE);
+	    default:
+		return false;
+	    }
+	}
+
+    /* Every access with an earlier timestamp has been read */
+    uint64_t watermark() const
+	{
+	    return lastWatermark;
+	}
+
+    /* Did we find a truncated or corrupt record? */
+    bool failed() const
+	{
+	    return corrupt;
+	}
+
+    /* The access in the text format of the trace, without the newline */
+    std::string text(uint64_t tid, const PackedAccess &pa) const
+	{
+	    char address[32];
+	    const Site &site = sites[pa.siteId];
+	    std::string line = pa.isWrite ? "write: " : "read: ";
+
+	    snprintf(address, sizeof(address), "0x%016llx", (unsigned long long)pa.address);
+	    line += std::to_string(tid) + " " + address + " " + std::to_string(pa.size)
+		+ " " + site.function + " " + site.source;
+	    if(pa.varId != 0)
+		line += " " + variables[pa.varId];
+	    return line;
+	}
+
+private:
+    class Site
+    {
+    public:
+	std::string function;
+	std::string source;
+    };
+
+    std::istream &in;
+    bool corrupt;
+    uint64_t numAccesses, length;  /* of the current block */
+    uint64_t lastWatermark;
+    std::string buf;
+    std::vector<Site> sites;
+    std::vector<std::string> variables;
+
+    /* Every access must refer to a site and a variable defined before */
+    bool checkIds(const std::vector<PackedAccess> &accesses) const
+	{
+	    for(const PackedAccess &pa: accesses)
+		if(pa.siteId >= sites.size() || (pa.varId != 0 && pa.varId >= variables.size()))
+		    return false;
+	    return true;
+	}
+};
+
+/* Puts the accesses of the blocks of a packed trace back in the order of
+ * their timestamps. The accesses of every thread are already in order, so
+ * this is a k-way merge of the threads, on a heap of the oldest access of
+ * every thread.
+ */
+class TimeOrder
+{
+public:
+    /* Add the accesses of a block */
+    void add(uint64_t tid, const std::vector<PackedAccess> &accesses)
+	{
+	    std::deque<PackedAccess> &q = queues[tid];
+
+	    if(accesses.empty())
+		return;
+	    if(q.empty())
+		heads.push(Head(accesses[0].time, tid));
+	    q.insert(q.end(), accesses.begin(), accesses.end());
+	}
+
+    /* Take out the oldest access, if it is older than the watermark.
+     * Return false if there is none.
+     */
+    bool next(uint64_t watermark, uint64_t &tid, PackedAccess &pa)
+	{
+	    if(heads.empty() || heads.top().first >= watermark)
+		return false;
+
+	    tid = heads.top().second;
+	    heads.pop();
+
+	    std::deque<PackedAccess> &q = queues[tid];
+	    pa = q.front();
+	    q.pop_front();
+	    if(!q.empty())
+		heads.push(Head(q.front().time, tid));
+	    return true;
+	}
+
+    static const uint64_t ALL = ~(uint64_t)0;
+
+private:
+    typedef std::pair<uint64_t, uint64_t> Head;  /* timestamp, thread */
+
+    std::unordered_map<uint64_t, std::deque<PackedAccess>> queues;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+};
@@ -0,0 +1,147 @@
+/*
+ * Self-profiling of memtracker: how many times every thread went through
+ * the expensive phases of the analysis routines, and how many cycles it
+ * spent in them and waiting for the global lock. memtracker prints the
+ * counters when the application exits, and every -profi million recorded
+ * accesses if asked to.
+ *
+ * The profiling is compiled in only with -DMEMTRACKER_PROFILE (make
+ * PROFILE=1). Otherwise the macros below expand to nothing, or to plain
+ * PIN_GetLock, and cost nothing.
+ */
+#pragma once
+
+#include "pin.H"
+
+#ifdef MEMTRACKER_PROFILE
+
+#include <iomanip>
+#include <iostream>
+
+enum profile_phase_t
+{
+    PHASE_SOURCE_LOCATION,   /* PIN_GetSourceLocation */
+    PHASE_ALLOCMAP_FIND,     /* allocmap.find */
+    PHASE_FIELD_NAME,        /* VarInfo::fieldname */
+    PHASE_ALLOC_VAR_NAME,    /* findAllocVarName */
+    PHASE_OUTPUT,            /* writing the access records */
+    PHASE_LOCK_WAIT,         /* waiting for the global lock */
+    NUM_PROFILE_PHASES
+};
+
+static const char *profilePhaseNames[NUM_PROFILE_PHASES] =
+{
+    "source location", "allocmap find", "field name", "alloc var name",
+    "output", "lock wait"
+};
+
+/* Threads beyond this share the counters of the last one */
+#define PROFILE_MAX_THREADS 256
+
+/* The counters of a thread, on cache lines of their own */
+class PhaseCounters
+{
+public:
+    UINT64 count[NUM_PROFILE_PHASES];
+    UINT64 cycles[NUM_PROFILE_PHASES];
+} __attribute__((aligned(64)));
+
+static PhaseCounters profileCounters[PROFILE_MAX_THREADS];
+
+static inline UINT64 profileClock()
+{
+    UINT32 lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return (UINT64)hi << 32 | lo;
+}
+
+/* Counts the phase, and the cycles until the end of the scope */
+class PhaseTimer
+{
+public:
+    PhaseTimer(profile_phase_t phase)
+	: phase(phase), start(profileClock()) {}
+
+    ~PhaseTimer()
+	{
+	    THREADID tid = PIN_ThreadId();
+	    PhaseCounters &c = profileCounters[tid < PROFILE_MAX_THREADS ?
+					       tid : PROFILE_MAX_THREADS - 1];
+
+	    c.count[phase]++;
+	    c.cycles[phase] += profileClock() - start;
+	}
+
+private:
+    profile_phase_t phase;
+    UINT64 start;
+};
+
+inline void profiledGetLock(PIN_LOCK *lock, INT32 owner)
+{
+    PhaseTimer timer(PHASE_LOCK_WAIT);
+
+    PIN_GetLock(lock, owner);
+}
+
+/* The totals of every phase, and the cycles of every thread that did
+ * anything. The counters of the other threads may be changing, so the
+ * numbers are approximate until the application exits.
+ */
+inline void printProfile(std::ostream &out)
+{
+    PhaseCounters total = PhaseCounters();
+
+    out << "memtracker profile:" << std::endl;
+    out << "  " << std::setw(16) << std::left << "phase" << std::right
+	<< std::setw(14) << "count" << std::setw(18) << "cycles"
+	<< std::setw(12) << "cycles/op" << std::endl;
+
+    for(int t = 0; t < PROFILE_MAX_THREADS; t++)
+	for(int p = 0; p < NUM_PROFILE_PHASES; p++)
+	{
+	    total.count[p] += profileCounters[t].count[p];
+	    total.cycles[p] += profileCounters[t].cycles[p];
+	}
+
+    for(int p = 0; p < NUM_PROFILE_PHASES; p++)
+	out << "  " << std::setw(16) << std::left << profilePhaseNames[p] << std::right
+	    << std::setw(14) << total.count[p] << std::setw(18) << total.cycles[p]
+	    << std::setw(12) << (total.count[p] ? total.cycles[p] / total.count[p] : 0)
+	    << std::endl;
+
+    for(int t = 0; t < PROFILE_MAX_THREADS; t++)
+    {
+	UINT64 cycles = 0;
+
+	for(int p = 0; p < NUM_PROFILE_PHASES; p++)
+	    cycles += profileCounters[t].cycles[p];
+	if(cycles == 0)
+	    continue;
+
+	out << "  thread " << t << ": " << cycles << " cycles, "
+	    << profileCounters[t].cycles[PHASE_LOCK_WAIT] << " waiting for the lock"
+	    << std::endl;
+    }
+}
+
+#define PROFILE_PHASE(phase) PhaseTimer profilePhaseTimer(phase)
+#define PROFILE_GET_LOCK(lock, owner) profiledGetLock(lock, owner)
+#define PROFILE_PRINT(out) printProfile(out)
+
+/* Print the profile every interval million events, as counted by count */
+#define PROFILE_PERIODIC(count, interval, out)				\
+    do {								\
+	if((interval) > 0 && (count) % ((UINT64)(interval) * 1000000) == 0) \
+	    printProfile(out);						\
+    } while(0)
+
+#else
+
+#define PROFILE_PHASE(phase)
+#define PROFILE_GET_LOCK(lock, owner) PIN_GetLock(lock, owner)
+#define PROFILE_PRINT(out)
+#define PROFILE_PERIODIC(count, interval, out)
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * A shadow bitmap of the address space, with a bit for every 64-byte
+ * line, that memtracker uses to reject the accesses it doesn't need to
+ * record before calling into the analysis routine. The test is an
+ * inlinable Pin If routine: two loads and a few shifts, with no branches.
+ *
+ * The bitmap has two levels. The top level has a pointer for every 1GB
+ * of a 47-bit address space, and the chunks of the second level have a
+ * bit for every line of that 1GB. Chunks are allocated when something in
+ * them is marked. Until then the pointers point to a shared chunk of
+ * zeroes, so the test never needs to check for a missing chunk.
+ *
+ * Bits are only ever set, by one thread at a time (memtracker marks lines
+ * with its lock held), and the test may race with marking. Marking is an
+ * over-approximation anyway: memtracker checks every access that passes
+ * the test against the allocations or the ranges it was asked for.
+ */
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pin.H"
+
+#define SHADOW_LINE_BITS 6
+#define SHADOW_CHUNK_BITS 30
+#define SHADOW_TOP_ENTRIES (1 << (47 - SHADOW_CHUNK_BITS))
+#define SHADOW_CHUNK_BYTES (1 << (SHADOW_CHUNK_BITS - SHADOW_LINE_BITS - 3))
+
+class ShadowBitmap
+{
+public:
+    ShadowBitmap()
+	{
+	    zeroes = (UINT8*)calloc(SHADOW_CHUNK_BYTES, 1);
+	    for(int i = 0; i < SHADOW_TOP_ENTRIES; i++)
+		top[i] = zeroes;
+	}
+
+    /* Mark the lines of [base, base + size) */
+    void mark(ADDRINT base, ADDRINT size)
+	{
+	    if(size == 0)
+		size = 1;
+	    for(ADDRINT line = base >> SHADOW_LINE_BITS;
+		line <= (base + size - 1) >> SHADOW_LINE_BITS; line++)
+	    {
+		UINT8 *&chunk = top[(line >> (SHADOW_CHUNK_BITS - SHADOW_LINE_BITS))
+				    & (SHADOW_TOP_ENTRIES - 1)];
+		ADDRINT bit = line & ((1 << (SHADOW_CHUNK_BITS - SHADOW_LINE_BITS)) - 1);
+
+		if(chunk == zeroes)
+		    chunk = (UINT8*)calloc(SHADOW_CHUNK_BYTES, 1);
+		chunk[bit >> 3] |= 1 << (bit & 7);
+	    }
+	}
+
+    /* Is the line of addr marked? */
+    ADDRINT test(ADDRINT addr) const
+	{
+	    const UINT8 *chunk = top[(addr >> SHADOW_CHUNK_BITS) & (SHADOW_TOP_ENTRIES - 1)];
+
+	    return (chunk[(addr >> (SHADOW_LINE_BITS + 3)) & (SHADOW_CHUNK_BYTES - 1)]
+		    >> ((addr >> SHADOW_LINE_BITS) & 7)) & 1;
+	}
+
+private:
+    UINT8 *top[SHADOW_TOP_ENTRIES];
+    UINT8 *zeroes;
+};
@@ -0,0 +1,119 @@
+/*
+ * The compressed trace format, written by memtracker (-o <file> -z) and
+ * read by the tools in analysis-tools. The trace text is cut into frames
+ * of up to FRAME_SIZE bytes, at line boundaries, and every frame is
+ * compressed with zlib on its own. Frames can therefore be compressed
+ * and decompressed in parallel, and every frame can be parsed without
+ * looking at the others.
+ *
+ * File layout:
+ *
+ *   "\x89MTZ"
+ *   frame: raw length (4 bytes, little endian),
+ *          compressed length (4 bytes, little endian),
+ *          zlib stream
+ *   ...
+ *
+ * The first byte of the magic never starts a text trace, so a reader
+ * can tell the two apart by peeking at one byte.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <zlib.h>
+#include <istream>
+#include <string>
+
+#define FRAME_MAGIC "\x89MTZ"
+#define FRAME_MAGIC_LEN 4
+#define FRAME_HEADER_LEN 8
+
+/* How much trace text goes into a frame */
+#define FRAME_SIZE (1024 * 1024)
+
+/* Frames larger than this must be corrupt */
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
+
+typedef enum {
+    FRAME_OK,
+    FRAME_END,
+    FRAME_CORRUPT
+} frame_status_t;
+
+inline void putLE32(char *p, uint32_t value)
+{
+    for(int i = 0; i < 4; i++)
+	p[i] = (char)(value >> (8 * i));
+}
+
+inline uint32_t getLE32(const char *p)
+{
+    uint32_t value = 0;
+
+    for(int i = 0; i < 4; i++)
+	value |= (uint32_t)(uint8_t)p[i] << (8 * i);
+    return value;
+}
+
+/* Compress len bytes of the trace into a frame, with the header.
+ * Return false if zlib failed.
+ */
+inline bool compressFrame(const char *raw, size_t len, std::string &frame, int level)
+{
+    uLongf compressedLength = compressBound(len);
+
+    frame.resize(FRAME_HEADER_LEN + compressedLength);
+    if(compress2((Bytef*)&frame[FRAME_HEADER_LEN], &compressedLength,
+		 (const Bytef*)raw, len, level) != Z_OK)
+	return false;
+
+    putLE32(&frame[0], len);
+    putLE32(&frame[4], compressedLength);
+    frame.resize(FRAME_HEADER_LEN + compressedLength);
+    return true;
+}
+
+/* Decompress the body of a frame whose header said the
+ * trace text is rawLength bytes long.
+ */
+inline bool decompressFrame(const std::string &compressed, size_t rawLength,
+			    std::string &raw)
+{
+    uLongf len = rawLength;
+
+    raw.resize(rawLength);
+    return uncompress((Bytef*)&raw[0], &len, (const Bytef*)compressed.data(),
+		      compressed.length()) == Z_OK && len == rawLength;
+}
+
+/* Check the magic at the beginning of the trace */
+inline bool readFrameMagic(std::istream &in)
+{
+    char magic[FRAME_MAGIC_LEN];
+
+    return in.read(magic, FRAME_MAGIC_LEN)
+	&& std::string(magic, FRAME_MAGIC_LEN).compare(FRAME_MAGIC) == 0;
+}
+
+/* Read the next frame, without decompressing it */
+inline frame_status_t readFrame(std::istream &in, std::string &compressed,
+				size_t &rawLength)
+{
+    char header[FRAME_HEADER_LEN];
+
+    in.read(header, FRAME_HEADER_LEN);
+    if(in.gcount() == 0 && in.eof())
+	return FRAME_END;
+    if(in.gcount() != FRAME_HEADER_LEN)
+	return FRAME_CORRUPT;
+
+    rawLength = getLE32(&header[0]);
+    size_t compressedLength = getLE32(&header[4]);
+    if(rawLength > MAX_FRAME_SIZE || compressedLength > compressBound(MAX_FRAME_SIZE))
+	return FRAME_CORRUPT;
+
+    compressed.resize(compressedLength);
+    if(!in.read(&compressed[0], compressedLength))
+	return FRAME_CORRUPT;
+    return FRAME_OK;
+}
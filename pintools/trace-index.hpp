@@ -0,0 +1,203 @@
+/*
+ * The sidecar index of a trace, written by memtracker (-i) next to the
+ * trace, as <trace>.idx, and read by the analysis tools to seek to the
+ * part of the trace they are asked to analyze.
+ *
+ * The index has a checkpoint at the beginning of every frame of a text
+ * or compressed trace and of every block of a packed trace. A checkpoint
+ * gives the byte offset of the frame or block in the trace, the number
+ * of access records before it, the time at which memtracker finished
+ * it (in microseconds since the start of the trace) and the number of
+ * access records of every thread before it. The records of a frame or
+ * block were made before the time of its checkpoint. A tool can start
+ * reading the trace at any checkpoint.
+ *
+ * The blocks of a packed trace refer to site and variable definitions
+ * that may come earlier in the trace, so the index of a packed trace
+ * has a copy of the definitions as well.
+ *
+ * File layout (all integers are varints):
+ *
+ *   "MTIDX001"
+ *   'C' offset, records, time, number of threads, records of every thread
+ *   'S', 'V' site and variable definitions (see packed-trace.hpp)
+ *   ...
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "packed-trace.hpp"
+#include "varint.hpp"
+
+#define INDEX_MAGIC "MTIDX001"
+#define INDEX_MAGIC_LEN 8
+#define INDEX_SUFFIX ".idx"
+
+#define TAG_CHECKPOINT 'C'
+
+class Checkpoint
+{
+public:
+    uint64_t offset;
+    uint64_t records;
+    uint64_t time;
+    std::vector<uint64_t> threadRecords;
+};
+
+/* Microseconds since some point in the past */
+inline uint64_t indexClock()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Writes the index. The callers serialize the calls. */
+class TraceIndexWriter
+{
+public:
+    TraceIndexWriter()
+	: f(NULL), startTime(0) {}
+
+    /* Create the index for the trace in traceName */
+    bool open(const std::string &traceName)
+	{
+	    f = fopen((traceName + INDEX_SUFFIX).c_str(), "w");
+	    if(f == NULL)
+		return false;
+
+	    startTime = indexClock();
+	    return fwrite(INDEX_MAGIC, 1, INDEX_MAGIC_LEN, f) == INDEX_MAGIC_LEN;
+	}
+
+    /* The time for a checkpoint, relative to the start of the trace */
+    uint64_t now()
+	{
+	    return indexClock() - startTime;
+	}
+
+    void checkpoint(uint64_t offset, uint64_t records, uint64_t time,
+		    const std::vector<uint64_t> &threadRecords)
+	{
+	    rec.clear();
+	    rec.push_back(TAG_CHECKPOINT);
+	    putVarint(rec, offset);
+	    putVarint(rec, records);
+	    putVarint(rec, time);
+	    putVarint(rec, threadRecords.size());
+	    for(uint64_t r: threadRecords)
+		putVarint(rec, r);
+	    fwrite(rec.data(), 1, rec.length(), f);
+	}
+
+    /* Copy a site or variable definition of a packed trace */
+    void definition(const std::string &def)
+	{
+	    fwrite(def.data(), 1, def.length(), f);
+	}
+
+    bool close()
+	{
+	    return fclose(f) == 0;
+	}
+
+private:
+    FILE *f;
+    uint64_t startTime;
+    std::string rec;
+};
+
+class TraceIndex
+{
+public:
+    std::vector<Checkpoint> checkpoints;
+
+    /* Read the index of the trace in traceName. The definitions of a
+     * packed trace are handed to packed. Return false if there is no
+     * index or it is corrupt.
+     */
+    bool load(const std::string &traceName, PackedReader *packed = NULL)
+	{
+	    std::ifstream in((traceName + INDEX_SUFFIX).c_str(), std::ios::binary);
+	    char magic[INDEX_MAGIC_LEN];
+	    int tag;
+
+	    if(!in.read(magic, INDEX_MAGIC_LEN)
+	       || std::string(magic, INDEX_MAGIC_LEN).compare(INDEX_MAGIC) != 0)
+		return false;
+
+	    while((tag = in.get()) != EOF)
+	    {
+		if(tag == TAG_CHECKPOINT)
+		{
+		    Checkpoint cp;
+		    uint64_t numThreads;
+
+		    if(!readVarint(in, cp.offset) || !readVarint(in, cp.records)
+		       || !readVarint(in, cp.time) || !readVarint(in, numThreads)
+		       || numThreads > MAX_INDEX_THREADS)
+			return false;
+		    cp.threadRecords.resize(numThreads);
+		    for(uint64_t &r: cp.threadRecords)
+			if(!readVarint(in, r))
+			    return false;
+		    checkpoints.push_back(cp);
+		}
+		else if(packed == NULL || !packed->readDefinition(in, tag))
+		    return false;
+	    }
+	    return true;
+	}
+
+    /* The last checkpoint at or before the given record.
+     * Return NULL if there is none.
+     */
+    const Checkpoint *findRecord(uint64_t record) const
+	{
+	    const Checkpoint *found = NULL;
+
+	    for(const Checkpoint &cp: checkpoints)
+	    {
+		if(cp.records > record)
+		    break;
+		found = &cp;
+	    }
+	    return found;
+	}
+
+    /* The first record of the first frame or block finished at or after
+     * the given time, or NO_RECORD if the trace was over by then.
+     */
+    uint64_t recordAt(uint64_t time) const
+	{
+	    for(const Checkpoint &cp: checkpoints)
+		if(cp.time >= time)
+		    return cp.records;
+	    return NO_RECORD;
+	}
+
+    /* The first record after the first frame or block finished at or
+     * after the given time, or NO_RECORD if the trace was over by then.
+     * Every record made before that time comes before this one.
+     */
+    uint64_t recordAfter(uint64_t time) const
+	{
+	    for(size_t i = 0; i < checkpoints.size(); i++)
+		if(checkpoints[i].time >= time)
+		    return i + 1 < checkpoints.size() ?
+			checkpoints[i + 1].records : NO_RECORD;
+	    return NO_RECORD;
+	}
+
+    static const uint64_t NO_RECORD = ~(uint64_t)0;
+
+private:
+    enum { MAX_INDEX_THREADS = 1 << 20 };
+};
@@ -0,0 +1,331 @@
+/*
+ * A stream buffer that writes the trace to a file in compressed frames
+ * (see trace-frames.hpp). memtracker installs it under cout, so the
+ * trace records are written as usual and just end up compressed.
+ *
+ * The application threads only copy the trace text into a buffer. When
+ * the buffer fills up, its complete lines are queued as a frame and
+ * compressed by a small pool of Pin internal threads, off the critical
+ * path of the application. Frames are written out in the order they were
+ * queued. If the compression threads fall behind, the application thread
+ * that fills the buffer waits until there is room in the queue, so the
+ * memory used by the queue stays bounded.
+ *
+ * Without compression the frames are written as they are, with no magic,
+ * so the file is an ordinary text trace. With an index (see
+ * trace-index.hpp), a checkpoint is added to it for every frame written.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <map>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "pin.H"
+#include "trace-frames.hpp"
+#include "trace-index.hpp"
+
+class FramedTraceBuf : public std::streambuf
+{
+public:
+    FramedTraceBuf()
+	: out(NULL), level(Z_BEST_SPEED), compress(true), index(NULL),
+	  nextSeq(0), nextToWrite(0), inFlight(0), maxInFlight(0),
+	  shuttingDown(false), failed(false), offset(0), records(0) {}
+
+    /* Create the file and start numThreads compression threads. The
+     * checkpoints go to index, unless it is NULL.
+     * Must be called from main(), before the application starts.
+     */
+    bool open(const char *fname, int numThreads, bool compress,
+	      TraceIndexWriter *index)
+	{
+	    this->compress = compress;
+	    this->index = index;
+
+	    out = fopen(fname, "w");
+	    if(out == NULL)
+		return false;
+	    if(compress)
+	    {
+		if(fwrite(FRAME_MAGIC, 1, FRAME_MAGIC_LEN, out) != FRAME_MAGIC_LEN)
+		    return false;
+		offset = FRAME_MAGIC_LEN;
+	    }
+
+	    PIN_MutexInit(&m);
+	    PIN_SemaphoreInit(&workReady);
+	    PIN_SemaphoreInit(&spaceReady);
+
+	    buf.resize(FRAME_SIZE);
+	    setp(&buf[0], &buf[0] + buf.size());
+
+	    maxInFlight = 2 * numThreads + 2;
+	    for(int i = 0; i < numThreads; i++)
+	    {
+		PIN_THREAD_UID uid;
+
+		if(PIN_SpawnInternalThread(compressThread, this, 0, &uid)
+		   == INVALID_THREADID)
+		    return false;
+		workers.push_back(uid);
+	    }
+	    return true;
+	}
+
+    /* Let the compression threads finish the queued frames and wait
+     * for them to exit. Pin kills the internal threads once the tool's
+     * Fini starts, possibly in the middle of a frame or with m held, so
+     * this must be called before that, from a PrepareForFini callback.
+     * The frames queued after this are compressed by the thread that
+     * queues them.
+     */
+    void stopWorkers()
+	{
+	    PIN_MutexLock(&m);
+	    shuttingDown = true;
+	    PIN_SemaphoreSet(&workReady);
+	    PIN_SemaphoreSet(&spaceReady);
+	    PIN_MutexUnlock(&m);
+
+	    for(PIN_THREAD_UID uid: workers)
+		PIN_WaitForThreadTermination(uid, PIN_INFINITE_TIMEOUT, NULL);
+	    workers.clear();
+	}
+
+    /* Write what is left in the buffer and close the file. Return false
+     * if we failed to compress or write any of the frames.
+     */
+    bool close()
+	{
+	    stopWorkers();
+	    submit(pbase(), pptr() - pbase());
+	    setp(&buf[0], &buf[0] + buf.size());
+
+	    if(fclose(out) != 0)
+		failed = true;
+	    return !failed && done.empty();
+	}
+
+protected:
+    /* The buffer is full. Queue its complete lines as a frame,
+     * and move the incomplete last line to the front.
+     */
+    int overflow(int c)
+	{
+	    char *begin = pbase(), *end = pptr(), *cut = end;
+
+	    for(char *p = end; p > begin; p--)
+	    {
+		if(p[-1] == '\n')
+		{
+		    cut = p;
+		    break;
+		}
+	    }
+
+	    submit(begin, cut - begin);
+
+	    size_t rest = end - cut;
+	    memmove(begin, cut, rest);
+	    setp(begin, begin + buf.size());
+	    pbump(rest);
+
+	    if(c != traits_type::eof())
+	    {
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	    }
+	    return traits_type::not_eof(c);
+	}
+
+    /* memtracker flushes cout after every record. We don't want a frame
+     * per record, so the buffer is only written out when it fills up.
+     */
+    int sync()
+	{
+	    return 0;
+	}
+
+private:
+    class Job
+    {
+    public:
+	size_t seq;
+	uint64_t time;
+	std::string raw;
+    };
+
+    /* A frame waiting for its turn to be written */
+    class Frame
+    {
+    public:
+	std::string data;
+	uint64_t time;
+	uint64_t records;
+	std::vector<uint64_t> threadRecords;
+    };
+
+    FILE *out;
+    int level;
+    bool compress;
+    TraceIndexWriter *index;
+    std::vector<char> buf;
+    std::vector<PIN_THREAD_UID> workers;
+
+    /* Protected by m */
+    std::deque<Job> jobs;
+    std::map<size_t, Frame> done;
+    size_t nextSeq, nextToWrite;
+    size_t inFlight, maxInFlight;
+    bool shuttingDown;
+    bool failed;
+    uint64_t offset, records;  /* written so far, for the index */
+    std::vector<uint64_t> threadRecords;
+
+    PIN_MUTEX m;
+    PIN_SEMAPHORE workReady, spaceReady;
+
+    static VOID compressThread(VOID *arg)
+	{
+	    ((FramedTraceBuf*)arg)->compressFrames();
+	}
+
+    void submit(const char *p, size_t len)
+	{
+	    if(len == 0)
+		return;
+
+	    PIN_MutexLock(&m);
+	    while(inFlight >= maxInFlight && !shuttingDown)
+	    {
+		PIN_SemaphoreClear(&spaceReady);
+		PIN_MutexUnlock(&m);
+		PIN_SemaphoreWait(&spaceReady);
+		PIN_MutexLock(&m);
+	    }
+
+	    jobs.push_back(Job());
+	    jobs.back().seq = nextSeq++;
+	    jobs.back().time = index ? index->now() : 0;
+	    jobs.back().raw.assign(p, len);
+	    inFlight++;
+	    PIN_SemaphoreSet(&workReady);
+	    PIN_MutexUnlock(&m);
+
+	    /* Nobody else is left to compress it */
+	    if(shuttingDown)
+		compressFrames();
+	}
+
+    void compressFrames()
+	{
+	    Job job;
+	    Frame frame;
+
+	    PIN_MutexLock(&m);
+	    while(true)
+	    {
+		if(jobs.empty())
+		{
+		    if(shuttingDown)
+			break;
+
+		    PIN_SemaphoreClear(&workReady);
+		    PIN_MutexUnlock(&m);
+		    PIN_SemaphoreWait(&workReady);
+		    PIN_MutexLock(&m);
+		    continue;
+		}
+
+		job.seq = jobs.front().seq;
+		job.time = jobs.front().time;
+		job.raw.swap(jobs.front().raw);
+		jobs.pop_front();
+		PIN_MutexUnlock(&m);
+
+		bool ok = true;
+		if(compress)
+		    ok = compressFrame(job.raw.data(), job.raw.length(), frame.data, level);
+		else
+		    frame.data.swap(job.raw);
+		frame.time = job.time;
+		if(index)
+		    countRecords(compress ? job.raw : frame.data, frame);
+
+		PIN_MutexLock(&m);
+		if(!ok)
+		    failed = true;
+		std::swap(done[job.seq], frame);
+		writeReadyFrames();
+	    }
+	    PIN_MutexUnlock(&m);
+	}
+
+    /* Count the access records of the frame, in total and per thread */
+    static void countRecords(const std::string &text, Frame &frame)
+	{
+	    const char *p = text.c_str(), *end = p + text.length();
+
+	    frame.records = 0;
+	    frame.threadRecords.clear();
+	    while(p < end)
+	    {
+		const char *nl = (const char*)memchr(p, '\n', end - p);
+		const char *tid = NULL;
+
+		if(nl == NULL)
+		    nl = end;
+		if(strncmp(p, "read: ", 6) == 0)
+		    tid = p + 6;
+		else if(strncmp(p, "write: ", 7) == 0)
+		    tid = p + 7;
+
+		if(tid != NULL)
+		{
+		    size_t t = strtoul(tid, NULL, 10);
+
+		    if(frame.threadRecords.size() <= t)
+			frame.threadRecords.resize(t + 1);
+		    frame.threadRecords[t]++;
+		    frame.records++;
+		}
+		p = nl + 1;
+	    }
+	}
+
+    /* Write out the frames that are next in line. Called with m held. */
+    void writeReadyFrames()
+	{
+	    std::map<size_t, Frame>::iterator it;
+
+	    while((it = done.find(nextToWrite)) != done.end())
+	    {
+		Frame &frame = it->second;
+
+		if(index)
+		{
+		    index->checkpoint(offset, records, frame.time, threadRecords);
+		    records += frame.records;
+		    if(threadRecords.size() < frame.threadRecords.size())
+			threadRecords.resize(frame.threadRecords.size());
+		    for(size_t t = 0; t < frame.threadRecords.size(); t++)
+			threadRecords[t] += frame.threadRecords[t];
+		}
+
+		if(fwrite(frame.data.data(), 1, frame.data.length(), out)
+		   != frame.data.length())
+		    failed = true;
+		offset += frame.data.length();
+		done.erase(it);
+		nextToWrite++;
+		inFlight--;
+	    }
+	    PIN_SemaphoreSet(&spaceReady);
+	}
+};
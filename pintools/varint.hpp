@@ -0,0 +1,93 @@
+/*
+ * Variable-length integer encoding shared by the binary trace formats
+ * and their readers in analysis-tools. An integer is stored seven bits
+ * at a time, least significant first, with the high bit of every byte
+ * set if more bytes follow. Signed values (e.g., address deltas) are
+ * zig-zag encoded first, so that small negative numbers stay short.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <istream>
+#include <string>
+
+inline void putVarint(std::string &buf, uint64_t value)
+{
+    while(value >= 0x80)
+    {
+	buf.push_back((char)(value | 0x80));
+	value >>= 7;
+    }
+    buf.push_back((char)value);
+}
+
+/* Decode a varint at p and advance p past it.
+ * Return false if the buffer ends in the middle of the varint.
+ */
+inline bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &value)
+{
+    value = 0;
+    for(int shift = 0; p < end && shift < 64; shift += 7)
+    {
+	uint8_t byte = *p++;
+
+	value |= (uint64_t)(byte & 0x7f) << shift;
+	if(!(byte & 0x80))
+	    return true;
+    }
+    return false;
+}
+
+inline uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+inline void putString(std::string &buf, const std::string &s)
+{
+    putVarint(buf, s.length());
+    buf += s;
+}
+
+inline bool getString(const uint8_t *&p, const uint8_t *end, std::string &s)
+{
+    uint64_t len;
+
+    if(!getVarint(p, end, len) || len > (uint64_t)(end - p))
+	return false;
+    s.assign((const char*)p, len);
+    p += len;
+    return true;
+}
+
+/* The same, reading from a stream */
+inline bool readVarint(std::istream &in, uint64_t &value)
+{
+    value = 0;
+    for(int shift = 0; shift < 64; shift += 7)
+    {
+	int byte = in.get();
+
+	if(byte == EOF)
+	    return false;
+	value |= (uint64_t)(byte & 0x7f) << shift;
+	if(!(byte & 0x80))
+	    return true;
+    }
+    return false;
+}
+
+inline bool readString(std::istream &in, std::string &s, uint64_t maxLength)
+{
+    uint64_t len;
+
+    if(!readVarint(in, len) || len > maxLength)
+	return false;
+    s.resize(len);
+    return len == 0 || in.read(&s[0], len);
+}